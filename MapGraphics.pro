@@ -1,6 +1,8 @@
 TEMPLATE = subdirs
 
 SUBDIRS += MapGraphics \
-    TestApp
+    TestApp \
+    PackBuilder
 
 TestApp.depends += MapGraphics
+PackBuilder.depends += MapGraphics
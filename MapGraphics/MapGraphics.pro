@@ -34,7 +34,30 @@ SOURCES += MapGraphicsScene.cpp \
     guts/PrivateQGraphicsInfoSource.cpp \
     PolygonObject.cpp \
     Position.cpp \
-    LineObject.cpp
+    LineObject.cpp \
+    TileKey.cpp \
+    MapTile.cpp \
+    MapTilePrefetcher.cpp \
+    MapTileMetrics.cpp \
+    tileCaches/MapTileCacheTier.cpp \
+    tileCaches/MapTileCache.cpp \
+    tileCaches/MemoryTileCache.cpp \
+    tileCaches/DiskTileCache.cpp \
+    tileCaches/FileTreeDiskTileCache.cpp \
+    tileCaches/SQLiteDiskTileCache.cpp \
+    tileCaches/TileExpirationIndex.cpp \
+    tileCaches/DiskCacheJanitor.cpp \
+    tileCaches/TileCacheRegistry.cpp \
+    tileCaches/SharedMemoryTileCache.cpp \
+    tileCaches/NegativeTileCache.cpp \
+    tileCaches/TilePack.cpp \
+    tileCaches/TilePackBuilder.cpp \
+    tileSources/PackTileSource.cpp \
+    guts/TileWorkerPool.cpp \
+    guts/TileWorkerTasks.cpp \
+    guts/TileMetricsRecorder.cpp \
+    guts/TileDeliveryDispatcher.cpp \
+    guts/MotionTilePrefetcher.cpp
 
 HEADERS += MapGraphicsScene.h\
         MapGraphics_global.h \
@@ -57,7 +80,30 @@ HEADERS += MapGraphicsScene.h\
     guts/PrivateQGraphicsInfoSource.h \
     PolygonObject.h \
     Position.h \
-    LineObject.h
+    LineObject.h \
+    TileKey.h \
+    MapTile.h \
+    MapTilePrefetcher.h \
+    MapTileMetrics.h \
+    tileCaches/MapTileCacheTier.h \
+    tileCaches/MapTileCache.h \
+    tileCaches/MemoryTileCache.h \
+    tileCaches/DiskTileCache.h \
+    tileCaches/FileTreeDiskTileCache.h \
+    tileCaches/SQLiteDiskTileCache.h \
+    tileCaches/TileExpirationIndex.h \
+    tileCaches/DiskCacheJanitor.h \
+    tileCaches/TileCacheRegistry.h \
+    tileCaches/SharedMemoryTileCache.h \
+    tileCaches/NegativeTileCache.h \
+    tileCaches/TilePack.h \
+    tileCaches/TilePackBuilder.h \
+    tileSources/PackTileSource.h \
+    guts/TileWorkerPool.h \
+    guts/TileWorkerTasks.h \
+    guts/TileMetricsRecorder.h \
+    guts/TileDeliveryDispatcher.h \
+    guts/MotionTilePrefetcher.h
 
 symbian {
     MMP_RULES += EXPORTUNFROZEN
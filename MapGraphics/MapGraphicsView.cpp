@@ -229,6 +229,7 @@ QSharedPointer<MapTileSource> MapGraphicsView::tileSource() const
 void MapGraphicsView::setTileSource(QSharedPointer<MapTileSource> tSource)
 {
     _tileSource = tSource;
+    _motionPrefetcher.setTileSource(tSource);
 
     if (!_tileSource.isNull())
     {
@@ -421,10 +422,21 @@ void MapGraphicsView::doTileLayout()
     const QPolygonF viewportPolygonQGS = _childView->mapToScene(viewportPolygonQGV);
     const QRectF boundingRect = viewportPolygonQGS.boundingRect();
 
+    //Tiles near the center get served first, including the ones we're about to request
+    _tileSource->setRequestFocus(centerPointQGS, this->zoomLevel());
+
+    //Tiles ahead of a pan come next, after everything we lay out here
+    _motionPrefetcher.update(boundingRect, this->zoomLevel());
+
+    //The faster we pan, the more tiles we lay out around the viewport
+    const quint16 tileSize = _tileSource->tileSize();
+    const qint32 overscan = _motionPrefetcher.overscanTiles();
+
     //We exaggerate the bounding rect for some purposes!
     QRectF exaggeratedBoundingRect = boundingRect;
     exaggeratedBoundingRect.setSize(boundingRect.size()*2.0);
     exaggeratedBoundingRect.moveCenter(boundingRect.center());
+    exaggeratedBoundingRect.adjust(-overscan*tileSize, -overscan*tileSize, overscan*tileSize, overscan*tileSize);
 
     //We'll mark tiles that aren't being displayed as free so we can use them
     QQueue<MapTileGraphicsObject *> freeTiles;
@@ -441,12 +453,11 @@ void MapGraphicsView::doTileLayout()
             placesWhereTilesAre.insert(tileObject->pos());
     }
 
-    const quint16 tileSize = _tileSource->tileSize();
     const quint32 tilesPerRow = sqrt((long double)_tileSource->tilesOnZoomLevel(this->zoomLevel()));
     const quint32 tilesPerCol = tilesPerRow;
 
     const qint32 perSide = qMax(boundingRect.width()/tileSize,
-                       boundingRect.height()/tileSize) + 3;
+                       boundingRect.height()/tileSize) + 3 + 2*overscan;
     const qint32 xc = qMax((qint32)0,
                      (qint32)(centerPointQGS.x() / tileSize) - perSide/2);
     const qint32 yc = qMax((qint32)0,
@@ -18,6 +18,7 @@
 #include "MapGraphics_global.h"
 
 #include "guts/MapTileGraphicsObject.h"
+#include "guts/MotionTilePrefetcher.h"
 #include "guts/PrivateQGraphicsInfoSource.h"
 
 class MAPGRAPHICSSHARED_EXPORT MapGraphicsView : public QWidget, public PrivateQGraphicsInfoSource
@@ -102,6 +103,9 @@ private:
 
     QSet<MapTileGraphicsObject *> _tileObjects;
 
+    //Fetches the tiles we're panning towards before they come into view
+    MotionTilePrefetcher _motionPrefetcher;
+
     quint8 _zoomLevel;
 
     DragMode _dragMode;
@@ -0,0 +1,99 @@
+#include "MapTile.h"
+
+class MapTileData : public QSharedData
+{
+public:
+    TileKey key;
+    QImage image;
+    QDateTime expireTime;
+    bool provisional;
+};
+
+MapTile::MapTile() :
+    d(new MapTileData())
+{
+    d->provisional = false;
+}
+
+MapTile::MapTile(const TileKey &key, const QImage &image, const QDateTime &expireTime, bool provisional) :
+    d(new MapTileData())
+{
+    d->key = key;
+    d->image = image;
+    d->expireTime = expireTime;
+    d->provisional = provisional;
+}
+
+MapTile::MapTile(const MapTile &other) :
+    d(other.d)
+{
+}
+
+MapTile::~MapTile()
+{
+}
+
+MapTile &MapTile::operator =(const MapTile &other)
+{
+    d = other.d;
+    return *this;
+}
+
+bool MapTile::isNull() const
+{
+    return d->image.isNull();
+}
+
+TileKey MapTile::key() const
+{
+    return d->key;
+}
+
+quint32 MapTile::x() const
+{
+    return d->key.x();
+}
+
+quint32 MapTile::y() const
+{
+    return d->key.y();
+}
+
+quint8 MapTile::z() const
+{
+    return d->key.z();
+}
+
+const QImage &MapTile::image() const
+{
+    return d->image;
+}
+
+QDateTime MapTile::expireTime() const
+{
+    return d->expireTime;
+}
+
+bool MapTile::isExpired(const QDateTime &now) const
+{
+    return !d->expireTime.isNull() && now.secsTo(d->expireTime) <= 0;
+}
+
+bool MapTile::isProvisional() const
+{
+    return d->provisional;
+}
+
+//static
+QImage MapTile::toPaintFormat(const QImage &image)
+{
+    //These are the formats the raster paint engine blends straight from
+    if (image.isNull()
+            || image.format() == QImage::Format_ARGB32_Premultiplied
+            || image.format() == QImage::Format_RGB32)
+        return image;
+
+    //Paletted PNGs and the like would otherwise be converted every time the tile is painted
+    return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied
+                                                         : QImage::Format_RGB32);
+}
@@ -0,0 +1,93 @@
+#ifndef MAPTILE_H
+#define MAPTILE_H
+
+#include <QDateTime>
+#include <QImage>
+#include <QMetaType>
+#include <QSharedDataPointer>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+class MapTileData;
+
+/**
+ * @brief Handle to a retrieved tile: its key, its image and when it expires. MapTile is implicitly shared,
+ * so passing one around (in signals, between threads, from a child source to a CompositeTileSource to
+ * the view) only bumps a reference count. Every holder sees the same pixels, and nobody has to delete
+ * anything.
+ */
+class MAPGRAPHICSSHARED_EXPORT MapTile
+{
+public:
+    /**
+     * @brief Constructs a null tile
+     */
+    MapTile();
+    MapTile(const TileKey& key, const QImage& image, const QDateTime& expireTime = QDateTime(),
+            bool provisional = false);
+    MapTile(const MapTile& other);
+    ~MapTile();
+
+    MapTile& operator =(const MapTile& other);
+
+    /**
+     * @brief Returns true if the tile has no image
+     *
+     * @return bool
+     */
+    bool isNull() const;
+
+    TileKey key() const;
+    quint32 x() const;
+    quint32 y() const;
+    quint8 z() const;
+
+    /**
+     * @brief Returns the tile's image. The pixels are shared with every other copy of the tile.
+     *
+     * @return const QImage &
+     */
+    const QImage& image() const;
+
+    /**
+     * @brief Returns the time after which the tile should be re-requested. May be null if unknown.
+     *
+     * @return QDateTime
+     */
+    QDateTime expireTime() const;
+
+    /**
+     * @brief Returns true if the tile expired at or before now. An expired tile is only handed out while a
+     * fresh copy is on its way (see MapTileSource::setStaleWhileRevalidate()), so a client showing it should
+     * keep listening for the same tile. Tiles with an unknown expiration never expire.
+     *
+     * @param now
+     * @return bool
+     */
+    bool isExpired(const QDateTime& now = QDateTime::currentDateTimeUtc()) const;
+
+    /**
+     * @brief Returns true if the tile is a stand-in that the source put together from tiles it already had
+     * (for instance, by shrinking the cached tiles of the next zoom level in) while the real one is fetched.
+     * A client showing it should keep listening for the same tile. Provisional tiles are never cached.
+     *
+     * @return bool
+     */
+    bool isProvisional() const;
+
+    /**
+     * @brief Returns image, converted (if needed) to a format that QPainter can draw without converting
+     * it again on every paint. Tile sources call this once per tile, off the GUI thread.
+     *
+     * @param image
+     * @return QImage
+     */
+    static QImage toPaintFormat(const QImage& image);
+
+private:
+    QSharedDataPointer<MapTileData> d;
+};
+Q_DECLARE_METATYPE(MapTile)
+
+#endif // MAPTILE_H
@@ -0,0 +1,113 @@
+#include "MapTileMetrics.h"
+
+MapTileMetrics::Histogram::Histogram() :
+    _count(0), _totalMSecs(0), _maxMSecs(0)
+{
+    for (int i = 0; i < BucketCount; i++)
+        _buckets[i] = 0;
+}
+
+void MapTileMetrics::Histogram::record(qint64 msecs)
+{
+    msecs = qMax<qint64>(0, msecs);
+
+    //The bucket is the number of bits needed for the sample
+    int index = 0;
+    while (index < BucketCount - 1 && (msecs >> index) > 0)
+        index++;
+
+    _buckets[index]++;
+    _count++;
+    _totalMSecs += msecs;
+    _maxMSecs = qMax(_maxMSecs, msecs);
+}
+
+void MapTileMetrics::Histogram::merge(const MapTileMetrics::Histogram &other)
+{
+    for (int i = 0; i < BucketCount; i++)
+        _buckets[i] += other._buckets[i];
+    _count += other._count;
+    _totalMSecs += other._totalMSecs;
+    _maxMSecs = qMax(_maxMSecs, other._maxMSecs);
+}
+
+quint64 MapTileMetrics::Histogram::count() const
+{
+    return _count;
+}
+
+qint64 MapTileMetrics::Histogram::totalMSecs() const
+{
+    return _totalMSecs;
+}
+
+qint64 MapTileMetrics::Histogram::maxMSecs() const
+{
+    return _maxMSecs;
+}
+
+qreal MapTileMetrics::Histogram::meanMSecs() const
+{
+    if (_count == 0)
+        return 0.0;
+    return qreal(_totalMSecs) / _count;
+}
+
+quint64 MapTileMetrics::Histogram::bucket(int index) const
+{
+    if (index < 0 || index >= BucketCount)
+        return 0;
+    return _buckets[index];
+}
+
+qint64 MapTileMetrics::Histogram::bucketLimit(int index) const
+{
+    if (index >= BucketCount - 1)
+        return _maxMSecs;
+    return qint64(1) << qMax(0, index);
+}
+
+qint64 MapTileMetrics::Histogram::percentile(qreal percent) const
+{
+    if (_count == 0)
+        return 0;
+
+    const quint64 wanted = qMax<quint64>(1, quint64(qBound<qreal>(0.0, percent, 100.0) / 100.0 * _count + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; i++)
+    {
+        seen += _buckets[i];
+        if (seen >= wanted)
+            return qMin(this->bucketLimit(i), _maxMSecs);
+    }
+    return _maxMSecs;
+}
+
+MapTileMetrics::MapTileMetrics() :
+    requests(0), cacheHits(0), fetches(0), received(0), failures(0), blocked(0), cancelled(0), coalesced(0), bytesReceived(0), inFlight(0)
+{
+}
+
+void MapTileMetrics::merge(const MapTileMetrics &other)
+{
+    requests += other.requests;
+    cacheHits += other.cacheHits;
+    fetches += other.fetches;
+    received += other.received;
+    failures += other.failures;
+    blocked += other.blocked;
+    cancelled += other.cancelled;
+    coalesced += other.coalesced;
+    bytesReceived += other.bytesReceived;
+    inFlight += other.inFlight;
+    tiers.append(other.tiers);
+    for (int i = 0; i < StageCount; i++)
+        latencies[i].merge(other.latencies[i]);
+}
+
+qreal MapTileMetrics::hitRate() const
+{
+    if (requests == 0)
+        return 0.0;
+    return qreal(cacheHits) / requests;
+}
@@ -0,0 +1,142 @@
+#ifndef MAPTILEMETRICS_H
+#define MAPTILEMETRICS_H
+
+#include <QList>
+#include <QString>
+#include <QtGlobal>
+
+#include "MapGraphics_global.h"
+
+/**
+ * @brief Snapshot of what a MapTileSource (and, for a CompositeTileSource, its children) has been doing
+ * since it was created or its metrics were last reset: how requests were served, how often each cache tier
+ * had the tile, how much was downloaded, and how long each stage of the pipeline took. See
+ * MapTileSource::metrics().
+ */
+class MAPGRAPHICSSHARED_EXPORT MapTileMetrics
+{
+public:
+    /**
+     * @brief The stages of a tile request whose latencies are recorded
+     */
+    enum Stage
+    {
+        //From the request to the end of the cache lookup, hit or miss
+        CacheLookup,
+        //From asking the source to fetch the tile to it arriving (or failing)
+        Network,
+        //Decoding a newly-received tile
+        Decode,
+        //From the request to the tile being handed to the client
+        Delivery,
+        StageCount
+    };
+
+    /**
+     * @brief Latency histogram with power-of-two millisecond buckets: bucket 0 counts samples under 1 ms,
+     * bucket i counts samples from 2^(i-1) up to 2^i ms, and the last bucket counts everything longer.
+     */
+    class MAPGRAPHICSSHARED_EXPORT Histogram
+    {
+    public:
+        enum
+        {
+            BucketCount = 20
+        };
+
+    public:
+        Histogram();
+
+        void record(qint64 msecs);
+        void merge(const MapTileMetrics::Histogram& other);
+
+        quint64 count() const;
+        qint64 totalMSecs() const;
+        qint64 maxMSecs() const;
+        qreal meanMSecs() const;
+        quint64 bucket(int index) const;
+
+        /**
+         * @brief Returns the exclusive upper bound, in ms, of a bucket. The last bucket has none, so the
+         * largest sample is returned for it.
+         *
+         * @param index
+         * @return qint64
+         */
+        qint64 bucketLimit(int index) const;
+
+        /**
+         * @brief Returns an upper bound on the given percentile (0 to 100) in ms, good to within a factor
+         * of two. Returns 0 if nothing has been recorded.
+         *
+         * @param percent
+         * @return qint64
+         */
+        qint64 percentile(qreal percent) const;
+
+    private:
+        quint64 _buckets[BucketCount];
+        quint64 _count;
+        qint64 _totalMSecs;
+        qint64 _maxMSecs;
+    };
+
+    /**
+     * @brief Lookups made in one cache tier of one source
+     */
+    struct TierCounters
+    {
+        TierCounters() : hits(0), misses(0) {}
+
+        QString source;
+        QString tier;
+        quint64 hits;
+        quint64 misses;
+    };
+
+public:
+    MapTileMetrics();
+
+    /**
+     * @brief Adds another source's metrics to these. Counters and histograms are summed, and the other
+     * source's tiers are listed after ours.
+     *
+     * @param other
+     */
+    void merge(const MapTileMetrics& other);
+
+    /**
+     * @brief Returns the fraction (0 to 1) of requests served from the cache
+     *
+     * @return qreal
+     */
+    qreal hitRate() const;
+
+    //Tiles requested with requestTile(), and how many of those the cache had
+    quint64 requests;
+    quint64 cacheHits;
+
+    //Tiles that were fetched (or generated), received, and failed. Blocked ones weren't tried because they
+    //had failed recently.
+    quint64 fetches;
+    quint64 received;
+    quint64 failures;
+    quint64 blocked;
+
+    //Requests that were cancelled with cancelTile() before they were answered
+    quint64 cancelled;
+
+    //Requests and fetches that joined one already underway for the same tile instead of starting another
+    quint64 coalesced;
+
+    //Encoded bytes of the tiles received
+    quint64 bytesReceived;
+
+    //Requests that haven't been answered yet
+    int inFlight;
+
+    QList<MapTileMetrics::TierCounters> tiers;
+    MapTileMetrics::Histogram latencies[StageCount];
+};
+
+#endif // MAPTILEMETRICS_H
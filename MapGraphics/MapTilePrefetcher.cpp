@@ -0,0 +1,441 @@
+#include "MapTilePrefetcher.h"
+
+#include <cmath>
+#include <QTimer>
+#include <QtDebug>
+
+//Web mercator stops short of the poles
+const qreal MAX_LATITUDE = 85.05112878;
+
+const qreal DEFAULT_REQUESTS_PER_SECOND = 2.0;
+const int DEFAULT_MAX_CONCURRENT_REQUESTS = 2;
+
+//How many tiles (or empty columns) nextTile() looks at in one go before letting the event loop run
+const int MAX_TILES_TESTED_PER_CALL = 1024;
+
+MapTilePrefetcher::MapTilePrefetcher(QSharedPointer<MapTileSource> source, QObject *parent) :
+    QObject(parent), _source(source), _state(Idle), _wholeBox(true), _minZoom(0), _maxZoom(0), _z(0), _x(0),
+    _y(0), _xFirst(0), _xLast(0), _yFirst(0), _yLast(0), _columnLast(0), _walkDone(true),
+    _requestsPerSecond(DEFAULT_REQUESTS_PER_SECOND), _tokens(0.0),
+    _maxConcurrent(DEFAULT_MAX_CONCURRENT_REQUESTS), _total(0), _completed(0), _downloaded(0), _failed(0),
+    _bytes(0)
+{
+    _pumpTimer = new QTimer(this);
+    _pumpTimer->setSingleShot(true);
+    connect(_pumpTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(requestMoreTiles()));
+
+    if (_source.isNull())
+        return;
+
+    //The source usually lives in another thread, so these are queued
+    connect(_source.data(),
+            SIGNAL(tilePrefetched(quint32,quint32,quint8,bool,quint64)),
+            this,
+            SLOT(handleTilePrefetched(quint32,quint32,quint8,bool,quint64)));
+    connect(_source.data(),
+            SIGNAL(tileFailed(quint32,quint32,quint8)),
+            this,
+            SLOT(handleTileFailed(quint32,quint32,quint8)));
+
+    if (_source->cacheMode() != MapTileSource::DiskAndMemCaching)
+        qWarning() << "Prefetching from" << _source->name() << "which doesn't cache tiles";
+}
+
+MapTilePrefetcher::~MapTilePrefetcher()
+{
+}
+
+QSharedPointer<MapTileSource> MapTilePrefetcher::tileSource() const
+{
+    return _source;
+}
+
+void MapTilePrefetcher::prefetch(const QRectF &lonLatBox, quint8 minZoom, quint8 maxZoom)
+{
+    this->start(QPolygonF(lonLatBox.normalized()), minZoom, maxZoom, true);
+}
+
+void MapTilePrefetcher::prefetch(const QPolygonF &lonLatPolygon, quint8 minZoom, quint8 maxZoom)
+{
+    this->start(lonLatPolygon, minZoom, maxZoom, false);
+}
+
+void MapTilePrefetcher::pause()
+{
+    if (_state != Running)
+        return;
+
+    _pumpTimer->stop();
+    this->setState(Paused);
+}
+
+void MapTilePrefetcher::resume()
+{
+    if (_state != Paused)
+        return;
+
+    //Time spent paused doesn't earn a burst of requests
+    _tokenClock.restart();
+    this->setState(Running);
+    this->requestMoreTiles();
+}
+
+void MapTilePrefetcher::cancel()
+{
+    _pumpTimer->stop();
+    _inFlight.clear();
+    _walkDone = true;
+    this->setState(Idle);
+}
+
+MapTilePrefetcher::State MapTilePrefetcher::state() const
+{
+    return _state;
+}
+
+qreal MapTilePrefetcher::requestsPerSecond() const
+{
+    return _requestsPerSecond;
+}
+
+void MapTilePrefetcher::setRequestsPerSecond(qreal rate)
+{
+    _requestsPerSecond = qMax<qreal>(0.0, rate);
+    _tokens = qMin<qreal>(_tokens, qMax<qreal>(1.0, _requestsPerSecond));
+
+    if (_state == Running)
+        this->requestMoreTiles();
+}
+
+int MapTilePrefetcher::maximumConcurrentRequests() const
+{
+    return _maxConcurrent;
+}
+
+void MapTilePrefetcher::setMaximumConcurrentRequests(int count)
+{
+    _maxConcurrent = qMax(1, count);
+
+    if (_state == Running)
+        this->requestMoreTiles();
+}
+
+quint64 MapTilePrefetcher::totalTiles() const
+{
+    return _total;
+}
+
+quint64 MapTilePrefetcher::completedTiles() const
+{
+    return _completed;
+}
+
+quint64 MapTilePrefetcher::downloadedTiles() const
+{
+    return _downloaded;
+}
+
+quint64 MapTilePrefetcher::failedTiles() const
+{
+    return _failed;
+}
+
+quint64 MapTilePrefetcher::bytesDownloaded() const
+{
+    return _bytes;
+}
+
+//private slot
+void MapTilePrefetcher::handleTilePrefetched(quint32 x, quint32 y, quint8 z, bool downloaded, quint64 bytes)
+{
+    this->finishTile(TileKey(x,y,z), downloaded, false, bytes);
+}
+
+//private slot
+void MapTilePrefetcher::handleTileFailed(quint32 x, quint32 y, quint8 z)
+{
+    this->finishTile(TileKey(x,y,z), false, true, 0);
+}
+
+//private slot
+void MapTilePrefetcher::requestMoreTiles()
+{
+    if (_state != Running)
+        return;
+
+    //Top up the bucket for the time that has passed. A second's worth of requests can be saved up.
+    const bool limited = (_requestsPerSecond > 0.0);
+    if (limited)
+    {
+        const qreal burst = qMax<qreal>(1.0, _requestsPerSecond);
+        _tokens = qMin<qreal>(burst, _tokens + _tokenClock.restart() * _requestsPerSecond / 1000.0);
+    }
+
+    while (_inFlight.size() < _maxConcurrent)
+    {
+        //Out of tokens? Come back when the next one is due.
+        if (limited && _tokens < 1.0)
+        {
+            const int wait = (int) ceil((1.0 - _tokens) * 1000.0 / _requestsPerSecond);
+            _pumpTimer->start(qMax(1, wait));
+            break;
+        }
+
+        //If the walk isn't done, it's only paused so that a mostly empty region doesn't hold everything up
+        TileKey key;
+        if (!this->nextTile(&key))
+        {
+            if (!_walkDone)
+                _pumpTimer->start(0);
+            break;
+        }
+
+        _inFlight.insert(key);
+        if (limited)
+            _tokens -= 1.0;
+        _source->prefetchTile(key.x(), key.y(), key.z());
+    }
+
+    if (_walkDone && _inFlight.isEmpty())
+    {
+        //A polygon's total may have come down since the last report
+        if (!_wholeBox)
+            this->progress(_completed, _total, _bytes);
+        this->setState(Idle);
+        this->finished();
+    }
+}
+
+//private
+void MapTilePrefetcher::start(const QPolygonF &lonLatPolygon, quint8 minZoom, quint8 maxZoom, bool wholeBox)
+{
+    this->cancel();
+    if (_source.isNull())
+        return;
+
+    _region = lonLatPolygon;
+    _regionPath = QPainterPath();
+    _regionPath.addPolygon(lonLatPolygon);
+    _regionPath.closeSubpath();
+    _wholeBox = wholeBox;
+    _minZoom = qMin(minZoom, maxZoom);
+    _maxZoom = qMax(minZoom, maxZoom);
+
+    _completed = 0;
+    _downloaded = 0;
+    _failed = 0;
+    _bytes = 0;
+
+    /*
+      Count the tiles of the bounding box zoom level by zoom level. That's exact for a box. For a polygon it's
+      an estimate that nextTile() brings down as it skips the tiles outside --- walking a big polygon down to
+      a deep zoom level just to count it would take far too long.
+    */
+    _total = 0;
+    for (int z = _minZoom; z <= _maxZoom; z++)
+    {
+        this->computeTileRange(z);
+        _total += quint64(_xLast - _xFirst + 1) * quint64(_yLast - _yFirst + 1);
+    }
+    this->resetWalk();
+
+    _tokens = 1.0;
+    _tokenClock.start();
+    this->setState(Running);
+    this->progress(_completed, _total, _bytes);
+    this->requestMoreTiles();
+}
+
+//private
+void MapTilePrefetcher::resetWalk()
+{
+    _z = _minZoom;
+    this->computeTileRange(_z);
+    _x = _xFirst;
+    this->startColumn();
+    _walkDone = false;
+}
+
+//private
+bool MapTilePrefetcher::nextTile(TileKey *key)
+{
+    int tested = 0;
+    while (!_walkDone)
+    {
+        if (tested++ >= MAX_TILES_TESTED_PER_CALL)
+            return false;
+
+        //Down each column, then across, then on to the next zoom level
+        if (_x > _xLast)
+        {
+            if (_z >= _maxZoom)
+            {
+                _walkDone = true;
+                break;
+            }
+            _z++;
+            this->computeTileRange(_z);
+            _x = _xFirst;
+            this->startColumn();
+            continue;
+        }
+
+        if (_y > _columnLast)
+        {
+            _x++;
+            if (_x <= _xLast)
+                this->startColumn();
+            continue;
+        }
+
+        const quint32 y = _y++;
+        if (_wholeBox || this->tileInRegion(_x, y, _z))
+        {
+            *key = TileKey(_x, y, _z);
+            return true;
+        }
+
+        //It was counted in the total, but isn't really part of the region
+        _total--;
+    }
+    return false;
+}
+
+//private
+void MapTilePrefetcher::startColumn()
+{
+    quint32 first = _yFirst;
+    quint32 last = _yLast;
+    if (!_wholeBox && !this->columnSpan(_x, _z, &first, &last))
+    {
+        //Nothing to walk down, and nothing of it belongs in the total
+        _total -= quint64(_yLast - _yFirst + 1);
+        _y = _yFirst + 1;
+        _columnLast = _yFirst;
+        return;
+    }
+
+    //Only the rows the region reaches into get tested one by one
+    _total -= quint64(first - _yFirst) + quint64(_yLast - last);
+    _y = first;
+    _columnLast = last;
+}
+
+//private
+bool MapTilePrefetcher::columnSpan(quint32 x, quint8 z, quint32 *first, quint32 *last) const
+{
+    const quint16 tileSize = _source->tileSize();
+    const qreal left = _source->qgs2ll(QPointF(x * tileSize, 0.0), z).x();
+    const qreal right = _source->qgs2ll(QPointF((x + 1) * tileSize, 0.0), z).x();
+
+    //Clip every edge of the polygon to the column and see how far up and down what's left goes
+    bool found = false;
+    qreal top = 0.0;
+    qreal bottom = 0.0;
+    for (int i = 0; i < _region.size(); i++)
+    {
+        QPointF a = _region.at(i);
+        QPointF b = _region.at((i + 1) % _region.size());
+        if (a.x() > b.x())
+            qSwap(a, b);
+        if (b.x() < left || a.x() > right)
+            continue;
+
+        QPointF from = a;
+        QPointF to = b;
+        if (b.x() > a.x())
+        {
+            const qreal slope = (b.y() - a.y()) / (b.x() - a.x());
+            if (from.x() < left)
+                from = QPointF(left, a.y() + (left - a.x()) * slope);
+            if (to.x() > right)
+                to = QPointF(right, a.y() + (right - a.x()) * slope);
+        }
+
+        const qreal edgeTop = qMax(from.y(), to.y());
+        const qreal edgeBottom = qMin(from.y(), to.y());
+        top = found ? qMax(top, edgeTop) : edgeTop;
+        bottom = found ? qMin(bottom, edgeBottom) : edgeBottom;
+        found = true;
+    }
+    if (!found)
+        return false;
+
+    //Latitude grows upwards but scene y grows downwards
+    const qreal lon = (left + right) / 2.0;
+    const QPointF topQGS = _source->ll2qgs(QPointF(lon, qBound<qreal>(-MAX_LATITUDE, top, MAX_LATITUDE)), z);
+    const QPointF bottomQGS = _source->ll2qgs(QPointF(lon, qBound<qreal>(-MAX_LATITUDE, bottom, MAX_LATITUDE)), z);
+    const qint64 firstRow = qMax<qint64>(_yFirst, qint64(floor(topQGS.y() / tileSize)));
+    const qint64 lastRow = qMin<qint64>(_yLast, qint64(floor(bottomQGS.y() / tileSize)));
+    if (firstRow > lastRow)
+        return false;
+
+    *first = quint32(firstRow);
+    *last = quint32(lastRow);
+    return true;
+}
+
+//private
+void MapTilePrefetcher::computeTileRange(quint8 z)
+{
+    const quint16 tileSize = _source->tileSize();
+    const quint32 tilesPerEdge = sqrt((long double)_source->tilesOnZoomLevel(z));
+    const quint32 lastTile = qMax<quint32>(1, tilesPerEdge) - 1;
+
+    //Latitude grows upwards but scene y grows downwards, so the top of the box is its largest latitude
+    const QRectF box = _region.boundingRect();
+    const QPointF topLeftLL(qBound<qreal>(-180.0, box.left(), 180.0),
+                            qBound<qreal>(-MAX_LATITUDE, box.bottom(), MAX_LATITUDE));
+    const QPointF bottomRightLL(qBound<qreal>(-180.0, box.right(), 180.0),
+                                qBound<qreal>(-MAX_LATITUDE, box.top(), MAX_LATITUDE));
+    const QPointF topLeft = _source->ll2qgs(topLeftLL, z);
+    const QPointF bottomRight = _source->ll2qgs(bottomRightLL, z);
+
+    _xFirst = qBound<qint64>(0, qint64(floor(topLeft.x() / tileSize)), lastTile);
+    _xLast = qBound<qint64>(0, qint64(floor(bottomRight.x() / tileSize)), lastTile);
+    _yFirst = qBound<qint64>(0, qint64(floor(topLeft.y() / tileSize)), lastTile);
+    _yLast = qBound<qint64>(0, qint64(floor(bottomRight.y() / tileSize)), lastTile);
+}
+
+//private
+bool MapTilePrefetcher::tileInRegion(quint32 x, quint32 y, quint8 z) const
+{
+    const quint16 tileSize = _source->tileSize();
+    const QPointF topLeft = _source->qgs2ll(QPointF(x * tileSize, y * tileSize), z);
+    const QPointF bottomRight = _source->qgs2ll(QPointF((x + 1) * tileSize, (y + 1) * tileSize), z);
+    return _regionPath.intersects(QRectF(topLeft, bottomRight).normalized());
+}
+
+//private
+void MapTilePrefetcher::finishTile(const TileKey &key, bool downloaded, bool failed, quint64 bytes)
+{
+    //The source reports every tile it retrieves or fails, not just ours
+    if (!_inFlight.remove(key))
+        return;
+
+    _completed++;
+    if (downloaded)
+        _downloaded++;
+    if (failed)
+        _failed++;
+    _bytes += bytes;
+
+    //The server never heard about a tile we already had, so it doesn't count against the rate
+    if (!downloaded && !failed && _requestsPerSecond > 0.0)
+        _tokens = qMin<qreal>(qMax<qreal>(1.0, _requestsPerSecond), _tokens + 1.0);
+
+    this->progress(_completed, _total, _bytes);
+    this->requestMoreTiles();
+}
+
+//private
+void MapTilePrefetcher::setState(MapTilePrefetcher::State state)
+{
+    if (state == _state)
+        return;
+    _state = state;
+    this->stateChanged(state);
+}
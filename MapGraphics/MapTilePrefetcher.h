@@ -0,0 +1,206 @@
+#ifndef MAPTILEPREFETCHER_H
+#define MAPTILEPREFETCHER_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QPainterPath>
+#include <QPolygonF>
+#include <QRectF>
+#include <QSet>
+#include <QSharedPointer>
+
+#include "MapGraphics_global.h"
+#include "MapTileSource.h"
+#include "TileKey.h"
+
+class QTimer;
+
+/**
+ * @brief Fills the cache of a MapTileSource with every tile of a region over a range of zoom levels, e.g.,
+ * so that the region can be looked at while offline. Only tiles that aren't cached (or have expired) are
+ * fetched, no faster than the configured rate and no more than the configured number at a time, so that
+ * tile servers aren't hammered. Tiles that fail are skipped (and left to the source's negative cache)
+ * rather than retried.
+ *
+ * The source must cache tiles (see MapTileSource::setCacheMode()). Progress is reported through signals.
+ * The prefetcher lives in the thread that created it; the source can live in any thread.
+ */
+class MAPGRAPHICSSHARED_EXPORT MapTilePrefetcher : public QObject
+{
+    Q_OBJECT
+public:
+    enum State
+    {
+        Idle,
+        Running,
+        Paused
+    };
+
+public:
+    explicit MapTilePrefetcher(QSharedPointer<MapTileSource> source, QObject * parent = 0);
+    virtual ~MapTilePrefetcher();
+
+    QSharedPointer<MapTileSource> tileSource() const;
+
+    /**
+     * @brief Starts prefetching the tiles that overlap a box of lon,lat coordinates (x is longitude, y is
+     * latitude) on zoom levels minZoom to maxZoom, inclusive. Replaces any prefetch underway.
+     *
+     * @param lonLatBox
+     * @param minZoom
+     * @param maxZoom
+     */
+    void prefetch(const QRectF& lonLatBox, quint8 minZoom, quint8 maxZoom);
+
+    /**
+     * @brief Starts prefetching the tiles that overlap a polygon of lon,lat coordinates on zoom levels
+     * minZoom to maxZoom, inclusive. Replaces any prefetch underway. Until every tile has been requested,
+     * totalTiles() is an estimate: it starts as the number of tiles of the polygon's bounding box and comes
+     * down as the tiles outside the polygon are skipped.
+     *
+     * @param lonLatPolygon
+     * @param minZoom
+     * @param maxZoom
+     */
+    void prefetch(const QPolygonF& lonLatPolygon, quint8 minZoom, quint8 maxZoom);
+
+    /**
+     * @brief Stops requesting tiles until resume() is called. Tiles already requested still complete.
+     */
+    void pause();
+
+    void resume();
+
+    /**
+     * @brief Stops the prefetch for good. Tiles already requested still end up in the cache, but are no
+     * longer reported.
+     */
+    void cancel();
+
+    MapTilePrefetcher::State state() const;
+
+    /**
+     * @brief Returns the number of tiles requested per second, at most. 0 means no limit.
+     *
+     * @return qreal
+     */
+    qreal requestsPerSecond() const;
+
+    /**
+     * @brief Sets the number of tiles requested per second, at most. 0 means no limit. Defaults to 2,
+     * which is about what public tile servers ask bulk downloaders to stay under. Tiles that turn out to
+     * be cached already don't count.
+     *
+     * @param rate
+     */
+    void setRequestsPerSecond(qreal rate);
+
+    /**
+     * @brief Returns the number of tiles that may be requested at once
+     *
+     * @return int
+     */
+    int maximumConcurrentRequests() const;
+
+    /**
+     * @brief Sets the number of tiles that may be requested at once. Defaults to 2.
+     *
+     * @param count
+     */
+    void setMaximumConcurrentRequests(int count);
+
+    //The totals of the current (or last) prefetch. See prefetch() for when totalTiles() is an estimate.
+    quint64 totalTiles() const;
+    quint64 completedTiles() const;
+    quint64 downloadedTiles() const;
+    quint64 failedTiles() const;
+    quint64 bytesDownloaded() const;
+
+signals:
+    /**
+     * @brief Emitted every time a tile is done with (whether it was fetched, already cached or failed)
+     *
+     * @param completed the number of tiles done with so far
+     * @param total the number of tiles in the region, or an estimate of it (see prefetch())
+     * @param bytes the number of encoded bytes downloaded so far
+     */
+    void progress(quint64 completed, quint64 total, quint64 bytes);
+
+    void stateChanged(MapTilePrefetcher::State state);
+
+    /**
+     * @brief Emitted when every tile of the region is done with. Not emitted after cancel().
+     */
+    void finished();
+
+private slots:
+    void handleTilePrefetched(quint32 x, quint32 y, quint8 z, bool downloaded, quint64 bytes);
+    void handleTileFailed(quint32 x, quint32 y, quint8 z);
+
+    //Requests as many tiles as the rate and concurrency limits allow
+    void requestMoreTiles();
+
+private:
+    //Sets up the walk over the region and counts its tiles
+    void start(const QPolygonF& lonLatPolygon, quint8 minZoom, quint8 maxZoom, bool wholeBox);
+
+    //Goes back to the first tile of the region
+    void resetWalk();
+
+    //Moves on to the next tile of the region. Returns false when there are none left, or when it has
+    //looked at enough tiles for one go without finding any (see _walkDone).
+    bool nextTile(TileKey * key);
+
+    //Sets _y.._columnLast to the tiles of column _x that may overlap the region
+    void startColumn();
+
+    //Finds the rows of column x on zoom level z that the region reaches into. Returns false if none.
+    bool columnSpan(quint32 x, quint8 z, quint32 * first, quint32 * last) const;
+
+    //Sets _xFirst.._xLast and _yFirst.._yLast to the tiles overlapping the region on zoom level z
+    void computeTileRange(quint8 z);
+
+    //Returns true if the tile overlaps the region
+    bool tileInRegion(quint32 x, quint32 y, quint8 z) const;
+
+    void finishTile(const TileKey& key, bool downloaded, bool failed, quint64 bytes);
+    void setState(MapTilePrefetcher::State state);
+
+    QSharedPointer<MapTileSource> _source;
+    State _state;
+
+    //The region, and whether it's the whole bounding box (so no per-tile checks are needed)
+    QPolygonF _region;
+    QPainterPath _regionPath;
+    bool _wholeBox;
+    quint8 _minZoom;
+    quint8 _maxZoom;
+
+    //Where we are in the walk over the region
+    quint8 _z;
+    quint32 _x;
+    quint32 _y;
+    quint32 _xFirst;
+    quint32 _xLast;
+    quint32 _yFirst;
+    quint32 _yLast;
+    quint32 _columnLast;
+    bool _walkDone;
+
+    QSet<TileKey> _inFlight;
+
+    //Token bucket for the request rate
+    qreal _requestsPerSecond;
+    qreal _tokens;
+    QElapsedTimer _tokenClock;
+    int _maxConcurrent;
+    QTimer * _pumpTimer;
+
+    quint64 _total;
+    quint64 _completed;
+    quint64 _downloaded;
+    quint64 _failed;
+    quint64 _bytes;
+};
+
+#endif // MAPTILEPREFETCHER_H
@@ -1,40 +1,112 @@
 #include "MapTileSource.h"
 
 #include <QStringBuilder>
+#include <QCryptographicHash>
 #include <QMutexLocker>
 #include <QtDebug>
-#include <QStringList>
-#include <QDataStream>
+#include <QDir>
+#include <QTimer>
+#include <cmath>
+
+#include "tileCaches/DiskCacheJanitor.h"
+#include "tileCaches/FileTreeDiskTileCache.h"
+#include "tileCaches/SQLiteDiskTileCache.h"
+#include "tileCaches/SharedMemoryTileCache.h"
+#include "tileCaches/TileCacheRegistry.h"
+#include "guts/TileMetricsRecorder.h"
+#include "guts/TileWorkerPool.h"
+#include "guts/TileWorkerTasks.h"
 
 const QString MAPGRAPHICS_CACHE_FOLDER_NAME = ".MapGraphicsCache";
+const QString SQLITE_CACHE_FILE_NAME = "tiles.sqlite";
 const quint32 DEFAULT_CACHE_DAYS = 7;
-const quint64 MAX_DISK_CACHE_READ_ATTEMPTS = 100000;
+
+//Often enough that a small batch of writes to the SQLite cache doesn't wait long for its commit
+const int DISK_CACHE_FLUSH_INTERVAL_MS = 2000;
+
+//Only a screenful or so of decoded tiles is kept in RAM...
+const quint64 DEFAULT_MEMORY_CACHE_BUDGET = 32 * 256 * 256 * 4;
+
+//...in front of the encoded ones, which are about ten times smaller
+const quint64 DEFAULT_ENCODED_MEMORY_CACHE_BUDGET = 32 * 1024 * 1024;
+
+//At most this many refreshes at once. Beyond that, expired tiles are shown without being refreshed.
+const int MAX_PENDING_REVALIDATIONS = 256;
+
+//Requests and fetches past this many at once aren't timed (and requests can't be cancelled)
+const int MAX_TIMED_REQUESTS = 4096;
+
+//Tiles dispatched at once unless setMaximumActiveRequests() says otherwise
+const int DEFAULT_MAX_ACTIVE_REQUESTS = 16;
+
+//A dispatched tile that hasn't been answered after this long stops holding up the queue
+const qint64 ACTIVE_REQUEST_TIMEOUT_MS = 30000;
 
 MapTileSource::MapTileSource() :
-    QObject(), _cacheExpirationsLoaded(false)
+    QObject(), _diskCacheBackend(FileTreeBackend), _diskCacheQuota(0), _defaultTileCache(true),
+    _sharedMemoryCacheEnabled(false), _staleWhileRevalidate(false), _maxActiveRequests(DEFAULT_MAX_ACTIVE_REQUESTS),
+    _requestSequence(0), _dispatching(false), _dispatchScheduled(false), _deliveriesScheduled(false),
+    _haveRequestFocus(false),
+    _requestFocusZoom(0), _metrics(new TileMetricsRecorder()), _negativeCache(new NegativeTileCache())
 {
+    _clock.start();
+
     this->setCacheMode(DiskAndMemCaching);
 
+    //Needed so the worker pool can post TileKeys and CachedTiles back to us, and we can post MapTiles to clients
+    qRegisterMetaType<TileKey>("TileKey");
+    qRegisterMetaType<CachedTile>("CachedTile");
+    qRegisterMetaType<MapTile>("MapTile");
+    qRegisterMetaType<QList<TileKey> >("QList<TileKey>");
+    qRegisterMetaType<QList<MapTile> >("QList<MapTile>");
+    _taskReceiver = QSharedPointer<TileTaskReceiver>(new TileTaskReceiver(this));
+
     //We connect this signal/slot pair to communicate across threads.
     connect(this,
             SIGNAL(tileRequested(quint32,quint32,quint8)),
             this,
-            SLOT(startTileRequest(quint32,quint32,quint8)),
+            SLOT(queueTileRequest(quint32,quint32,quint8)),
             Qt::QueuedConnection);
-
-    /*
-      When all our tiles have been invalidated, we clear our temp cache so any misinformed clients
-      that don't notice will get a null tile instead of an old tile.
-    */
     connect(this,
-            SIGNAL(allTilesInvalidated()),
+            SIGNAL(tilesRequested(QList<TileKey>)),
             this,
-            SLOT(clearTempCache()));
+            SLOT(queueTileRequests(QList<TileKey>)),
+            Qt::QueuedConnection);
+    connect(this,
+            SIGNAL(tilePrefetchRequested(quint32,quint32,quint8)),
+            this,
+            SLOT(queueTilePrefetch(quint32,quint32,quint8)),
+            Qt::QueuedConnection);
+    connect(this,
+            SIGNAL(tileCancelRequested(quint32,quint32,quint8)),
+            this,
+            SLOT(startTileCancel(quint32,quint32,quint8)),
+            Qt::QueuedConnection);
+    connect(this,
+            SIGNAL(requestFocusChanged(QPointF,quint8)),
+            this,
+            SLOT(handleRequestFocusChanged(QPointF,quint8)),
+            Qt::QueuedConnection);
+
+    //The timer is our child, so it follows us if we're moved to another thread
+    _diskFlushTimer = new QTimer(this);
+    connect(_diskFlushTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(flushDiskCache()));
+    _diskFlushTimer->start(DISK_CACHE_FLUSH_INTERVAL_MS);
 }
 
 MapTileSource::~MapTileSource()
 {
-    this->saveCacheExpirationsToDisk();
+    //Results of disk reads or decodes still running on the worker pool get dropped from now on
+    _taskReceiver->detach();
+
+    //Make sure everything we've cached reaches the disk
+    if (!_tileCache.isNull())
+        _tileCache->flush();
+    if (!_diskCache.isNull())
+        _diskCache->flush();
 }
 
 void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z)
@@ -46,16 +118,39 @@ void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z)
     this->tileRequested(x,y,z);
 }
 
-QImage *MapTileSource::getFinishedTile(quint32 x, quint32 y, quint8 z)
+void MapTileSource::requestTiles(const QList<TileKey> &keys)
 {
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
-    QMutexLocker lock(&_tempCacheLock);
-    if (!_tempCache.contains(cacheID))
-    {
-        qWarning() << "getFinishedTile() called, but the tile is not present";
-        return 0;
-    }
-    return _tempCache.take(cacheID);
+    //One event for the lot, rather than one per tile
+    if (!keys.isEmpty())
+        this->tilesRequested(keys);
+}
+
+void MapTileSource::cancelTile(quint32 x, quint32 y, quint8 z)
+{
+    //Like requestTile(), this is usually called from another thread
+    this->tileCancelRequested(x,y,z);
+}
+
+void MapTileSource::prefetchTile(quint32 x, quint32 y, quint8 z)
+{
+    //Like requestTile(), this is usually called from another thread
+    this->tilePrefetchRequested(x,y,z);
+}
+
+void MapTileSource::setRequestFocus(const QPointF &centerQGS, quint8 zoomLevel)
+{
+    //Like requestTile(), this is usually called from another thread
+    this->requestFocusChanged(centerQGS, zoomLevel);
+}
+
+int MapTileSource::maximumActiveRequests() const
+{
+    return _maxActiveRequests;
+}
+
+void MapTileSource::setMaximumActiveRequests(int count)
+{
+    _maxActiveRequests = qMax(0, count);
 }
 
 MapTileSource::CacheMode MapTileSource::cacheMode() const
@@ -68,316 +163,1111 @@ void MapTileSource::setCacheMode(MapTileSource::CacheMode nMode)
     _cacheMode = nMode;
 }
 
-//private slot
-void MapTileSource::startTileRequest(quint32 x, quint32 y, quint8 z)
+bool MapTileSource::staleWhileRevalidate() const
 {
-    //Check caches for the tile first
-    if (this->cacheMode() == DiskAndMemCaching)
+    return _staleWhileRevalidate;
+}
+
+void MapTileSource::setStaleWhileRevalidate(bool enabled)
+{
+    _staleWhileRevalidate = enabled;
+
+    //Expired tiles on disk are what we'd be showing, so the janitor has to leave them be
+    QMutexLocker lock(&_cacheLock);
+    if (!_diskCache.isNull())
+        DiskCacheJanitor::setKeepsExpired(_diskCache.data(), enabled);
+}
+
+MapTileSource::DiskCacheBackend MapTileSource::diskCacheBackend() const
+{
+    return _diskCacheBackend;
+}
+
+void MapTileSource::setDiskCacheBackend(MapTileSource::DiskCacheBackend backend)
+{
+    if (backend == SQLiteBackend && !SQLiteDiskTileCache::isAvailable())
     {
-        const QString cacheID = MapTileSource::createCacheID(x,y,z);
-        QImage * cached = this->fromMemCache(cacheID);
-        if (!cached)
-            cached = this->fromDiskCache(cacheID);
+        qWarning() << "Qt SQLite driver not available. Falling back to file tree disk cache.";
+        backend = FileTreeBackend;
+    }
+
+    QMutexLocker lock(&_cacheLock);
+    if (backend == _diskCacheBackend)
+        return;
+    _diskCacheBackend = backend;
+
+    //The new backend (and the default tile cache on top of it) get created the next time they're needed
+    _diskCache.clear();
+    if (_defaultTileCache)
+        _tileCache.clear();
+}
+
+QSharedPointer<MapTileCache> MapTileSource::tileCache()
+{
+    QMutexLocker lock(&_cacheLock);
+    if (!_tileCache.isNull())
+        return _tileCache;
+
+    //Decoded tiles in RAM, then encoded tiles in RAM, then other processes' tiles, then the disk
+    _tileCache = QSharedPointer<MapTileCache>(new MapTileCache());
+    _tileCache->setEncodingFormat(this->tileFileExtension().toLatin1());
+    _tileCache->addTier(this->memoryCache(MapTileCacheTier::Decoded));
+    _tileCache->addTier(this->memoryCache(MapTileCacheTier::Encoded));
+    if (_sharedMemoryCacheEnabled)
+        _tileCache->addTier(this->sharedMemoryCache());
+    _tileCache->addTier(this->diskCache());
+    _defaultTileCache = true;
+    return _tileCache;
+}
+
+void MapTileSource::setTileCache(QSharedPointer<MapTileCache> cache)
+{
+    QMutexLocker lock(&_cacheLock);
+    _tileCache = cache;
+    _defaultTileCache = cache.isNull();
+}
+
+MapTile MapTileSource::peekCachedTile(quint32 x, quint32 y, quint8 z) const
+{
+    //Don't create the cache from some other thread just to look in it
+    QMutexLocker lock(&_cacheLock);
+    QSharedPointer<MapTileCache> cache = _tileCache;
+    lock.unlock();
+
+    CachedTile cached;
+    if (cache.isNull() || this->cacheMode() != DiskAndMemCaching || !cache->peek(TileKey(x,y,z), &cached))
+        return MapTile();
+    return MapTile(TileKey(x,y,z), cached.image, cached.expireTime);
+}
+
+quint64 MapTileSource::memoryCacheBudget() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return this->memoryCache(MapTileCacheTier::Decoded)->budget();
+}
+
+void MapTileSource::setMemoryCacheBudget(quint64 bytes)
+{
+    QMutexLocker lock(&_cacheLock);
+    this->memoryCache(MapTileCacheTier::Decoded)->setBudget(bytes);
+}
+
+MemoryTileCache::Stats MapTileSource::memoryCacheStats() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return this->memoryCache(MapTileCacheTier::Decoded)->stats();
+}
+
+quint64 MapTileSource::encodedMemoryCacheBudget() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return this->memoryCache(MapTileCacheTier::Encoded)->budget();
+}
+
+void MapTileSource::setEncodedMemoryCacheBudget(quint64 bytes)
+{
+    QMutexLocker lock(&_cacheLock);
+    this->memoryCache(MapTileCacheTier::Encoded)->setBudget(bytes);
+}
+
+MemoryTileCache::Stats MapTileSource::encodedMemoryCacheStats() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return this->memoryCache(MapTileCacheTier::Encoded)->stats();
+}
+
+//static
+quint64 MapTileSource::globalMemoryCacheBudget()
+{
+    return MemoryTileCache::globalBudget();
+}
+
+//static
+void MapTileSource::setGlobalMemoryCacheBudget(quint64 bytes)
+{
+    MemoryTileCache::setGlobalBudget(bytes);
+}
+
+bool MapTileSource::sharedMemoryCacheEnabled() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return _sharedMemoryCacheEnabled;
+}
+
+void MapTileSource::setSharedMemoryCacheEnabled(bool enabled)
+{
+    QMutexLocker lock(&_cacheLock);
+    if (enabled == _sharedMemoryCacheEnabled)
+        return;
+    _sharedMemoryCacheEnabled = enabled;
+
+    //The default tile cache gets rebuilt with (or without) the shared tier the next time it's needed
+    if (!enabled)
+        _sharedMemoryCache.clear();
+    if (_defaultTileCache)
+        _tileCache.clear();
+}
+
+quint64 MapTileSource::diskCacheQuota() const
+{
+    QMutexLocker lock(&_cacheLock);
+    return _diskCacheQuota;
+}
+
+void MapTileSource::setDiskCacheQuota(quint64 bytes)
+{
+    QMutexLocker lock(&_cacheLock);
+    _diskCacheQuota = bytes;
+    if (!_diskCache.isNull())
+        DiskCacheJanitor::setQuota(_diskCache.data(), bytes);
+    lock.unlock();
+
+    DiskCacheJanitor::sweepSoon();
+}
 
-        //If we got an image from one of the caches, prepare it for the client and return
-        if (cached)
+//static
+quint64 MapTileSource::globalDiskCacheQuota()
+{
+    return DiskCacheJanitor::globalQuota();
+}
+
+//static
+void MapTileSource::setGlobalDiskCacheQuota(quint64 bytes)
+{
+    DiskCacheJanitor::setGlobalQuota(bytes);
+    DiskCacheJanitor::sweepSoon();
+}
+
+QSharedPointer<NegativeTileCache> MapTileSource::negativeCache() const
+{
+    return _negativeCache;
+}
+
+MapTileMetrics MapTileSource::metrics() const
+{
+    MapTileMetrics toRet = _metrics->snapshot();
+
+    //Don't create the cache just to count what it hasn't done
+    QMutexLocker lock(&_cacheLock);
+    QSharedPointer<MapTileCache> cache = _tileCache;
+    lock.unlock();
+
+    if (!cache.isNull())
+    {
+        foreach(const MapTileCache::TierStats& stats, cache->tierStats())
         {
-            this->prepareRetrievedTile(x,y,z,cached);
-            return;
+            MapTileMetrics::TierCounters counters;
+            counters.source = this->name();
+            counters.tier = stats.name;
+            counters.hits = stats.hits;
+            counters.misses = stats.misses;
+            toRet.tiers.append(counters);
         }
     }
+    return toRet;
+}
 
-    //If we get here, the tile was not cached and we must try to retrieve it
-    this->fetchTile(x,y,z);
+void MapTileSource::resetMetrics()
+{
+    _metrics->reset();
+
+    QMutexLocker lock(&_cacheLock);
+    if (!_tileCache.isNull())
+        _tileCache->resetTierStats();
 }
 
-//private slot
-void MapTileSource::clearTempCache()
+//static
+int MapTileSource::workerThreadCount()
 {
-    _tempCache.clear();
+    return TileWorkerPool::maxThreadCount();
 }
 
-//protected static
-QString MapTileSource::createCacheID(quint32 x, quint32 y, quint8 z)
+//static
+void MapTileSource::setWorkerThreadCount(int count)
 {
-    //We use % because it's more efficient to concatenate with QStringBuilder
-    QString toRet = QString::number(x) % "," % QString::number(y) % "," % QString::number(z);
-    return toRet;
+    TileWorkerPool::setMaxThreadCount(count);
 }
 
-//protected static
-bool MapTileSource::cacheID2xyz(const QString & string, quint32 *x, quint32 *y, quint32 *z)
+//private slot
+void MapTileSource::queueTileRequest(quint32 x, quint32 y, quint8 z)
 {
-    QStringList list = string.split(',');
-    if (list.size() != 3)
+    const TileKey key(x,y,z);
+
+    //Time the request from here to delivery, queueing included. If it's already underway, the first request
+    //sets the time.
+    _metrics->countRequest();
+    //Past the limit, new requests go untimed rather than push out the timings of those still underway
+    if (!_requestStarts.contains(key) && _requestStarts.size() < MAX_TIMED_REQUESTS)
     {
-        qWarning() << "Bad cacheID" << string << "cannot convert";
-        return false;
+        _requestStarts.insert(key, _clock.elapsed());
+        _metrics->setInFlight(_requestStarts.size());
     }
 
-    bool ok = true;
-    *x = list.at(0).toUInt(&ok);
-    if (!ok)
-        return false;
-    *y = list.at(1).toUInt(&ok);
-    if (!ok)
-        return false;
-    *z = list.at(2).toUInt(&ok);
-    return ok;
+    //No need to queue it if it's already underway
+    if (this->joinTileRequest(key, 1))
+        return;
+
+    this->queueTile(key, false);
+}
+
+//private slot
+void MapTileSource::queueTileRequests(QList<TileKey> keys)
+{
+    foreach(const TileKey& key, keys)
+        this->queueTileRequest(key.x(), key.y(), key.z());
 }
 
-QImage *MapTileSource::fromMemCache(const QString &cacheID)
+//private slot
+void MapTileSource::queueTilePrefetch(quint32 x, quint32 y, quint8 z)
 {
-    QImage * toRet = 0;
+    this->queueTile(TileKey(x,y,z), true);
+}
 
-    if (_memoryCache.contains(cacheID))
+//private slot
+void MapTileSource::handleRequestFocusChanged(QPointF centerQGS, quint8 zoomLevel)
+{
+    _haveRequestFocus = true;
+    _requestFocusCenter = centerQGS;
+    _requestFocusZoom = zoomLevel;
+
+    //Put everything that's waiting back in order around the new focus
+    _requestQueue.clear();
+    QHash<TileKey, QueuedRequest>::iterator iter;
+    for (iter = _queuedRequests.begin(); iter != _queuedRequests.end(); iter++)
     {
-        //Figure out when the tile we're loading from cache was supposed to expire
-        QDateTime expireTime = this->getTileExpirationTime(cacheID);
+        iter.value().priority = this->requestPriority(iter.key(), iter.value());
+        _requestQueue.insert(iter.value().priority, iter.key());
+    }
+}
 
-        //If the cached tile is older than we would like, throw it out
-        if (QDateTime::currentDateTimeUtc().secsTo(expireTime) <= 0)
-        {
-            _memoryCache.remove(cacheID);
-        }
-        //Otherwise, make a copy of the cached tile and return it to the caller
-        else
+//private slot
+void MapTileSource::dispatchQueuedRequests()
+{
+    _dispatchScheduled = false;
+
+    //Tiles answered right away (e.g., from memory) free their slot as we go, so we may come back here
+    if (_dispatching)
+        return;
+    _dispatching = true;
+
+    while (!_requestQueue.isEmpty())
+    {
+        if (_maxActiveRequests > 0 && _activeRequests.size() >= _maxActiveRequests)
         {
-            toRet = new QImage(*_memoryCache.object(cacheID));
+            //Tiles that are never answered (say, lost by their source) mustn't hold their slots forever, nor
+            //their place among the timed requests
+            const qint64 now = _clock.elapsed();
+            QHash<TileKey, qint64>::iterator iter = _activeRequests.begin();
+            while (iter != _activeRequests.end())
+            {
+                if (now - iter.value() > ACTIVE_REQUEST_TIMEOUT_MS)
+                {
+                    _requestStarts.remove(iter.key());
+                    _fetchStarts.remove(iter.key());
+                    iter = _activeRequests.erase(iter);
+                }
+                else
+                    iter++;
+            }
+            _metrics->setInFlight(_requestStarts.size());
+            if (_activeRequests.size() >= _maxActiveRequests)
+                break;
         }
+
+        const TileKey key = _requestQueue.begin().value();
+        _requestQueue.erase(_requestQueue.begin());
+        const QueuedRequest request = _queuedRequests.take(key);
+
+        _activeRequests.insert(key, _clock.elapsed());
+        if (request.requests > 0)
+            this->startTileRequest(key, request.requests);
+        if (request.prefetch)
+            this->startTilePrefetch(key);
     }
 
-    return toRet;
+    _dispatching = false;
 }
 
-void MapTileSource::toMemCache(const QString &cacheID, QImage *toCache, const QDateTime &expireTime)
+//private slot
+void MapTileSource::flushDeliveries()
 {
-    if (toCache == 0)
+    _deliveriesScheduled = false;
+    if (_deliveries.isEmpty())
         return;
 
-    if (_memoryCache.contains(cacheID))
+    const QList<MapTile> deliveries = _deliveries;
+    _deliveries.clear();
+    this->tilesDelivered(deliveries);
+}
+
+//private
+void MapTileSource::queueTile(const TileKey &key, bool prefetch)
+{
+    QHash<TileKey, QueuedRequest>::iterator iter = _queuedRequests.find(key);
+    if (iter == _queuedRequests.end())
+    {
+        QueuedRequest request;
+        request.sequence = _requestSequence++;
+        iter = _queuedRequests.insert(key, request);
+    }
+    else
+        _requestQueue.remove(iter.value().priority);
+
+    if (prefetch)
+        iter.value().prefetch = true;
+    else
+        iter.value().requests++;
+    iter.value().priority = this->requestPriority(key, iter.value());
+    _requestQueue.insert(iter.value().priority, key);
+
+    //Dispatch once the requests that are already posted to us have been queued too, so the best go first
+    if (!_dispatchScheduled)
+    {
+        _dispatchScheduled = true;
+        QMetaObject::invokeMethod(this, "dispatchQueuedRequests", Qt::QueuedConnection);
+    }
+}
+
+//private
+quint64 MapTileSource::requestPriority(const TileKey &key, const QueuedRequest &request) const
+{
+    //Prefetches come after everything else, and otherwise it's first come, first served...
+    quint64 toRet = request.sequence;
+    if (request.requests == 0)
+        toRet |= Q_UINT64_C(1) << 62;
+    if (!_haveRequestFocus)
+        return toRet;
+
+    //...among the tiles at the same zoom level and distance from the focus, in tiles at the focus zoom level
+    const quint64 zoomDistance = qAbs(int(key.z()) - int(_requestFocusZoom));
+    const qreal scale = pow(2.0, int(_requestFocusZoom) - int(key.z()));
+    const qreal tileSize = this->tileSize();
+    const qreal dx = (key.x() + 0.5) * scale - _requestFocusCenter.x() / tileSize;
+    const qreal dy = (key.y() + 0.5) * scale - _requestFocusCenter.y() / tileSize;
+    const quint64 distance = quint64(qMin<qreal>(dx*dx + dy*dy, 0xFFFFFF));
+
+    toRet |= qMin<quint64>(zoomDistance, 0x3F) << 56;
+    toRet |= distance << 32;
+    return toRet;
+}
+
+//private
+void MapTileSource::startTileRequest(const TileKey &key, int requests)
+{
+    //It may have been started for someone else while these requests were queued
+    if (this->joinTileRequest(key, requests))
         return;
 
-    //Note when the tile will expire
-    this->setTileExpirationTime(cacheID, expireTime);
+    //Count who's waiting so that cancelTile() knows when nobody is. Past the limit, requests can't be cancelled.
+    _cancelled.remove(key);
+    if (_requestWaiters.size() < MAX_TIMED_REQUESTS || _requestWaiters.contains(key))
+        _requestWaiters[key] += requests;
+
+    //Check caches for the tile first
+    if (this->cacheMode() == DiskAndMemCaching)
+    {
+        QSharedPointer<MapTileCache> cache = this->tileCache();
+
+        //The decoded tiles in memory are cheap enough to check right here
+        CachedTile cached;
+        const bool found = cache->fastLookup(key, &cached);
+        if (found && (!cached.isExpired() || _staleWhileRevalidate))
+        {
+            _metrics->countCacheHit();
+            if (_requestStarts.contains(key))
+                _metrics->recordLatency(MapTileMetrics::CacheLookup, _clock.elapsed() - _requestStarts.value(key));
+            if (!cached.isExpired())
+                this->prepareRetrievedTile(key,cached.image,cached.expireTime);
+            else
+                this->prepareStaleTile(key,cached);
+            return;
+        }
+
+        //A tile we just received may still be on its way into the slow tiers
+        const CachedTile pending = _pendingInserts.value(key).tile;
+        if (!pending.image.isNull() && !pending.isExpired())
+        {
+            _metrics->countCacheHit();
+            if (_requestStarts.contains(key))
+                _metrics->recordLatency(MapTileMetrics::CacheLookup, _clock.elapsed() - _requestStarts.value(key));
+            this->prepareRetrievedTile(key,pending.image,pending.expireTime);
+            return;
+        }
 
-    //Make a copy of the QImage
-    QImage * copy = new QImage(*toCache);
-    _memoryCache.insert(cacheID,copy);
+        /*
+          The other tiers are checked (and their tiles decoded) on the worker pool so that a slow disk can't
+          stall the requests queued up behind this one. We pick up again in handleCacheLookupResult().
+        */
+        if (cache->hasSlowTiers())
+        {
+            TileWorkerPool::pool()->start(new TileCacheLookupTask(_taskReceiver,
+                                                                  cache,
+                                                                  key,
+                                                                  QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS),
+                                                                  _staleWhileRevalidate));
+            return;
+        }
+    }
+
+    //If we get here, the tile was not cached and we must try to retrieve it
+    this->fetchUncachedTile(key);
 }
 
-QImage *MapTileSource::fromDiskCache(const QString &cacheID)
+//private
+bool MapTileSource::joinTileRequest(const TileKey &key, int requests)
 {
-    //Figure out x,y,z based on the cacheID
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
-        return 0;
+    //Waiters are counted from the moment a request starts until it's answered, so that's what's underway
+    QHash<TileKey, int>::iterator iter = _requestWaiters.find(key);
+    if (iter == _requestWaiters.end())
+        return false;
 
-    //See if we've got it in the cache
-    const QString path = this->getDiskCacheFile(x,y,z);
-    QFile fp(path);
-    if (!fp.exists())
-        return 0;
+    iter.value() += requests;
+    _metrics->countCoalesced();
 
-    //Figure out when the tile we're loading from cache was supposed to expire
-    QDateTime expireTime = this->getTileExpirationTime(cacheID);
+    //Those waiting on a refresh already have the stale copy, so the newcomers get it too
+    const MapTile stale = _revalidating.value(key);
+    if (!stale.isNull())
+        this->prepareRetrievedTile(key, stale.image(), stale.expireTime());
+    return true;
+}
 
-    //If the cached tile is older than we would like, throw it out
-    if (QDateTime::currentDateTimeUtc().secsTo(expireTime) <= 0)
+//private
+void MapTileSource::startTilePrefetch(const TileKey &key)
+{
+    //Without a cache there's nowhere to put the tile
+    if (this->cacheMode() != DiskAndMemCaching)
     {
-        if (!QFile::remove(path))
-            qWarning() << "Failed to remove old cache file" << path;
-        return 0;
+        this->releaseRequestSlot(key);
+        this->tilePrefetched(key.x(),key.y(),key.z(),false,0);
+        return;
     }
 
-    if (!fp.open(QFile::ReadOnly))
+    //A tile we just received is as good as cached
+    if (_pendingInserts.contains(key))
     {
-        qWarning() << "Failed to open" << QFileInfo(fp.fileName()).baseName() << "from cache";
-        return 0;
+        this->releaseRequestSlot(key);
+        this->tilePrefetched(key.x(),key.y(),key.z(),false,0);
+        return;
     }
 
-    QByteArray data;
-    quint64 counter = 0;
-    while (data.length() < fp.size())
+    //Only whether the tile is cached matters, so nothing is read or decoded. We pick up again in
+    //handlePrefetchLookupResult().
+    TileWorkerPool::pool()->start(new TileCachePresenceTask(_taskReceiver,
+                                                            this->tileCache(),
+                                                            key));
+}
+
+//private
+void MapTileSource::releaseRequestSlot(const TileKey &key)
+{
+    if (_activeRequests.remove(key) == 0 || _dispatchScheduled || _dispatching)
+        return;
+
+    //Not right away: whoever called us has a tile to hand over first
+    _dispatchScheduled = true;
+    QMetaObject::invokeMethod(this, "dispatchQueuedRequests", Qt::QueuedConnection);
+}
+
+//private slot
+void MapTileSource::startTileCancel(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+
+    //Requests that are still queued just leave the queue, unless the tile is to be prefetched too
+    QHash<TileKey, QueuedRequest>::iterator queued = _queuedRequests.find(key);
+    if (queued != _queuedRequests.end() && queued.value().requests > 0)
     {
-        data += fp.read(20480);
-        if (++counter >= MAX_DISK_CACHE_READ_ATTEMPTS)
+        if (--queued.value().requests > 0)
+            return;
+
+        _metrics->countCancelled();
+        _requestQueue.remove(queued.value().priority);
+        if (queued.value().prefetch)
         {
-            qWarning() << "Reading cache file" << fp.fileName() << "took too long. Aborting.";
-            return 0;
+            queued.value().priority = this->requestPriority(key, queued.value());
+            _requestQueue.insert(queued.value().priority, key);
         }
+        else
+            _queuedRequests.erase(queued);
+
+        //Unless the tile is also underway for someone else, stop timing it
+        if (!_requestWaiters.contains(key))
+            this->finishRequest(key, false);
+        return;
     }
 
-    QImage * image = new QImage();
-    if (!image->loadFromData(data))
+    //If the tile was already handed over (or failed), there's nothing left to cancel
+    QHash<TileKey, int>::iterator iter = _requestWaiters.find(key);
+    if (iter == _requestWaiters.end())
+        return;
+
+    //Someone else still wants it
+    if (--iter.value() > 0)
+        return;
+
+    _metrics->countCancelled();
+    this->finishRequest(key, false);
+    _fetchStarts.remove(key);
+    _revalidating.remove(key);
+
+    //A prefetch of the same tile still needs it
+    if (_prefetching.contains(key))
+        return;
+
+    //If it wasn't being fetched, it's still being looked for in the cache. That lookup won't go on to fetch
+    //it, and takes the key back out of _cancelled when it returns.
+    if (!_fetching.remove(key))
+        _cancelled.insert(key);
+
+    this->cancelFetch(x,y,z);
+}
+
+//private slot
+void MapTileSource::handleCacheLookupResult(TileKey key, CachedTile tile)
+{
+    if (_requestStarts.contains(key))
+        _metrics->recordLatency(MapTileMetrics::CacheLookup, _clock.elapsed() - _requestStarts.value(key));
+
+    //We may have received the tile while the lookup was underway
+    if (tile.image.isNull() && !_pendingInserts.value(key).tile.isExpired())
+        tile = _pendingInserts.value(key).tile;
+
+    //If the cache didn't have it, we must try to retrieve it --- unless it's not wanted anymore
+    if (tile.image.isNull())
+    {
+        if (!_cancelled.remove(key))
+            this->fetchUncachedTile(key);
+        return;
+    }
+
+    //The cache has it, but nobody wants it anymore (and it's been promoted, so that's not wasted either)
+    if (_cancelled.remove(key))
+        return;
+
+    _metrics->countCacheHit();
+
+    //The lookup only hands back expired tiles if we asked it to keep them
+    if (tile.isExpired())
     {
-        delete image;
-        return 0;
+        this->prepareStaleTile(key,tile);
+        return;
     }
 
-    return image;
+    //The cache has already promoted the tile to its faster tiers
+    this->prepareRetrievedTile(key,tile.image,tile.expireTime);
 }
 
-void MapTileSource::toDiskCache(const QString &cacheID, QImage *toCache, const QDateTime &expireTime)
+//private slot
+void MapTileSource::handlePrefetchLookupResult(TileKey key, bool cached)
 {
-    //Figure out x,y,z based on the cacheID
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+    if (cached)
+    {
+        this->releaseRequestSlot(key);
+        this->tilePrefetched(key.x(),key.y(),key.z(),false,0);
         return;
+    }
 
-    //Find out where we'll be caching
-    const QString filePath = this->getDiskCacheFile(x,y,z);
+    //prepareReceivedTile() (or reportTileFailure()) will know the tile was prefetched. Every prefetch is
+    //taken out of _prefetching when it ends, so that tilePrefetched or tileFailed is always emitted for it.
+    _prefetching.insert(key);
+    this->fetchUncachedTile(key);
+}
 
-    //If we've already cached something, do not cache it again
-    QFile fp(filePath);
-    if (fp.exists())
+//private slot
+void MapTileSource::handleDecodedTile(TileKey key, CachedTile tile)
+{
+    if (tile.image.isNull())
+    {
+        qWarning() << "Failed to make QImage from" << this->name() << key.toString() << "bytes";
+        this->reportTileFailure(key.x(), key.y(), key.z(), NegativeTileCache::InvalidTile);
         return;
+    }
 
-    //Note when the tile will expire
-    this->setTileExpirationTime(cacheID, expireTime);
+    this->prepareReceivedTile(key,tile);
+}
 
-    //Auto-detect file format
-    const char * format = 0;
+//private slot
+void MapTileSource::handleProvisionalTile(TileKey key, CachedTile tile)
+{
+    //Too late if the real tile (or news that there isn't one) came first, or if nobody wants it anymore
+    if (tile.image.isNull() || !_fetching.contains(key) || !_requestWaiters.contains(key))
+        return;
 
-    //No compression for lossy file types!
-    const int quality = 100;
+    //Only for showing in the meantime. It isn't cached and the request isn't over.
+    this->queueDelivery(MapTile(key, tile.image, QDateTime(), true));
+}
 
-    //Try to write the data
-    if (!toCache->save(filePath,format,quality))
-        qWarning() << "Failed to put" << this->name() << x << y << z << "into disk cache";
+//private slot
+void MapTileSource::handleCacheInsertDone(TileKey key)
+{
+    QHash<TileKey, PendingInsert>::iterator iter = _pendingInserts.find(key);
+    if (iter != _pendingInserts.end() && --iter.value().tasks <= 0)
+        _pendingInserts.erase(iter);
 }
 
-void MapTileSource::prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage *image)
+//private slot
+void MapTileSource::flushDiskCache()
+{
+    //Don't create the cache just to flush it
+    QMutexLocker lock(&_cacheLock);
+    QSharedPointer<MapTileCache> cache = _tileCache;
+    lock.unlock();
+
+    if (!cache.isNull())
+        TileWorkerPool::pool()->start(new TileCacheFlushTask(cache));
+}
+
+//private
+void MapTileSource::prepareRetrievedTile(const TileKey &key, const QImage &image, const QDateTime &expireTime)
 {
     //Do tile sanity check here optionally
-    if (image == 0)
+    if (image.isNull())
         return;
 
-    //Put it into the "temporary retrieval cache" so the user can grab it
-    QMutexLocker lock(&_tempCacheLock);
-    _tempCache.insert(MapTileSource::createCacheID(x,y,z),
-                      image);
-    /*
-      We must explicitly unlock the mutex before emitting tileRetrieved in case
-      we're running in the GUI thread (since the signal can trigger
-      slots immediately in that case).
-    */
-    lock.unlock();
+    this->finishRequest(key, true);
 
-    //Emit signal so user knows to call getFinishedTile()
-    this->tileRetrieved(x,y,z);
+    //The handle shares the image with the cache and with every client, so no copies are made from here on
+    const MapTile tile(key, image, expireTime);
+
+    //Whoever asked for an expired tile is still waiting for the fresh copy
+    if (!tile.isExpired())
+        _requestWaiters.remove(key);
+    this->tileRetrieved(tile);
+    this->queueDelivery(tile);
+}
+
+//private
+void MapTileSource::deliverFailure(const TileKey &key)
+{
+    this->tileFailed(key.x(), key.y(), key.z());
+    this->queueDelivery(MapTile(key, QImage()));
+}
+
+//private
+void MapTileSource::queueDelivery(const MapTile &tile)
+{
+    //Nobody listens for batches unless they're in another thread, so don't bother collecting them
+    if (this->receivers(SIGNAL(tilesDelivered(QList<MapTile>))) == 0)
+        return;
+
+    //Whatever else is delivered before we get back to the event loop goes in the same batch
+    _deliveries.append(tile);
+    if (!_deliveriesScheduled)
+    {
+        _deliveriesScheduled = true;
+        QMetaObject::invokeMethod(this, "flushDeliveries", Qt::QueuedConnection);
+    }
 }
 
-void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QImage *image, QDateTime expireTime)
+//private
+void MapTileSource::prepareReceivedTile(const TileKey &key, CachedTile tile)
 {
-    //Insert into caches when applicable
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    if (tile.image.isNull())
+        return;
+
+    //A fresh copy of a tile we were refreshing is the end of that, as is any trouble we had getting it
+    _revalidating.remove(key);
+    _negativeCache->recordSuccess(key);
+    const bool prefetched = _prefetching.remove(key);
+    _cancelled.remove(key);
+
+    //Cancelling the last request for a tile takes it out of _fetching (unless it's also being prefetched).
+    //If it arrives anyway, e.g. from a decode already underway, it's cached but not handed over. Those
+    //still waiting on a fresh copy of an expired tile do want it, fetched or not.
+    const bool fetched = _fetching.remove(key);
+    const bool wanted = fetched || prefetched || _requestWaiters.contains(key);
+    this->finishFetch(key);
+    _metrics->countReceived(tile.encoded.size());
+
+    //Convert once, here, rather than every time the view paints the tile
+    tile.image = MapTile::toPaintFormat(tile.image);
+
+    //If they didn't tell us when the tile expires, use the default
+    if (tile.expireTime.isNull())
+        tile.expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    //Insert into caches when applicable. The original bytes (if any) spare the cache from re-encoding.
+    //Prefetched tiles are kept encoded only, where they don't crowd out the tiles being looked at.
     if (this->cacheMode() == DiskAndMemCaching)
     {
-        this->toMemCache(cacheID, image, expireTime);
-        this->toDiskCache(cacheID, image, expireTime);
+        CachedTile toCache = tile;
+        if ((prefetched || !wanted) && !toCache.encoded.isEmpty() && !_requestWaiters.contains(key))
+            toCache.image = QImage();
+        this->cacheReceivedTile(key, tile, toCache);
     }
 
-    //Put the tile in a client-accessible place and notify them
-    this->prepareRetrievedTile(x, y, z, image);
+    if (prefetched)
+        this->tilePrefetched(key.x(), key.y(), key.z(), true, tile.encoded.size());
+
+    //Notify the client
+    if (wanted)
+        this->prepareRetrievedTile(key, tile.image, tile.expireTime);
 }
 
-//protected
-QDateTime MapTileSource::getTileExpirationTime(const QString &cacheID)
+//private
+void MapTileSource::cacheReceivedTile(const TileKey &key, const CachedTile &tile, const CachedTile &toCache)
 {
-    //Make sure we've got our expiration database loaded
-    this->loadCacheExpirationsFromDisk();
+    QSharedPointer<MapTileCache> cache = this->tileCache();
+    cache->fastInsert(key, toCache);
+    if (!cache->hasSlowTiers())
+        return;
 
-    QDateTime expireTime;
-    if (_cacheExpirations.contains(cacheID))
-        expireTime = _cacheExpirations.value(cacheID);
-    else
+    //Encoding the tile and writing it to disk are left to the worker pool. Until it's done, lookups in the
+    //slow tiers would miss the tile, so we keep it around to answer them ourselves.
+    PendingInsert& pending = _pendingInserts[key];
+    pending.tile = tile;
+    pending.tasks++;
+    TileWorkerPool::pool()->start(new TileCacheInsertTask(_taskReceiver, cache, key, toCache));
+}
+
+//private
+void MapTileSource::prepareStaleTile(const TileKey &key, const CachedTile &tile)
+{
+    //Show what we've got right away...
+    this->prepareRetrievedTile(key, tile.image, tile.expireTime);
+
+    //...and refresh it in the background, once, unless the last try failed too recently
+    if (_revalidating.contains(key))
+        return;
+    if (_negativeCache->isBlocked(key) || _revalidating.size() >= MAX_PENDING_REVALIDATIONS)
     {
-        qWarning() << "Tile" << cacheID << "has unknown expire time. Resetting to default of" << DEFAULT_CACHE_DAYS << "days.";
-        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
-        _cacheExpirations.insert(cacheID,expireTime);
+        _requestWaiters.remove(key);
+        return;
     }
+    _revalidating.insert(key, MapTile(key, tile.image, tile.expireTime));
 
-    return expireTime;
+    _metrics->countFetch();
+    _fetchStarts.insert(key, _clock.elapsed());
+    _fetching.insert(key);
+    this->refreshTile(key.x(), key.y(), key.z(), tile.etag, tile.lastModified);
 }
 
-//protected
-void MapTileSource::setTileExpirationTime(const QString &cacheID, QDateTime expireTime)
+//private
+void MapTileSource::fetchUncachedTile(const TileKey &key)
 {
-    //Make sure we've got our expiration database loaded
-    this->loadCacheExpirationsFromDisk();
+    //Don't go back to the server for a tile that just failed. The client hears about it right away instead.
+    if (_negativeCache->isBlocked(key))
+    {
+        _prefetching.remove(key);
+        _metrics->countBlocked();
+        this->finishRequest(key, false);
+        this->deliverFailure(key);
+        return;
+    }
 
-    //If they told us when the tile expires, store that expiration. Otherwise, use the default.
-    if (expireTime.isNull())
+    //Requests and prefetches of the same tile all get it from one fetch. Every fetch takes its key out of
+    //_fetching when it ends (received, failed, cancelled or abandoned), so there's no need to bound it.
+    if (_fetching.contains(key))
     {
-        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+        _metrics->countCoalesced();
+        return;
     }
+    _fetching.insert(key);
 
-    _cacheExpirations.insert(cacheID, expireTime);
+    _metrics->countFetch();
+    if (_fetchStarts.size() < MAX_TIMED_REQUESTS)
+        _fetchStarts.insert(key, _clock.elapsed());
+
+    //Somebody is looking at this tile, so give them something to look at until it comes
+    if (_requestWaiters.contains(key))
+        this->startProvisionalTile(key);
+
+    this->fetchTile(key.x(), key.y(), key.z());
 }
 
 //private
-QDir MapTileSource::getDiskCacheDirectory(quint32 x, quint32 y, quint8 z) const
+void MapTileSource::startProvisionalTile(const TileKey &key)
 {
-    Q_UNUSED(y)
-    QString pathString = QDir::homePath() % "/" % MAPGRAPHICS_CACHE_FOLDER_NAME % "/" % this->name() % "/" % QString::number(z) % "/" % QString::number(x);
-    QDir toRet = QDir(pathString);
-    if (!toRet.exists())
+    //Only quadtrees have four children that make up the tile, and only if a TileKey can hold them
+    if (key.z() >= TileKey::MAX_ZOOM_LEVEL
+            || key.x() > TileKey::MAX_COORDINATE / 2
+            || key.y() > TileKey::MAX_COORDINATE / 2
+            || this->cacheMode() != DiskAndMemCaching
+            || this->tilesOnZoomLevel(key.z() + 1) != 4 * this->tilesOnZoomLevel(key.z()))
+        return;
+
+    //Only the decoded tiles in RAM. Going to the disk for them would take about as long as the fetch.
+    QMutexLocker lock(&_cacheLock);
+    QSharedPointer<MapTileCache> cache = _tileCache;
+    lock.unlock();
+    if (cache.isNull())
+        return;
+
+    QList<QImage> children;
+    bool haveChild = false;
+    for (quint32 i = 0; i < 4; i++)
     {
-        if (!toRet.mkpath(toRet.absolutePath()))
-            qWarning() << "Failed to create cache directory" << toRet.absolutePath();
+        CachedTile child;
+        cache->peek(TileKey(2 * key.x() + i % 2, 2 * key.y() + i / 2, key.z() + 1), &child);
+        children.append(child.image);
+        haveChild = haveChild || !child.image.isNull();
     }
-    return toRet;
+    if (!haveChild)
+        return;
+
+    //We pick up again in handleProvisionalTile()
+    TileWorkerPool::pool()->start(new TileDownsampleTask(_taskReceiver, key, children));
 }
 
 //private
-QString MapTileSource::getDiskCacheFile(quint32 x, quint32 y, quint8 z) const
+void MapTileSource::finishFetch(const TileKey &key)
 {
-    QString toRet = this->getDiskCacheDirectory(x,y,z).absolutePath() % "/" % QString::number(y) % "." % this->tileFileExtension();
-    return toRet;
+    QHash<TileKey, qint64>::iterator iter = _fetchStarts.find(key);
+    if (iter == _fetchStarts.end())
+        return;
+
+    _metrics->recordLatency(MapTileMetrics::Network, _clock.elapsed() - iter.value());
+    _fetchStarts.erase(iter);
 }
 
 //private
-void MapTileSource::loadCacheExpirationsFromDisk()
+void MapTileSource::finishRequest(const TileKey &key, bool delivered)
 {
-    if (_cacheExpirationsLoaded)
+    //Answered one way or the other, so the next one can go
+    this->releaseRequestSlot(key);
+
+    //A request that wasn't answered with a tile is over for everyone waiting on it
+    if (!delivered)
+        _requestWaiters.remove(key);
+
+    QHash<TileKey, qint64>::iterator iter = _requestStarts.find(key);
+    if (iter == _requestStarts.end())
         return;
 
-    //If we try to do this and succeed or even fail, don't try again
-    _cacheExpirationsLoaded = true;
+    if (delivered)
+        _metrics->recordLatency(MapTileMetrics::Delivery, _clock.elapsed() - iter.value());
+    _requestStarts.erase(iter);
+    _metrics->setInFlight(_requestStarts.size());
+}
 
-    QDir dir = this->getDiskCacheDirectory(0,0,0);
-    QString path = dir.absolutePath() % "/" % "cacheExpirations.db";
-    _cacheExpirationsFile = path;
+//protected
+void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QImage &image, QDateTime expireTime,
+                                             const QByteArray &encoded)
+{
+    CachedTile tile;
+    tile.image = image;
+    tile.encoded = encoded;
+    tile.expireTime = expireTime;
+    this->prepareReceivedTile(TileKey(x,y,z), tile);
+}
+
+//protected
+void MapTileSource::decodeNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QByteArray &encoded,
+                                            const QDateTime &expireTime, const QByteArray &etag,
+                                            const QByteArray &lastModified)
+{
+    CachedTile tile;
+    tile.encoded = encoded;
+    tile.expireTime = expireTime;
+    tile.etag = etag;
+    tile.lastModified = lastModified;
 
-    QFile fp(path);
-    if (!fp.exists())
+    //The network's part is done. Decoding is timed by the task.
+    this->finishFetch(TileKey(x,y,z));
+
+    //We pick up again in handleDecodedTile()
+    TileWorkerPool::pool()->start(new TileDecodeTask(_taskReceiver,
+                                                     _metrics,
+                                                     TileKey(x,y,z),
+                                                     tile));
+}
+
+//protected
+void MapTileSource::prepareRevalidatedTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime)
+{
+    const TileKey key(x,y,z);
+    if (expireTime.isNull())
+        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    _negativeCache->recordSuccess(key);
+    _fetching.remove(key);
+    this->finishFetch(key);
+    _metrics->countReceived(0);
+
+    //The bytes we have are still good, so all there is to do is push back the expiration in every tier
+    if (this->cacheMode() == DiskAndMemCaching)
+        this->tileCache()->setExpirationTime(key, expireTime);
+
+    //A prefetch that came along during the refresh finds the tile was cached all along
+    if (_prefetching.remove(key))
+        this->tilePrefetched(x,y,z,false,0);
+
+    //Give the client the tile again, this time as a fresh one
+    const MapTile stale = _revalidating.take(key);
+    if (!stale.isNull())
+        this->prepareRetrievedTile(key, stale.image(), expireTime);
+}
+
+//protected
+void MapTileSource::reportTileFailure(quint32 x, quint32 y, quint8 z, NegativeTileCache::FailureClass failure)
+{
+    const TileKey key(x,y,z);
+    _negativeCache->recordFailure(key, failure);
+    _metrics->countFailure();
+    this->reportTileUnavailable(x,y,z);
+}
+
+//protected
+void MapTileSource::reportTileUnavailable(quint32 x, quint32 y, quint8 z)
+{
+    const TileKey key(x,y,z);
+    const bool fetched = _fetching.remove(key);
+    const bool prefetched = _prefetching.remove(key);
+    const bool wanted = fetched || prefetched || _requestWaiters.contains(key);
+    this->finishFetch(key);
+    this->finishRequest(key, false);
+
+    //If this was a refresh, the client keeps the stale copy it already has but can stop waiting for a fresh one
+    _revalidating.remove(key);
+
+    //Nobody is told about tiles whose requests were all cancelled (see prepareReceivedTile())
+    if (wanted)
+        this->deliverFailure(key);
+}
+
+//protected
+void MapTileSource::abandonFetch(quint32 x, quint32 y, quint8 z)
+{
+    //It may have ended already, e.g. a refresh that was answered before it was given up on
+    if (!_fetching.contains(TileKey(x,y,z)))
         return;
+    this->reportTileUnavailable(x,y,z);
+}
 
-    if (!fp.open(QIODevice::ReadOnly))
+//protected virtual
+void MapTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    Q_UNUSED(x)
+    Q_UNUSED(y)
+    Q_UNUSED(z)
+}
+
+//protected virtual
+void MapTileSource::refreshTile(quint32 x, quint32 y, quint8 z, const QByteArray &etag, const QByteArray &lastModified)
+{
+    Q_UNUSED(etag)
+    Q_UNUSED(lastModified)
+    this->fetchTile(x,y,z);
+}
+
+//protected
+QDateTime MapTileSource::getTileExpirationTime(const TileKey &key)
+{
+    if (this->cacheMode() != DiskAndMemCaching)
+        return QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+
+    QSharedPointer<MapTileCache> cache = this->tileCache();
+    QDateTime expireTime = cache->expirationTime(key);
+    if (expireTime.isNull())
     {
-        qWarning() << "Failed to open cache expiration file for reading:" << fp.errorString();
-        return;
+        qWarning() << "Tile" << key.toString() << "has unknown expire time. Resetting to default of" << DEFAULT_CACHE_DAYS << "days.";
+        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+        cache->setExpirationTime(key, expireTime);
     }
 
-    QDataStream stream(&fp);
-    stream >> _cacheExpirations;
+    return expireTime;
 }
 
-void MapTileSource::saveCacheExpirationsToDisk()
+//protected
+void MapTileSource::setTileExpirationTime(const TileKey &key, QDateTime expireTime)
 {
-    if (!_cacheExpirationsLoaded || _cacheExpirationsFile.isEmpty())
-        return;
+    //If they told us when the tile expires, store that expiration. Otherwise, use the default.
+    if (expireTime.isNull())
+    {
+        expireTime = QDateTime::currentDateTimeUtc().addDays(DEFAULT_CACHE_DAYS);
+    }
+
+    if (this->cacheMode() == DiskAndMemCaching)
+        this->tileCache()->setExpirationTime(key, expireTime);
+}
 
-    QFile fp(_cacheExpirationsFile);
+//virtual
+QString MapTileSource::cacheIdentity() const
+{
+    return this->name();
+}
+
+//private
+QString MapTileSource::diskCacheDirectory() const
+{
+    QString toRet = QDir::homePath() % "/" % MAPGRAPHICS_CACHE_FOLDER_NAME % "/" % this->name();
+    return toRet;
+}
 
-    if (!fp.open(QIODevice::Truncate | QIODevice::WriteOnly))
+//private
+QSharedPointer<DiskTileCache> MapTileSource::diskCache()
+{
+    if (!_diskCache.isNull())
+        return _diskCache;
+
+    //Sources with the same name share a cache directory, so they had better share the cache too
+    const QString directory = this->diskCacheDirectory();
+    const bool sqlite = (_diskCacheBackend == SQLiteBackend && SQLiteDiskTileCache::isAvailable());
+    const QString location = sqlite ? directory % "/" % SQLITE_CACHE_FILE_NAME : directory;
+    const QString key = "disk/" % location;
+
+    QSharedPointer<MapTileCacheTier> shared = TileCacheRegistry::tier(key);
+    if (shared.isNull())
     {
-        qWarning() << "Failed to open cache expiration file for writing:" << fp.errorString();
-        return;
+        QSharedPointer<MapTileCacheTier> created;
+        if (sqlite)
+            created = QSharedPointer<MapTileCacheTier>(new SQLiteDiskTileCache(location,
+                                                                               this->name(),
+                                                                               this->tileFileExtension()));
+        else
+            created = QSharedPointer<MapTileCacheTier>(new FileTreeDiskTileCache(location,
+                                                                                 this->tileFileExtension()));
+        shared = TileCacheRegistry::addTier(key, created);
     }
+    _diskCache = shared.staticCast<DiskTileCache>();
+
+    //The janitor keeps it within its quota and clears out expired tiles in the background. Don't clobber a
+    //quota set by another source sharing the cache with a quota of our own.
+    if (_diskCacheQuota > 0 || DiskCacheJanitor::quota(_diskCache.data()) == 0)
+        DiskCacheJanitor::addCache(_diskCache, _diskCacheQuota);
+    if (_staleWhileRevalidate)
+        DiskCacheJanitor::setKeepsExpired(_diskCache.data(), true);
+    return _diskCache;
+}
+
+//private
+QSharedPointer<MemoryTileCache> MapTileSource::memoryCache(MapTileCacheTier::Representation representation) const
+{
+    QSharedPointer<MemoryTileCache>& cache = (representation == MapTileCacheTier::Decoded) ? _memoryCache
+                                                                                         : _encodedMemoryCache;
+    if (!cache.isNull())
+        return cache;
+
+    //Sources showing the same tiles share their memory caches
+    const QString key = "memory/" % QString::number(representation) % "/" % this->cacheIdentity();
+    QSharedPointer<MapTileCacheTier> shared = TileCacheRegistry::tier(key);
+    if (shared.isNull())
+    {
+        const quint64 budget = (representation == MapTileCacheTier::Decoded) ? DEFAULT_MEMORY_CACHE_BUDGET
+                                                                             : DEFAULT_ENCODED_MEMORY_CACHE_BUDGET;
+        shared = TileCacheRegistry::addTier(key, QSharedPointer<MapTileCacheTier>(new MemoryTileCache(representation,
+                                                                                                       budget)));
+    }
+    cache = shared.staticCast<MemoryTileCache>();
+    return cache;
+}
+
+//private
+QSharedPointer<MapTileCacheTier> MapTileSource::sharedMemoryCache()
+{
+    if (!_sharedMemoryCache.isNull())
+        return _sharedMemoryCache;
+
+    //cacheIdentity() can be a URL, so hash it into something that's safe (and stable) as a file name
+    const QByteArray identity = QCryptographicHash::hash(this->cacheIdentity().toUtf8(),
+                                                         QCryptographicHash::Md5).toHex();
+    const QString arenaFile = this->diskCacheDirectory() % "/shared-" % QString::fromLatin1(identity) % ".arena";
+    const QString key = "shared/" % arenaFile;
 
-    QDataStream stream(&fp);
-    stream << _cacheExpirations;
-    qDebug() << "Cache expirations saved to" << _cacheExpirationsFile;
+    //One mapping of the arena per process is plenty
+    QSharedPointer<MapTileCacheTier> shared = TileCacheRegistry::tier(key);
+    if (shared.isNull())
+        shared = TileCacheRegistry::addTier(key, QSharedPointer<MapTileCacheTier>(new SharedMemoryTileCache(arenaFile)));
+    _sharedMemoryCache = shared;
+    return _sharedMemoryCache;
 }
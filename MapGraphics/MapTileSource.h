@@ -5,14 +5,26 @@
 #include <QPoint>
 #include <QPointF>
 #include <QImage>
-#include <QCache>
 #include <QMutex>
 #include <QDateTime>
-#include <QDir>
-#include <QFile>
+#include <QElapsedTimer>
+#include <QSharedPointer>
 #include <QHash>
+#include <QSet>
+#include <QMap>
 
 #include "MapGraphics_global.h"
+#include "TileKey.h"
+#include "MapTile.h"
+#include "MapTileMetrics.h"
+#include "tileCaches/MemoryTileCache.h"
+#include "tileCaches/DiskTileCache.h"
+#include "tileCaches/MapTileCache.h"
+#include "tileCaches/NegativeTileCache.h"
+
+class TileTaskReceiver;
+class TileMetricsRecorder;
+class QTimer;
 
 class MAPGRAPHICSSHARED_EXPORT MapTileSource : public QObject
 {
@@ -29,14 +41,27 @@ public:
         DiskAndMemCaching
     };
 
+    /**
+     * @brief Enum used to pick where a MapTileSource keeps its disk cache. FileTreeBackend keeps one file
+     * per tile in a <z>/<x>/<y> directory tree. SQLiteBackend keeps all tiles, their expirations and some
+     * metadata in a single SQLite database per source.
+     *
+     */
+    enum DiskCacheBackend
+    {
+        FileTreeBackend,
+        SQLiteBackend
+    };
+
 public:
     explicit MapTileSource();
     virtual ~MapTileSource();
 
     /**
      * @brief Causes the MapTileSource to request the tile (x,y) at zoom level z.
-     * A tileRetrieved signal will be emitted when the tile is available, at which point it can be
-     * retrieved using getFinishedTile()
+     * A tileRetrieved signal carrying the tile will be emitted when the tile is available. Requests wait
+     * their turn in a queue ordered by setRequestFocus(). A request for a tile that is already being looked
+     * up or fetched joins the one underway, so subclasses only ever see one fetchTile() at a time per tile.
      *
      * @param x
      * @param y
@@ -45,21 +70,290 @@ public:
     void requestTile(quint32 x, quint32 y, quint8 z);
 
     /**
-     * @brief Retrieves a pointer to a retrieved image tile. You must call requestTile and wait for the
-     * tileRetrieved signal before calling this method. Returns a QImage pointer on success, null on failure.
-     * The caller takes ownership of the QImage pointer - i.e., the caller is responsible for deleting it.
+     * @brief Requests every tile in keys, like requestTile() does, but hands them all to the MapTileSource's
+     * thread at once. Use it when many tiles are needed at the same time (e.g., when laying out a view).
+     *
+     * @param keys
+     */
+    void requestTiles(const QList<TileKey>& keys);
+
+    /**
+     * @brief Tells the MapTileSource that a tile asked for with requestTile() isn't wanted anymore (e.g.,
+     * it has scrolled out of view). Once every request for the tile has been cancelled, whatever is still
+     * being done to get it is abandoned where the source can (see cancelFetch()), and neither
+     * tileRetrieved nor tileFailed is emitted for it unless it's requested again. Tiles being prefetched
+     * carry on regardless.
      *
      * @param x
      * @param y
      * @param z
-     * @return QImage
      */
-    QImage * getFinishedTile(quint32 x, quint32 y, quint8 z);
+    void cancelTile(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief Makes sure the tile (x,y) at zoom level z is in the cache, fetching it only if it isn't cached
+     * (or has expired). Cached tiles aren't read or decoded, and fetched tiles are stored without taking
+     * up room among the decoded tiles in RAM, so prefetching doesn't push out the tiles being looked at.
+     * tilePrefetched is emitted when done, or tileFailed if the tile couldn't be retrieved. Does nothing
+     * useful unless cacheMode() is DiskAndMemCaching. See MapTilePrefetcher for prefetching whole regions.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    virtual void prefetchTile(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief Tells the MapTileSource where the user is looking: centerQGS is the center of the view in
+     * scene coordinates at zoomLevel. Queued requests are served in order of zoom level (zoomLevel first,
+     * then the nearest ones) and then of distance from the center, with prefetches last of all. Until this
+     * is called, requests are served in the order they were made.
+     *
+     * @param centerQGS
+     * @param zoomLevel
+     */
+    virtual void setRequestFocus(const QPointF& centerQGS, quint8 zoomLevel);
+
+    /**
+     * @brief Returns the number of requests (and prefetches) that may be underway at once
+     *
+     * @return int
+     */
+    int maximumActiveRequests() const;
+
+    /**
+     * @brief Sets the number of requests (and prefetches) that may be underway at once. The rest wait in
+     * the queue, so that the ones that matter most aren't stuck behind the others. 0 means no limit.
+     * Defaults to 16.
+     *
+     * @param count
+     */
+    void setMaximumActiveRequests(int count);
 
     MapTileSource::CacheMode cacheMode() const;
 
     void setCacheMode(MapTileSource::CacheMode);
 
+    /**
+     * @brief Returns true if expired tiles are shown while they're being refreshed
+     *
+     * @return bool
+     */
+    bool staleWhileRevalidate() const;
+
+    /**
+     * @brief When enabled, a cached tile that has expired is handed to the client right away (flagged as
+     * expired, see MapTile::isExpired()) while a fresh copy is requested in the background with
+     * refreshTile(). Once the refresh comes back, tileRetrieved is emitted again for the same tile. Off by
+     * default, in which case expired tiles are thrown out and the client waits for the fresh copy. While
+     * enabled, the disk cache janitor leaves expired tiles alone and only evicts to stay within quota.
+     *
+     * @param enabled
+     */
+    void setStaleWhileRevalidate(bool enabled);
+
+    MapTileSource::DiskCacheBackend diskCacheBackend() const;
+
+    /**
+     * @brief Selects where the disk cache is kept. Changing the backend doesn't migrate tiles that are
+     * already cached --- they are simply not seen by the new backend. Falls back to FileTreeBackend if the
+     * Qt SQLite driver isn't available.
+     *
+     * @param backend
+     */
+    void setDiskCacheBackend(MapTileSource::DiskCacheBackend backend);
+
+    /**
+     * @brief Returns the cache that tiles are looked up in and stored to when cacheMode() is
+     * DiskAndMemCaching, creating it on first use. Unless setTileCache() was called, this is the default
+     * stack of decoded tiles in RAM, then encoded tiles in RAM, then (if enabled) the tiles shared with
+     * other processes, then the disk cache.
+     *
+     * @return QSharedPointer<MapTileCache>
+     */
+    QSharedPointer<MapTileCache> tileCache();
+
+    /**
+     * @brief Replaces the cache of this MapTileSource with one made of whatever tiers you like. Tiles
+     * cached in the old one are not migrated. Passing a null pointer goes back to the default cache.
+     *
+     * @param cache
+     */
+    void setTileCache(QSharedPointer<MapTileCache> cache);
+
+    /**
+     * @brief Returns the tile (x,y) at zoom level z if it's among the decoded tiles in RAM, or a null
+     * MapTile if it isn't. Nothing is requested and nothing else is checked, so this is cheap enough to call
+     * from any thread, e.g. to find something to show while a tile loads. The tile may be expired.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @return MapTile
+     */
+    virtual MapTile peekCachedTile(quint32 x, quint32 y, quint8 z) const;
+
+    /**
+     * @brief Returns the number of bytes of decoded tiles this MapTileSource may keep in its memory cache
+     *
+     * @return quint64
+     */
+    quint64 memoryCacheBudget() const;
+
+    /**
+     * @brief Sets the number of bytes of decoded tiles this MapTileSource may keep in its memory cache.
+     * The cost of a tile is the size of its pixel data, so the number of tiles that fit depends on the
+     * tile size and format. Can be called at any time from any thread.
+     *
+     * The decoded cache is meant to be small (it defaults to 32 256px tiles) since it sits in front of the
+     * much denser encoded memory cache. It is shared with other sources that have the same cacheIdentity().
+     *
+     * @param bytes
+     */
+    void setMemoryCacheBudget(quint64 bytes);
+
+    /**
+     * @brief Returns a snapshot of the memory cache's hit, miss and eviction counters and its current size.
+     * Safe to call from any thread.
+     *
+     * @return MemoryTileCache::Stats
+     */
+    MemoryTileCache::Stats memoryCacheStats() const;
+
+    /**
+     * @brief Returns the number of bytes of encoded (png, jpg, etc.) tiles this MapTileSource may keep in
+     * memory
+     *
+     * @return quint64
+     */
+    quint64 encodedMemoryCacheBudget() const;
+
+    /**
+     * @brief Sets the number of bytes of encoded tiles this MapTileSource may keep in memory. Encoded tiles
+     * are typically ten times smaller than decoded ones and are decoded on the worker pool when requested,
+     * so this is where most of a source's tiles are kept in RAM. Defaults to 32 MiB. Like the decoded cache,
+     * it is shared with other sources that have the same cacheIdentity(). Can be called at any time from
+     * any thread.
+     *
+     * @param bytes
+     */
+    void setEncodedMemoryCacheBudget(quint64 bytes);
+
+    /**
+     * @brief Returns a snapshot of the encoded memory cache's counters and its current size. Safe to call
+     * from any thread.
+     *
+     * @return MemoryTileCache::Stats
+     */
+    MemoryTileCache::Stats encodedMemoryCacheStats() const;
+
+    /**
+     * @brief Returns the budget, in bytes, shared by the memory caches of all MapTileSources. 0 means
+     * unlimited, which is the default.
+     *
+     * @return quint64
+     */
+    static quint64 globalMemoryCacheBudget();
+
+    /**
+     * @brief Sets the budget, in bytes, shared by the memory caches of all MapTileSources. When the sum of
+     * all memory caches exceeds this, the least recently used tiles process-wide are evicted. 0 means
+     * unlimited.
+     *
+     * @param bytes
+     */
+    static void setGlobalMemoryCacheBudget(quint64 bytes);
+
+    /**
+     * @brief Returns true if the default tile cache includes the tier shared with other processes
+     *
+     * @return bool
+     */
+    bool sharedMemoryCacheEnabled() const;
+
+    /**
+     * @brief Adds (or removes) a SharedMemoryTileCache between the in-memory tiers and the disk cache of
+     * the default tile cache, so that several applications on the same machine showing the same tiles
+     * find the ones a sibling already fetched. Processes share the arena if their sources have the same
+     * cacheIdentity(). Off by default.
+     *
+     * @param enabled
+     */
+    void setSharedMemoryCacheEnabled(bool enabled);
+
+    /**
+     * @brief Returns the number of bytes this MapTileSource may keep in its disk cache. 0 (the default)
+     * means it is only limited by the global disk cache quota.
+     *
+     * @return quint64
+     */
+    quint64 diskCacheQuota() const;
+
+    /**
+     * @brief Sets the number of bytes this MapTileSource may keep in its disk cache. The quota is enforced
+     * in the background, so the cache can briefly grow past it. 0 means only the global quota applies.
+     *
+     * @param bytes
+     */
+    void setDiskCacheQuota(quint64 bytes);
+
+    /**
+     * @brief Returns the quota, in bytes, shared by the disk caches of all MapTileSources. 0 means
+     * unlimited. Defaults to 1 GiB.
+     *
+     * @return quint64
+     */
+    static quint64 globalDiskCacheQuota();
+
+    /**
+     * @brief Sets the quota, in bytes, shared by the disk caches of all MapTileSources. When the disk
+     * caches together exceed it, the least recently used tiles process-wide are removed by a background
+     * janitor, which also removes expired tiles. 0 means unlimited.
+     *
+     * @param bytes
+     */
+    static void setGlobalDiskCacheQuota(quint64 bytes);
+
+    /**
+     * @brief Returns the tiles this MapTileSource recently failed to retrieve. Requests for those tiles
+     * fail right away (see tileFailed) until their time-to-live runs out, rather than going back to the
+     * server. Use it to adjust the time-to-lives or backoff, or clear() it when the network comes back.
+     * Thread-safe, and never null.
+     *
+     * @return QSharedPointer<NegativeTileCache>
+     */
+    QSharedPointer<NegativeTileCache> negativeCache() const;
+
+    /**
+     * @brief Returns a snapshot of this source's metrics: how requests were served, the hits and misses of
+     * each cache tier, what was downloaded, and the latency of each stage of a request. Safe to call from
+     * any thread, and cheap enough to poll.
+     *
+     * @return MapTileMetrics
+     */
+    virtual MapTileMetrics metrics() const;
+
+    /**
+     * @brief Starts the metrics over from zero
+     */
+    virtual void resetMetrics();
+
+    /**
+     * @brief Returns the number of worker threads shared by all MapTileSources for disk cache reads and
+     * image decoding.
+     *
+     * @return int
+     */
+    static int workerThreadCount();
+
+    /**
+     * @brief Sets the number of worker threads shared by all MapTileSources for disk cache reads and
+     * image decoding. Defaults to the number of CPU cores (but at least two).
+     *
+     * @param count
+     */
+    static void setWorkerThreadCount(int count);
+
     /**
      * @brief Converst from geo (lat,lon) coordinates into QGraphicsScene coordinates. A MapTileSource
      * implementation has to implement this method.
@@ -129,17 +423,47 @@ public:
      *
      */
     virtual QString tileFileExtension() const=0;
+
+    /**
+     * @brief Returns a string that identifies the tiles this MapTileSource serves. MapTileSources with the
+     * same identity share their memory caches (see TileCacheRegistry), so two sources showing the same
+     * tiles only download, decode and hold each tile once. The default is name(); sources whose tiles
+     * depend on more than their name should override it.
+     *
+     * @return QString
+     */
+    virtual QString cacheIdentity() const;
     
 signals:
     /**
-     * @brief Signal emitted when a tile that was requested with requestTile() has been retrieved and can
-     * be gotten at using getFinishedTile()
+     * @brief Signal emitted when a tile that was requested with requestTile() has been retrieved. Every
+     * receiver gets a handle to the same image, so keep it for as long as you like.
+     *
+     * @param tile
+     */
+    void tileRetrieved(MapTile tile);
+
+    /**
+     * @brief Signal emitted when a tile that was requested with requestTile() couldn't be retrieved, either
+     * just now or recently enough that it wasn't tried again (see negativeCache()).
      *
      * @param x
      * @param y
      * @param z
      */
-    void tileRetrieved(quint32 x, quint32 y, quint8 z);
+    void tileFailed(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief Signal emitted with every tile that tileRetrieved or tileFailed was emitted for since the last
+     * time, in the same order, so that clients in other threads get one event instead of one per tile. A
+     * tile that failed comes as a null MapTile with the tile's key.
+     *
+     * While a tile is fetched, a provisional stand-in (see MapTile::isProvisional()) may come first. It's
+     * only sent here, never with tileRetrieved.
+     *
+     * @param tiles
+     */
+    void tilesDelivered(QList<MapTile> tiles);
 
     /**
      * @brief Signal emitted when a tile is requested using requestTile().
@@ -150,88 +474,97 @@ signals:
      */
     void tileRequested(quint32 x, quint32 y, quint8 z);
 
-    /*!
-     \brief Emitted when vital parameters of the tile source have changed and anyone displaying the tiles should
-      refresh.
-
-    */
-    void allTilesInvalidated();
-    
-public slots:
-
-private slots:
-    void startTileRequest(quint32 x, quint32 y, quint8 z);
-    void clearTempCache();
-
-protected:
     /**
-     * @brief This static method takes the x,y,z of a tile and creates a unique string that is used
-     * as a key in the caches to keep track of the tile.
+     * @brief Signal emitted when tiles are requested using requestTiles().
      *
-     * @param x x-coordinate of the tile
-     * @param y y-coordinate of the tile
-     * @param z zoom-level of the tile
-     * @return QString unique cacheID
+     * @param keys
      */
-    static QString createCacheID(quint32 x, quint32 y, quint8 z);
+    void tilesRequested(QList<TileKey> keys);
 
     /**
-     * @brief This static convenience method takes a cacheID and places the numberical x,y,z values that
-     * generated the cacheID into the variables pointed to by x,y,z. Returns true on success, false on failure.
+     * @brief Signal emitted when a tile request is cancelled using cancelTile().
      *
-     * @param string the cacheID you are converting
-     * @param x where you want the x value
-     * @param y where you want the y value
-     * @param z where you want the z value
-     * @return bool
+     * @param x
+     * @param y
+     * @param z
      */
-    static bool cacheID2xyz(const QString & string, quint32 * x, quint32 * y, quint32 * z);
+    void tileCancelRequested(quint32 x, quint32 y, quint8 z);
 
     /**
-     * @brief Given a cacheID, retrieve the tile with that cacheID from memcache. Returns a pointer
-     * to a QImage on success, null on failure. Caller takes responsibility for deleting the returned
-     * QImage
+     * @brief Signal emitted when the request focus is changed using setRequestFocus().
      *
-     * @param cacheID cacheID of the tile you want to get from cache
-     * @return QImage
+     * @param centerQGS
+     * @param zoomLevel
      */
-    QImage * fromMemCache(const QString& cacheID);
+    void requestFocusChanged(QPointF centerQGS, quint8 zoomLevel);
 
     /**
-     * @brief Given a cacheID and a pointer to a QImage, inserts the QImage pointed to by the pointer into
-     * the memory cache using cacheID as the key
+     * @brief Signal emitted when a tile that was requested with prefetchTile() is in the cache. downloaded
+     * is false if it was already there, and bytes is the size of the encoded tile if it was fetched.
      *
-     * @param cacheID
-     * @param toCache
+     * @param x
+     * @param y
+     * @param z
+     * @param downloaded
+     * @param bytes
      */
-    void toMemCache(const QString& cacheID, QImage * toCache, const QDateTime &expireTime = QDateTime());
+    void tilePrefetched(quint32 x, quint32 y, quint8 z, bool downloaded, quint64 bytes);
 
     /**
-     * @brief Given a cacheID, retrieve the tile with that cacheID from the disk cache. Returns a
-     * pointer to a QImage on success, null on failure. Caller takes responsibility for deleting the
-     * returned QImage
+     * @brief Signal emitted when a tile is requested using prefetchTile().
      *
-     * @param cacheID cacheID of the tile you want to get from cache
-     * @return QImage
+     * @param x
+     * @param y
+     * @param z
      */
-    QImage * fromDiskCache(const QString& cacheID);
+    void tilePrefetchRequested(quint32 x, quint32 y, quint8 z);
 
-    /**
-     * @brief Given a cacheID and a pointer to a QImage, inserts the QImage pointed to by the pointer into
-     * the disk cache using cacheID as the key.
-     * Optionally, takes a QDateTime object that specifies the time that the QImage should be kept cached 
-     * until. Defaults to 7 days.
-     *
-     * @param cacheID
-     * @param toCache
-     * @param cacheUntil
-     */
-    void toDiskCache(const QString& cacheID, QImage * toCache, const QDateTime &expireTime = QDateTime());
+    /*!
+     \brief Emitted when vital parameters of the tile source have changed and anyone displaying the tiles should
+      refresh.
+
+    */
+    void allTilesInvalidated();
+    
+public slots:
+
+private slots:
+    void queueTileRequest(quint32 x, quint32 y, quint8 z);
+    void queueTileRequests(QList<TileKey> keys);
+    void queueTilePrefetch(quint32 x, quint32 y, quint8 z);
+    void startTileCancel(quint32 x, quint32 y, quint8 z);
+    void handleRequestFocusChanged(QPointF centerQGS, quint8 zoomLevel);
+
+    //Starts queued requests, best first, until there are no free slots
+    void dispatchQueuedRequests();
+
+    //Emits tilesDelivered with the tiles delivered since the last time
+    void flushDeliveries();
+
+    //Called (queued) by the worker pool when a lookup in the slow tiers of the cache finishes
+    void handleCacheLookupResult(TileKey key, CachedTile tile);
+
+    //Called (queued) by the worker pool when a prefetch has found out whether the tile is already cached
+    void handlePrefetchLookupResult(TileKey key, bool cached);
+
+    //Called (queued) by the worker pool when decodeNewlyReceivedTile() finishes
+    void handleDecodedTile(TileKey key, CachedTile tile);
+
+    //Called (queued) by the worker pool when the stand-in started by startProvisionalTile() is ready
+    void handleProvisionalTile(TileKey key, CachedTile tile);
+
+    //Called (queued) by the worker pool when cacheReceivedTile() has put a tile in the slow tiers of the cache
+    void handleCacheInsertDone(TileKey key);
+
+    //Called periodically to persist the disk cache's pending changes on the worker pool
+    void flushDiskCache();
 
+protected:
     /**
      * @brief Fetches (from MapQuest or OSM or whatever) or generates the tile if it isn't cached.
      * This is where the rubber hits the road, so to speak, for a MapTileSource. When successful, this method
-     * should just call prepareRetrievedTile. On failure, do nothing.
+     * should just call prepareNewlyReceivedTile. On failure, call reportTileFailure() so that the tile
+     * isn't requested again right away.
      *
      * @param x x-coordinate of the tile
      * @param y y-coordinate of the tile
@@ -242,79 +575,319 @@ protected:
                            quint32 y,
                            quint8 z)=0;
 
-    //Call only for tiles which were newly-generated or newly-acquired from the network (i.e., not cached)
-    void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QImage * image, QDateTime expireTime = QDateTime());
+    /**
+     * @brief Fetches a fresh copy of a tile that is cached but has expired, while the stale copy is being
+     * shown (see setStaleWhileRevalidate()). etag and lastModified are the validators stored with the
+     * stale copy, if any. If the source finds that the stale copy is still good (e.g., an HTTP server
+     * answers 304 Not Modified), it should call prepareRevalidatedTile(). Otherwise it should deliver the
+     * fresh tile like fetchTile() does. The default implementation just calls fetchTile().
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @param etag
+     * @param lastModified
+     */
+    virtual void refreshTile(quint32 x,
+                             quint32 y,
+                             quint8 z,
+                             const QByteArray& etag,
+                             const QByteArray& lastModified);
+
+    /**
+     * @brief Called when nobody wants a tile that fetchTile() or refreshTile() may still be working on
+     * anymore. Sources that can should stop (e.g., abort the network request) without reporting a
+     * failure, since the tile didn't fail. It's fine to call prepareNewlyReceivedTile() anyway if the tile
+     * is already on its way. The default implementation does nothing.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
+
+    /*
+      Call only for tiles which were newly-generated or newly-acquired from the network (i.e., not cached).
+      If the tile came from somewhere as encoded bytes (e.g., a network reply), pass those bytes as encoded
+      so that they can be cached as-is. Otherwise the image is encoded in tileFileExtension() format for
+      the cache tiers that keep encoded tiles.
+    */
+    void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QImage& image,
+                                  QDateTime expireTime = QDateTime(),
+                                  const QByteArray& encoded = QByteArray());
+
+    /*
+      Like prepareNewlyReceivedTile(), but for tiles that arrived as encoded bytes. The bytes are decoded on
+      a worker thread, after which the tile is cached (bytes as-is on disk) and the client is notified.
+      Tiles that can't be decoded are dropped with a warning.
+    */
+    void decodeNewlyReceivedTile(quint32 x, quint32 y, quint8 z, const QByteArray& encoded,
+                                 const QDateTime& expireTime = QDateTime(),
+                                 const QByteArray& etag = QByteArray(),
+                                 const QByteArray& lastModified = QByteArray());
+
+    /*
+      Call from refreshTile() when the cached copy of a tile turns out to still be good. Only its expiration
+      is updated --- nothing is downloaded or decoded again --- and the client is handed the tile again,
+      no longer expired.
+    */
+    void prepareRevalidatedTile(quint32 x, quint32 y, quint8 z, QDateTime expireTime = QDateTime());
+
+    /*
+      Call from fetchTile() or refreshTile() when a tile couldn't be retrieved. The tile goes into the
+      negative cache for the time-to-live of the failure class, and the client is told with tileFailed.
+    */
+    void reportTileFailure(quint32 x, quint32 y, quint8 z, NegativeTileCache::FailureClass failure);
+
+    /*
+      Like reportTileFailure(), but the failure isn't remembered, so the tile will be tried again the next
+      time it's requested. For sources whose tiles are made from other sources' tiles, which remember
+      their own failures.
+    */
+    void reportTileUnavailable(quint32 x, quint32 y, quint8 z);
+
+    /*
+      Like reportTileUnavailable(), but only if the tile is still being fetched. For sources that give up on
+      tiles behind MapTileSource's back, so that whoever is waiting on them isn't left waiting forever.
+    */
+    void abandonFetch(quint32 x, quint32 y, quint8 z);
 
     /**
      * @brief Returns the time when the tile is supposed to expire from any caches.
      * This should only be called on tiles which are actually cached!
-     * @param cacheID The cacheID of the tile
+     * @param key The TileKey of the tile
      * @return QDateTime of the tile's expiration (time after which it should be re-requested or regenerated)
      */
-    QDateTime getTileExpirationTime(const QString& cacheID);
+    QDateTime getTileExpirationTime(const TileKey& key);
 
     /**
      * @brief Sets the time when the tile is supposed to expire from any caches
-     * @param cacheID of the tile
+     * @param key of the tile
      * @param QDateTime of the tile's expiration (time after which it should be re-requested or regenerated)
      */
-    void setTileExpirationTime(const QString& cacheID, QDateTime expireTime);
+    void setTileExpirationTime(const TileKey& key, QDateTime expireTime);
 
 private:
+    //A tile waiting in the request queue
+    struct QueuedRequest
+    {
+        QueuedRequest() : priority(0), sequence(0), requests(0), prefetch(false) {}
+
+        quint64 priority;
+        quint32 sequence;
+
+        //How many requestTile() calls are waiting for it, and whether prefetchTile() is too
+        int requests;
+        bool prefetch;
+    };
+
+    //A received tile on its way into the slow tiers of the cache
+    struct PendingInsert
+    {
+        PendingInsert() : tasks(0) {}
+
+        CachedTile tile;
+        int tasks;
+    };
+
     /**
-     * @brief prepareRetrievedTile prepares a generated/retrieve tile for retrieval by the client
-     * and notifies the client that the tile is ready.
+     * @brief Adds a request (or a prefetch) for the tile to the queue and makes sure it'll be dispatched
      */
-    void prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage * image);
+    void queueTile(const TileKey& key, bool prefetch);
 
     /**
-     * @brief Given the x,y, and z of a tile, returns the directory where it should be cached on disk
-     *
-     * @param x
-     * @param y
-     * @param z
-     * @return QDir
+     * @brief Returns where a queued tile goes in the queue: lower comes first. Made of (from the top bits
+     * down) whether it's a prefetch, how far its zoom level is from the focus, its distance from the focus,
+     * and the order it was queued in.
+     */
+    quint64 requestPriority(const TileKey& key, const QueuedRequest& request) const;
+
+    /**
+     * @brief Looks the tile up in the cache and fetches it if it isn't there, for the given number of
+     * requestTile() calls
+     */
+    void startTileRequest(const TileKey& key, int requests);
+
+    /**
+     * @brief If a request for the tile is already underway, adds the given number of requestTile() calls
+     * to those waiting on it and returns true. Otherwise returns false.
+     */
+    bool joinTileRequest(const TileKey& key, int requests);
+
+    /**
+     * @brief Finds out whether the tile is cached, and fetches it for the cache if it isn't
+     */
+    void startTilePrefetch(const TileKey& key);
+
+    /**
+     * @brief Frees the slot a dispatched tile was holding, once it's been answered
+     */
+    void releaseRequestSlot(const TileKey& key);
+
+    /**
+     * @brief prepareRetrievedTile hands a generated/retrieved tile to the client by emitting
+     * tileRetrieved.
+     */
+    void prepareRetrievedTile(const TileKey& key, const QImage& image, const QDateTime& expireTime);
+
+    /**
+     * @brief Tells the client that the tile couldn't be had, with tileFailed now and tilesDelivered soon
+     */
+    void deliverFailure(const TileKey& key);
+
+    /**
+     * @brief Adds the tile (a null one for a failure) to the next tilesDelivered
+     */
+    void queueDelivery(const MapTile& tile);
+
+    /**
+     * @brief Caches a newly-received (and decoded) tile and hands it to the client
+     */
+    void prepareReceivedTile(const TileKey& key, CachedTile tile);
+
+    /**
+     * @brief Puts a newly-received tile in the cache: the decoded tiers right away, and the rest (which may
+     * encode it and write to disk) on the worker pool. Until that's done the tile is served from
+     * _pendingInserts.
+     */
+    void cacheReceivedTile(const TileKey& key, const CachedTile& tile, const CachedTile& toCache);
+
+    /**
+     * @brief Hands an expired tile to the client and starts refreshing it, unless that's already underway
+     */
+    void prepareStaleTile(const TileKey& key, const CachedTile& tile);
+
+    /**
+     * @brief Fetches a tile that isn't cached, unless it failed recently, in which case the client is told
+     * right away with tileFailed.
+     */
+    void fetchUncachedTile(const TileKey& key);
+
+    /**
+     * @brief If this is a quadtree and some of the tile's children on the next zoom level in are decoded in
+     * the cache, has them shrunk into a provisional stand-in for the tile on the worker pool. Anyone waiting
+     * on the tile gets it (see handleProvisionalTile()) unless the real tile beats it.
+     */
+    void startProvisionalTile(const TileKey& key);
+
+    /**
+     * @brief Records how long the fetch of a tile took, if it was being timed
+     */
+    void finishFetch(const TileKey& key);
+
+    /**
+     * @brief Records how long the request for a tile took to answer (if delivered), and stops timing it.
+     * If it wasn't delivered, nobody is waiting on the tile anymore.
      */
-    QDir getDiskCacheDirectory(quint32 x, quint32 y, quint8 z) const;
+    void finishRequest(const TileKey& key, bool delivered);
 
     /**
-     * @brief Given the x,y, and z of a tile, returns the full path to the file where it should be
-     * cached on disk
+     * @brief Returns the directory under which this source's disk cache lives
      *
-     * @param x
-     * @param y
-     * @param z
      * @return QString
      */
-    QString getDiskCacheFile(quint32 x, quint32 y, quint8 z) const;
+    QString diskCacheDirectory() const;
 
-    /*!
-     \brief Loads cache expiration times from disk if necessary
-    */
-    void loadCacheExpirationsFromDisk();
-
-    void saveCacheExpirationsToDisk();
+    /**
+     * @brief Returns the disk cache backend, creating it on first use. We can't create it in the
+     * constructor since it depends on name() and tileFileExtension(), which are pure-virtual there.
+     * Sources with the same name share the same disk cache. _cacheLock must be held.
+     *
+     * @return QSharedPointer<DiskTileCache>
+     */
+    QSharedPointer<DiskTileCache> diskCache();
 
-    bool _cacheExpirationsLoaded;
+    /**
+     * @brief Returns the memory cache of decoded or encoded tiles, getting it from the TileCacheRegistry
+     * on first use. Sources with the same cacheIdentity() share them. _cacheLock must be held.
+     *
+     * @param representation
+     * @return QSharedPointer<MemoryTileCache>
+     */
+    QSharedPointer<MemoryTileCache> memoryCache(MapTileCacheTier::Representation representation) const;
 
-    /*
-      loadCacheExpirationsFromDisk() stores the place where it loaded from here.
-      When we're destructing and need to serialize out we can use this instead of
-      foolishly trying to call a pure-virtual method (name()) from the destructor
-    */
-    QString _cacheExpirationsFile;
+    /**
+     * @brief Returns the tier shared with other processes, getting it from the TileCacheRegistry on first
+     * use. The arena file is named after cacheIdentity() so that every process picks the same one.
+     * _cacheLock must be held.
+     *
+     * @return QSharedPointer<MapTileCacheTier>
+     */
+    QSharedPointer<MapTileCacheTier> sharedMemoryCache();
 
     MapTileSource::CacheMode _cacheMode;
 
-    //Temporary cache for QImage tiles waiting for the client to take them
-    QCache<QString, QImage> _tempCache;
-    QMutex _tempCacheLock;
+    MapTileSource::DiskCacheBackend _diskCacheBackend;
+    QSharedPointer<DiskTileCache> _diskCache;
+    quint64 _diskCacheQuota;
 
-    //The "real" cache, where tiles are saved in memory so we don't download them again
-    QCache<QString, QImage> _memoryCache;
+    //The tile cache, and whether it's the default one made of our own tiers
+    QSharedPointer<MapTileCache> _tileCache;
+    bool _defaultTileCache;
+
+    //Protects the disk and tile caches
+    mutable QMutex _cacheLock;
+
+    //The in-memory tiers of the default tile cache: decoded tiles, and the encoded bytes they came from
+    mutable QSharedPointer<MemoryTileCache> _memoryCache;
+    mutable QSharedPointer<MemoryTileCache> _encodedMemoryCache;
+
+    //The optional tier shared with other processes
+    bool _sharedMemoryCacheEnabled;
+    QSharedPointer<MapTileCacheTier> _sharedMemoryCache;
+
+    //Whether expired tiles are shown while they're refreshed, and the ones being refreshed right now
+    bool _staleWhileRevalidate;
+    QHash<TileKey, MapTile> _revalidating;
+
+    //Tiles being fetched for prefetchTile()
+    QSet<TileKey> _prefetching;
+
+    //Received tiles that the worker pool hasn't finished putting in the slow tiers of the cache yet
+    QHash<TileKey, PendingInsert> _pendingInserts;
+
+    //How many requestTile() calls are waiting on each tile, and the tiles whose requests were all cancelled
+    QHash<TileKey, int> _requestWaiters;
+    QSet<TileKey> _cancelled;
+
+    //Tiles that fetchTile() or refreshTile() is working on, so that nobody else starts them again
+    QSet<TileKey> _fetching;
+
+    //Requests that haven't been dispatched yet, best first, and the tiles that have (with when, in _clock msecs)
+    QMap<quint64, TileKey> _requestQueue;
+    QHash<TileKey, QueuedRequest> _queuedRequests;
+    QHash<TileKey, qint64> _activeRequests;
+    int _maxActiveRequests;
+    quint32 _requestSequence;
+    bool _dispatching;
+    bool _dispatchScheduled;
+
+    //Tiles handed over since tilesDelivered was last emitted
+    QList<MapTile> _deliveries;
+    bool _deliveriesScheduled;
+
+    //Where the user is looking, which decides the order of the queue
+    bool _haveRequestFocus;
+    QPointF _requestFocusCenter;
+    quint8 _requestFocusZoom;
+
+    //Metrics, and when the requests and fetches underway started (in msecs of _clock)
+    QSharedPointer<TileMetricsRecorder> _metrics;
+    QElapsedTimer _clock;
+    QHash<TileKey, qint64> _requestStarts;
+    QHash<TileKey, qint64> _fetchStarts;
+
+    //Tiles that failed recently and shouldn't be requested again yet
+    QSharedPointer<NegativeTileCache> _negativeCache;
+
+    //Lets work on the worker pool post results back to us without outliving us
+    QSharedPointer<TileTaskReceiver> _taskReceiver;
+
+    //Periodically persists the disk cache so a crash loses at most a few seconds of changes
+    QTimer * _diskFlushTimer;
 
-    QHash<QString, QDateTime> _cacheExpirations;
-    
 };
 
 #endif // MAPTILESOURCE_H
@@ -0,0 +1,46 @@
+#include "TileKey.h"
+
+#include <QStringBuilder>
+#include <QStringList>
+
+const quint8 TileKey::MAX_ZOOM_LEVEL;
+const quint32 TileKey::MAX_COORDINATE;
+
+QString TileKey::toString() const
+{
+    //We use % because it's more efficient to concatenate with QStringBuilder
+    QString toRet = QString::number(this->x()) % "," % QString::number(this->y()) % "," % QString::number(this->z());
+    return toRet;
+}
+
+//static
+TileKey TileKey::fromString(const QString &string, bool *ok)
+{
+    if (ok)
+        *ok = false;
+
+    QStringList list = string.split(',');
+    if (list.size() != 3)
+        return TileKey();
+
+    bool good = true;
+    const quint32 x = list.at(0).toUInt(&good);
+    if (!good)
+        return TileKey();
+    const quint32 y = list.at(1).toUInt(&good);
+    if (!good)
+        return TileKey();
+    const quint32 z = list.at(2).toUInt(&good);
+    if (!good || z > Z_MASK)
+        return TileKey();
+
+    if (ok)
+        *ok = true;
+    return TileKey(x,y,z);
+}
+
+QDebug operator<<(QDebug dbg, const TileKey &key)
+{
+    dbg.nospace() << "TileKey(" << key.x() << "," << key.y() << "," << key.z() << ")";
+    return dbg.space();
+}
@@ -0,0 +1,93 @@
+#ifndef TILEKEY_H
+#define TILEKEY_H
+
+#include <QtGlobal>
+#include <QHash>
+#include <QMetaType>
+#include <QString>
+#include <QtDebug>
+
+#include "MapGraphics_global.h"
+
+/**
+ * @brief Compact, hashable identifier for a map tile. The x,y,z of the tile are packed into a single
+ * quint64 (6 bits of zoom level, 29 bits each of x and y) so that keys can be compared, hashed and copied
+ * without allocating. This is what all of the tile caches and pending-request tables are keyed on.
+ *
+ * Zoom levels up to 29 can be represented exactly, which covers every real-world tile scheme.
+ * Use toString() when you need something human-readable (logging, on-disk names).
+ */
+class MAPGRAPHICSSHARED_EXPORT TileKey
+{
+public:
+    inline TileKey() : _packed(0) {}
+    inline TileKey(quint32 x, quint32 y, quint8 z) :
+        _packed((quint64(z & Z_MASK) << Z_SHIFT) | (quint64(x & XY_MASK) << X_SHIFT) | quint64(y & XY_MASK)) {}
+
+    inline quint32 x() const { return quint32((_packed >> X_SHIFT) & XY_MASK); }
+    inline quint32 y() const { return quint32(_packed & XY_MASK); }
+    inline quint8 z() const { return quint8((_packed >> Z_SHIFT) & Z_MASK); }
+
+    /**
+     * @brief Returns the packed 64-bit representation of the key
+     *
+     * @return quint64
+     */
+    inline quint64 packed() const { return _packed; }
+
+    /**
+     * @brief Rebuilds a TileKey from the value returned by packed()
+     *
+     * @param packed
+     * @return TileKey
+     */
+    static inline TileKey fromPacked(quint64 packed) { TileKey toRet; toRet._packed = packed; return toRet; }
+
+    /**
+     * @brief Returns the "x,y,z" string form of the key. Meant for logging and on-disk names only ---
+     * don't use it as a cache key.
+     *
+     * @return QString
+     */
+    QString toString() const;
+
+    /**
+     * @brief Parses the "x,y,z" form produced by toString(). Sets ok (if non-null) to false and returns
+     * a default TileKey on failure.
+     *
+     * @param string
+     * @param ok
+     * @return TileKey
+     */
+    static TileKey fromString(const QString& string, bool * ok = 0);
+
+    //The largest zoom level and x/y a key can hold. Anything bigger wraps around.
+    static const quint8 MAX_ZOOM_LEVEL = 0x3F;
+    static const quint32 MAX_COORDINATE = 0x1FFFFFFF;
+
+    inline bool operator ==(const TileKey& other) const { return _packed == other._packed; }
+    inline bool operator !=(const TileKey& other) const { return _packed != other._packed; }
+    inline bool operator <(const TileKey& other) const { return _packed < other._packed; }
+
+private:
+    static const int Z_SHIFT = 58;
+    static const int X_SHIFT = 29;
+    static const quint64 Z_MASK = 0x3F;
+    static const quint64 XY_MASK = 0x1FFFFFFF;
+
+    quint64 _packed;
+};
+
+Q_DECLARE_TYPEINFO(TileKey, Q_PRIMITIVE_TYPE);
+Q_DECLARE_METATYPE(TileKey)
+
+//Non-member method for hashing
+inline uint qHash(const TileKey& key)
+{
+    return qHash(key.packed());
+}
+
+//Non-member method for streaming to qDebug
+MAPGRAPHICSSHARED_EXPORT QDebug operator<<(QDebug dbg, const TileKey& key);
+
+#endif // TILEKEY_H
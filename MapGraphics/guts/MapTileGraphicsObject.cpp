@@ -3,15 +3,19 @@
 #include <QPainter>
 #include <QtDebug>
 
+//How many zoom levels out we look for a tile to blow up while ours loads. Three levels out, the piece that
+//covers us is only a few dozen pixels wide, which is about as blurry as is still worth showing.
+const int MAX_PLACEHOLDER_LEVELS = 3;
+
 MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
 {
     this->setTileSize(tileSize);
-    _tile = 0;
     _tileX = 0;
     _tileY = 0;
     _tileZoom = 0;
     _initialized = false;
     _havePendingRequest = false;
+    _tileFailed = false;
 
     //Default z-value is important --- used in MapGraphicsView
     this->setZValue(-1.0);
@@ -19,11 +23,8 @@ MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
 
 MapTileGraphicsObject::~MapTileGraphicsObject()
 {
-    if (_tile != 0)
-    {
-        delete _tile;
-        _tile = 0;
-    }
+    this->cancelPendingRequest();
+    this->unsubscribe();
 }
 
 QRectF MapTileGraphicsObject::boundingRect() const
@@ -41,15 +42,21 @@ void MapTileGraphicsObject::paint(QPainter *painter, const QStyleOptionGraphicsI
     Q_UNUSED(widget)
 
 qDebug() << __FILE__ << ":" << __PRETTY_FUNCTION__ << ":" << __LINE__;
-    //If we've got a tile, draw it. Otherwise, show a loading or "No tile source" message
-    if (_tile != 0)
-        painter->drawPixmap(this->boundingRect().toRect(),
-                            *_tile);
+    //If we've got a tile (or a stand-in for it), draw it. Otherwise, show a loading or "No tile source" message
+    //The image is shared with the tile source and its caches, and was put in a paintable format off this thread
+    if (!_tile.isNull())
+        painter->drawImage(this->boundingRect().toRect(),
+                           _tile.image());
+    else if (!_placeholder.isNull())
+        painter->drawImage(this->boundingRect().toRect(),
+                           _placeholder);
     else
     {
         QString string;
         if (_tileSource.isNull())
             string = " No tile source defined";
+        else if (_tileFailed)
+            string = " Tile unavailable";
         else
             string = " Loading...";
         painter->drawText(this->boundingRect(),
@@ -76,12 +83,14 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
     if (_tileX == x && _tileY == y && _tileZoom == z && !force && _initialized)
         return;
 
+    //We don't want the old tile anymore, even if it hasn't come yet (if it's the same tile, it was invalidated)
+    this->cancelPendingRequest();
+    this->unsubscribe();
+
     //Get rid of the old tile
-    if (_tile != 0)
-    {
-        delete _tile;
-        _tile = 0;
-    }
+    _tile = MapTile();
+    _placeholder = QImage();
+    _tileFailed = false;
 
     //Store information for the tile we're requesting
     _tileX = x;
@@ -93,18 +102,19 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
     if (_tileSource.isNull())
         return;
 
-    //If our tile source is good, connect to the signal we'll need to get the result after requesting
-    connect(_tileSource.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-            this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    //Show something better than "Loading..." in the meantime if we can
+    this->findAncestorPlaceholder();
+
+    //If our tile source is good, ask its dispatcher for the result before requesting
+    _dispatcher->subscribe(TileKey(x,y,z), this);
 
     //Make sure we know that we're requesting a tile
     _havePendingRequest = true;
 
-    //Request the tile from tileSource, which will emit tileRetrieved when finished
+    //Request the tile from tileSource (along with the rest of the layout's tiles, through the dispatcher),
+    //which will call tileDelivered when finished
     //qDebug() << this << "requests" << x << y << z;
-    _tileSource->requestTile(x,y,z);
+    _dispatcher->requestTile(TileKey(x,y,z));
 }
 
 QSharedPointer<MapTileSource> MapTileGraphicsObject::tileSource() const
@@ -117,10 +127,8 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
     //Disconnect from the old source, if applicable
     if (!_tileSource.isNull())
     {
-        QObject::disconnect(_tileSource.data(),
-                            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-                            this,
-                            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+        this->cancelPendingRequest();
+        this->unsubscribe();
         QObject::disconnect(_tileSource.data(),
                             SIGNAL(allTilesInvalidated()),
                             this,
@@ -130,6 +138,7 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
     //Set the new source
     QSharedPointer<MapTileSource> oldSource = _tileSource;
     _tileSource = nSource;
+    _dispatcher = TileDeliveryDispatcher::forSource(nSource);
 
     //Connect signals if approprite
     if (!_tileSource.isNull())
@@ -138,7 +147,7 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
                 SIGNAL(allTilesInvalidated()),
                 this,
                 SLOT(handleTileInvalidation()));
-        //We connect/disconnect the "tileRetrieved" signal as needed and don't do it here!
+        //Tiles come through _dispatcher, which we subscribe to as needed
     }
 
     //Force a refresh from the new source
@@ -146,70 +155,130 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
 }
 
 //private slot
-void MapTileGraphicsObject::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+void MapTileGraphicsObject::handleTileInvalidation()
 {
-    //If we don't care about retrieved tiles (i.e., we haven't requested a tile), return
-    //This shouldn't actually happen as the signal/slot should get disconnected
-    if (!_havePendingRequest)
+    //If we haven't been initialized with a proper tile coordinate to fetch yet, don't force a refresh
+    if (!_initialized)
         return;
 
-    //If this isn't the tile we're looking for, return
-    else if (_tileX != x || _tileY != y || _tileZoom != z)
-        return;
+    //Call setTile with force=true so that it forces a refresh
+    this->setTile(_tileX,_tileY,_tileZoom,true);
+}
 
-    //Now we know that our tile has been retrieved by the MapTileSource. We just need to get it.
-    _havePendingRequest = false;
+//private
+void MapTileGraphicsObject::tileDelivered(const MapTile &tile)
+{
+    //If we don't care about retrieved tiles (i.e., we haven't requested a tile), return
+    //This shouldn't actually happen as we unsubscribe once we have our tile
+    if (!_havePendingRequest)
+        return;
 
     //Make sure some mischevious person hasn't set our MapTileSource to null while we weren't looking...
     if (_tileSource.isNull())
         return;
 
-    QImage * image = _tileSource->getFinishedTile(x,y,z);
-
-    //Make sure someone didn't snake us to grabbing our tile
-    if (image == 0)
+    if (tile.isNull())
     {
-        qWarning() << "Failed to get tile" << x << y << z << "from MapTileSource";
+        qWarning() << "Got null tile" << tile.key() << "from MapTileSource";
         return;
     }
 
-    //Convert the QImage to a QPixmap
-    //We have to do this here since we can't use QPixmaps in non-GUI threads (i.e., MapTileSource)
-    QPixmap * tile = new QPixmap();
-    *tile = QPixmap::fromImage(*image);
-
-    //Delete the QImage
-    delete image;
-    image = 0;
-
-    //Make sure that the old tile has been disposed of. If it hasn't, do it
-    //In reality, it should have been, so display a warning
-    if (_tile != 0)
+    //A stand-in while the real tile comes. It's better than an ancestor's upscaled piece, but not than a tile.
+    if (tile.isProvisional())
     {
-        qWarning() << "Tile should be null, but isn't";
-        delete _tile;
-        _tile = 0;
+        if (_tile.isNull())
+        {
+            _placeholder = tile.image();
+            this->update();
+        }
+        return;
     }
 
     //Set the new tile and force a redraw
     _tile = tile;
+    _placeholder = QImage();
     this->update();
 
-    //Disconnect our signal/slot connection with MapTileSource until we need to do another request
-    //It remains to be seen if it's better to continually connect/reconnect or just to filter events
-    QObject::disconnect(_tileSource.data(),
-                        SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-                        this,
-                        SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    //An expired tile is being refreshed, so keep listening for the fresh copy
+    if (tile.isExpired())
+        return;
+
+    //Now we know that our tile has been retrieved by the MapTileSource
+    _havePendingRequest = false;
+
+    //Stop listening until we need to do another request
+    this->unsubscribe();
 }
 
-//private slot
-void MapTileGraphicsObject::handleTileInvalidation()
+//private
+void MapTileGraphicsObject::tileDeliveryFailed(const TileKey &key)
 {
-    //If we haven't been initialized with a proper tile coordinate to fetch yet, don't force a refresh
-    if (!_initialized)
+    Q_UNUSED(key)
+    if (!_havePendingRequest)
         return;
 
-    //Call setTile with force=true so that it forces a refresh
-    this->setTile(_tileX,_tileY,_tileZoom,true);
+    if (_tileSource.isNull())
+        return;
+
+    //If we're showing an expired copy, it's still better than nothing. Otherwise, say what happened.
+    _havePendingRequest = false;
+    if (_tile.isNull())
+    {
+        _tileFailed = true;
+        this->update();
+    }
+
+    //The source won't try again until the tile's failure wears off, so neither do we until we're re-laid out
+    this->unsubscribe();
+}
+
+//private
+void MapTileGraphicsObject::cancelPendingRequest()
+{
+    if (!_havePendingRequest || _tileSource.isNull())
+        return;
+
+    _havePendingRequest = false;
+    if (!_dispatcher.isNull())
+        _dispatcher->cancelTile(TileKey(_tileX,_tileY,_tileZoom));
+}
+
+//private
+void MapTileGraphicsObject::findAncestorPlaceholder()
+{
+    //Only quadtrees have a parent tile a quarter of which is ours
+    if (_tileZoom == 0
+            || _tileSource->tilesOnZoomLevel(_tileZoom) != 4 * _tileSource->tilesOnZoomLevel(_tileZoom - 1))
+        return;
+
+    for (int levels = 1; levels <= MAX_PLACEHOLDER_LEVELS && levels <= _tileZoom; levels++)
+    {
+        const MapTile ancestor = _tileSource->peekCachedTile(_tileX >> levels,
+                                                             _tileY >> levels,
+                                                             _tileZoom - levels);
+        if (ancestor.isNull())
+            continue;
+
+        //Our piece of the ancestor is 1/2^levels of it on each side
+        const QImage& image = ancestor.image();
+        const quint32 mask = (1 << levels) - 1;
+        const int width = image.width() >> levels;
+        const int height = image.height() >> levels;
+        if (width < 1 || height < 1)
+            return;
+
+        const QRect piece((_tileX & mask) * width, (_tileY & mask) * height, width, height);
+        _placeholder = image.copy(piece).scaled(this->tileSize(),
+                                                this->tileSize(),
+                                                Qt::IgnoreAspectRatio,
+                                                Qt::SmoothTransformation);
+        return;
+    }
+}
+
+//private
+void MapTileGraphicsObject::unsubscribe()
+{
+    if (!_dispatcher.isNull() && _initialized)
+        _dispatcher->unsubscribe(TileKey(_tileX,_tileY,_tileZoom), this);
 }
@@ -5,8 +5,9 @@
 #include <QPointer>
 
 #include "MapTileSource.h"
+#include "TileDeliveryDispatcher.h"
 
-class MapTileGraphicsObject : public QGraphicsObject
+class MapTileGraphicsObject : public QGraphicsObject, private TileDeliveryDispatcher::Subscriber
 {
     Q_OBJECT
 public:
@@ -27,7 +28,6 @@ public:
 
 
 private slots:
-    void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
     void handleTileInvalidation();
     
 signals:
@@ -36,8 +36,26 @@ signals:
 public slots:
 
 private:
+    //virtual from TileDeliveryDispatcher::Subscriber
+    virtual void tileDelivered(const MapTile& tile);
+
+    //virtual from TileDeliveryDispatcher::Subscriber
+    virtual void tileDeliveryFailed(const TileKey& key);
+
+    //Tells the tile source we don't need the tile we asked for, if we're still waiting on it
+    void cancelPendingRequest();
+
+    //Makes a stand-in for our tile out of the nearest ancestor that's already decoded in RAM, if there is one
+    void findAncestorPlaceholder();
+
+    //Stops listening for the result of our tile request
+    void unsubscribe();
+
     quint16 _tileSize;
-    QPixmap * _tile;
+    MapTile _tile;
+
+    //Shown while _tile is null, e.g. a blown-up piece of the tile one zoom level out
+    QImage _placeholder;
     quint32 _tileX;
     quint32 _tileY;
     quint8 _tileZoom;
@@ -46,7 +64,13 @@ private:
 
     bool _havePendingRequest;
 
+    //Whether the tile source told us it couldn't get our tile
+    bool _tileFailed;
+
     QSharedPointer<MapTileSource> _tileSource;
+
+    //Hands us our tile without us having to look at everyone else's
+    QSharedPointer<TileDeliveryDispatcher> _dispatcher;
     
 };
 
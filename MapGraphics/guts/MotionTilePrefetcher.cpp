@@ -0,0 +1,166 @@
+#include "MotionTilePrefetcher.h"
+
+#include <cmath>
+
+//A layout this long after the last one isn't part of the same pan
+const qint64 MAX_SAMPLE_GAP_MS = 1000;
+
+//How much of each new sample goes into the smoothed velocity
+const qreal VELOCITY_SMOOTHING = 0.5;
+
+//Slower than this (in tiles per second) and the view's own ring of tiles is enough
+const qreal MIN_TILES_PER_SECOND = 0.25;
+
+//How far ahead we look, in time and (for very fast pans) in tiles
+const qreal LOOKAHEAD_SECONDS = 2.0;
+const qreal MAX_LOOKAHEAD_TILES = 8.0;
+
+//How far the view's ring of tiles reaches, in seconds of panning and at most in tiles
+const qreal OVERSCAN_SECONDS = 0.5;
+const int MAX_OVERSCAN_TILES = 4;
+
+//Forgotten tiles just get prefetched again, which the source sees are cached
+const int MAX_REMEMBERED_TILES = 4096;
+
+MotionTilePrefetcher::MotionTilePrefetcher() :
+    _lastTime(0), _lastZoomLevel(0), _overscan(0)
+{
+}
+
+void MotionTilePrefetcher::setTileSource(QSharedPointer<MapTileSource> source)
+{
+    _source = source;
+    _dispatcher = TileDeliveryDispatcher::forSource(source);
+    this->reset();
+}
+
+void MotionTilePrefetcher::update(const QRectF &viewportQGS, quint8 zoomLevel)
+{
+    //Nothing to prefetch from until the view has a tile source
+    if (_source.isNull())
+        return;
+
+    //A zoom isn't a pan, and what we prefetched was for the old zoom level
+    if (!_clock.isValid() || zoomLevel != _lastZoomLevel)
+    {
+        this->reset();
+        _clock.start();
+        _lastTime = _clock.elapsed();
+        _lastCenter = viewportQGS.center();
+        _lastZoomLevel = zoomLevel;
+        return;
+    }
+
+    const qint64 now = _clock.elapsed();
+    const qint64 elapsed = now - _lastTime;
+    if (elapsed <= 0)
+        return;
+
+    const QPointF moved = viewportQGS.center() - _lastCenter;
+    _lastTime = now;
+    _lastCenter = viewportQGS.center();
+
+    if (elapsed > MAX_SAMPLE_GAP_MS)
+    {
+        _velocity = QPointF();
+        _overscan = 0;
+        return;
+    }
+    _velocity = _velocity * (1.0 - VELOCITY_SMOOTHING) + moved * (1000.0 / elapsed) * VELOCITY_SMOOTHING;
+
+    const quint16 tileSize = _source->tileSize();
+    const qreal speed = sqrt(_velocity.x() * _velocity.x() + _velocity.y() * _velocity.y());
+    if (tileSize == 0 || speed < MIN_TILES_PER_SECOND * tileSize)
+    {
+        _overscan = 0;
+        return;
+    }
+
+    int budget = this->tileBudget(viewportQGS, tileSize);
+
+    //The ring comes out of the same budget: each tile of it on every side costs a row or column of tiles
+    const qint64 ringTiles = 2 * qint64(ceil(viewportQGS.width() / tileSize) + ceil(viewportQGS.height() / tileSize) + 4);
+    _overscan = qMin(MAX_OVERSCAN_TILES, int(ceil(speed * OVERSCAN_SECONDS / tileSize)));
+    while (_overscan > 0 && _overscan * ringTiles > budget)
+        _overscan--;
+    budget -= int(_overscan * ringTiles);
+    if (budget <= 0)
+        return;
+
+    //The faster we go, the farther ahead we look
+    const qreal lookahead = qMin(speed * LOOKAHEAD_SECONDS, MAX_LOOKAHEAD_TILES * tileSize);
+    const QPointF direction = _velocity / speed;
+    const qint64 tilesPerSide = (qint64) sqrt((long double)_source->tilesOnZoomLevel(zoomLevel));
+
+    //The view requests what's on screen and a little more, so we start past that
+    const qreal margin = qreal(_overscan + 1) * tileSize;
+    const QRectF covered = viewportQGS.adjusted(-margin, -margin, margin, margin);
+
+    //Slide the viewport ahead half a tile at a time, collecting the tiles it would show. Nearest first.
+    QList<TileKey> ahead;
+    QSet<TileKey> seen;
+    for (qreal distance = tileSize / 2.0; distance <= lookahead && ahead.size() < budget; distance += tileSize / 2.0)
+    {
+        const QRectF swept = viewportQGS.translated(direction * distance);
+        const qint64 xFirst = qMax<qint64>(0, floor(swept.left() / tileSize));
+        const qint64 yFirst = qMax<qint64>(0, floor(swept.top() / tileSize));
+        const qint64 xLast = qMin<qint64>(tilesPerSide - 1, floor(swept.right() / tileSize));
+        const qint64 yLast = qMin<qint64>(tilesPerSide - 1, floor(swept.bottom() / tileSize));
+
+        for (qint64 x = xFirst; x <= xLast && ahead.size() < budget; x++)
+        {
+            for (qint64 y = yFirst; y <= yLast && ahead.size() < budget; y++)
+            {
+                const QRectF tileRect(x * tileSize, y * tileSize, tileSize, tileSize);
+                if (covered.contains(tileRect))
+                    continue;
+
+                const TileKey key(x, y, zoomLevel);
+                if (seen.contains(key))
+                    continue;
+                seen.insert(key);
+                ahead.append(key);
+            }
+        }
+    }
+
+    if (_prefetched.size() + ahead.size() > MAX_REMEMBERED_TILES)
+        _prefetched.clear();
+
+    foreach(const TileKey& key, ahead)
+    {
+        if (_prefetched.contains(key))
+            continue;
+        _prefetched.insert(key);
+        _dispatcher->prefetchTile(key);
+    }
+}
+
+void MotionTilePrefetcher::reset()
+{
+    _clock.invalidate();
+    _velocity = QPointF();
+    _overscan = 0;
+    _prefetched.clear();
+}
+
+QPointF MotionTilePrefetcher::velocity() const
+{
+    return _velocity;
+}
+
+int MotionTilePrefetcher::overscanTiles() const
+{
+    return _overscan;
+}
+
+//private
+int MotionTilePrefetcher::tileBudget(const QRectF &viewportQGS, quint16 tileSize) const
+{
+    //As many decoded tiles as the source keeps in RAM, less the ones on screen (and the view's ring of them)
+    const quint64 tileBytes = quint64(tileSize) * tileSize * 4;
+    const qint64 cacheTiles = _source->memoryCacheBudget() / tileBytes;
+    const qint64 onScreen = qint64(ceil(viewportQGS.width() / tileSize) + 2)
+            * qint64(ceil(viewportQGS.height() / tileSize) + 2);
+    return int(qBound<qint64>(0, cacheTiles - onScreen, MAX_REMEMBERED_TILES));
+}
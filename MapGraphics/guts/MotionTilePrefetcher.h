@@ -0,0 +1,70 @@
+#ifndef MOTIONTILEPREFETCHER_H
+#define MOTIONTILEPREFETCHER_H
+
+#include <QElapsedTimer>
+#include <QPointF>
+#include <QRectF>
+#include <QSet>
+#include <QSharedPointer>
+
+#include "MapTileSource.h"
+#include "TileDeliveryDispatcher.h"
+#include "TileKey.h"
+
+/*!
+ \brief Prefetches the tiles a MapGraphicsView is about to pan over. Every tile layout tells it where the
+ viewport is; from how far the viewport moved since the last layout it keeps a smoothed velocity, and
+ prefetches (see MapTileSource::prefetchTile(), which the source serves after every request) the tiles
+ the viewport will sweep over in the next couple of seconds, nearest first. They go through the source's
+ TileDeliveryDispatcher, behind the requests of the same layout.
+
+ The faster the pan, the farther ahead it looks, and the wider the ring of tiles (see overscanTiles()) the
+ view lays out around the viewport. How many tiles it keeps ahead is bounded by the source's memory cache
+ budget, less what's on screen, so that the tiles it brings in don't push out the ones being looked at
+ before they're needed. Belongs to the GUI thread.
+*/
+class MotionTilePrefetcher
+{
+public:
+    MotionTilePrefetcher();
+
+    void setTileSource(QSharedPointer<MapTileSource> source);
+
+    /*!
+     \brief Called with the viewport (in QGraphicsScene coordinates) every time the view lays out its tiles
+    */
+    void update(const QRectF& viewportQGS, quint8 zoomLevel);
+
+    /*!
+     \brief Forgets the motion so far, e.g., after a jump that wasn't a pan
+    */
+    void reset();
+
+    //Returns the smoothed velocity of the viewport, in QGraphicsScene units per second
+    QPointF velocity() const;
+
+    /*!
+     \brief Returns how many tiles beyond its usual ring the view should lay out on each side of the
+     viewport, for the speed of the pan as of the last update(). 0 when the view isn't panning.
+    */
+    int overscanTiles() const;
+
+private:
+    //Returns the most tiles it may keep ahead of a viewport of the given size
+    int tileBudget(const QRectF& viewportQGS, quint16 tileSize) const;
+
+    QSharedPointer<MapTileSource> _source;
+    QSharedPointer<TileDeliveryDispatcher> _dispatcher;
+
+    QElapsedTimer _clock;
+    qint64 _lastTime;
+    QPointF _lastCenter;
+    quint8 _lastZoomLevel;
+    QPointF _velocity;
+    int _overscan;
+
+    //Tiles already prefetched on this zoom level, so that each layout only asks for new ones
+    QSet<TileKey> _prefetched;
+};
+
+#endif // MOTIONTILEPREFETCHER_H
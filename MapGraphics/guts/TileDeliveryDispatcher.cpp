@@ -0,0 +1,147 @@
+#include "TileDeliveryDispatcher.h"
+
+#include <QWeakPointer>
+#include <QtDebug>
+
+//Dispatchers are only touched from the GUI thread, so this needn't be locked
+static QHash<MapTileSource *, QWeakPointer<TileDeliveryDispatcher> > dispatchers;
+
+//static
+QSharedPointer<TileDeliveryDispatcher> TileDeliveryDispatcher::forSource(QSharedPointer<MapTileSource> source)
+{
+    if (source.isNull())
+        return QSharedPointer<TileDeliveryDispatcher>();
+
+    QSharedPointer<TileDeliveryDispatcher> toRet = dispatchers.value(source.data()).toStrongRef();
+    if (toRet.isNull())
+    {
+        toRet = QSharedPointer<TileDeliveryDispatcher>(new TileDeliveryDispatcher(source));
+        dispatchers.insert(source.data(), toRet.toWeakRef());
+    }
+    return toRet;
+}
+
+TileDeliveryDispatcher::~TileDeliveryDispatcher()
+{
+    //A newer dispatcher may already be registered for the source if ours was on its way out
+    if (dispatchers.value(_source.data()).isNull())
+        dispatchers.remove(_source.data());
+}
+
+void TileDeliveryDispatcher::subscribe(const TileKey &key, TileDeliveryDispatcher::Subscriber *subscriber)
+{
+    QList<Subscriber *>& subscribers = _subscribers[key];
+    if (!subscribers.contains(subscriber))
+        subscribers.append(subscriber);
+}
+
+void TileDeliveryDispatcher::unsubscribe(const TileKey &key, TileDeliveryDispatcher::Subscriber *subscriber)
+{
+    QHash<TileKey, QList<Subscriber *> >::iterator it = _subscribers.find(key);
+    if (it == _subscribers.end())
+        return;
+
+    it.value().removeAll(subscriber);
+    if (it.value().isEmpty())
+        _subscribers.erase(it);
+}
+
+int TileDeliveryDispatcher::subscriberCount(const TileKey &key) const
+{
+    return _subscribers.value(key).size();
+}
+
+void TileDeliveryDispatcher::requestTile(const TileKey &key)
+{
+    _unsentRequests.append(key);
+    if (_unsentRequests.size() + _unsentPrefetches.size() == 1)
+        QMetaObject::invokeMethod(this, "sendRequests", Qt::QueuedConnection);
+}
+
+void TileDeliveryDispatcher::cancelTile(const TileKey &key)
+{
+    //A request still with us can simply be forgotten. Otherwise the source has to be told.
+    const int unsent = _unsentRequests.indexOf(key);
+    if (unsent != -1)
+        _unsentRequests.removeAt(unsent);
+    else
+        _source->cancelTile(key.x(), key.y(), key.z());
+}
+
+void TileDeliveryDispatcher::prefetchTile(const TileKey &key)
+{
+    _unsentPrefetches.append(key);
+    if (_unsentRequests.size() + _unsentPrefetches.size() == 1)
+        QMetaObject::invokeMethod(this, "sendRequests", Qt::QueuedConnection);
+}
+
+//private slot
+void TileDeliveryDispatcher::handleTilesDelivered(QList<MapTile> tiles)
+{
+    //A null tile is one that failed
+    foreach(const MapTile& tile, tiles)
+    {
+        if (tile.isNull())
+            this->deliverFailure(tile.key());
+        else
+            this->deliverTile(tile);
+    }
+}
+
+//private slot
+void TileDeliveryDispatcher::sendRequests()
+{
+    if (!_unsentRequests.isEmpty())
+        _source->requestTiles(_unsentRequests);
+    _unsentRequests.clear();
+
+    //After the requests, so that they don't wait behind prefetches for a free slot
+    foreach(const TileKey& key, _unsentPrefetches)
+        _source->prefetchTile(key.x(), key.y(), key.z());
+    _unsentPrefetches.clear();
+}
+
+//private
+TileDeliveryDispatcher::TileDeliveryDispatcher(QSharedPointer<MapTileSource> source) :
+    _source(source)
+{
+    //The source lives in its own thread, so this is queued. One event brings a whole batch of tiles.
+    connect(_source.data(),
+            SIGNAL(tilesDelivered(QList<MapTile>)),
+            this,
+            SLOT(handleTilesDelivered(QList<MapTile>)));
+}
+
+//private
+QList<TileDeliveryDispatcher::Subscriber *> TileDeliveryDispatcher::subscribersOf(const TileKey &key) const
+{
+    return _subscribers.value(key);
+}
+
+//private
+bool TileDeliveryDispatcher::isSubscribed(const TileKey &key, TileDeliveryDispatcher::Subscriber *subscriber) const
+{
+    QHash<TileKey, QList<Subscriber *> >::const_iterator it = _subscribers.constFind(key);
+    return it != _subscribers.constEnd() && it.value().contains(subscriber);
+}
+
+//private
+void TileDeliveryDispatcher::deliverTile(const MapTile &tile)
+{
+    //Subscribers may unsubscribe (or unsubscribe each other) as we go
+    foreach(Subscriber * subscriber, this->subscribersOf(tile.key()))
+    {
+        if (this->isSubscribed(tile.key(), subscriber))
+            subscriber->tileDelivered(tile);
+    }
+}
+
+//private
+void TileDeliveryDispatcher::deliverFailure(const TileKey &key)
+{
+    foreach(Subscriber * subscriber, this->subscribersOf(key))
+    {
+        if (this->isSubscribed(key, subscriber))
+            subscriber->tileDeliveryFailed(key);
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef TILEDELIVERYDISPATCHER_H
+#define TILEDELIVERYDISPATCHER_H
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QSharedPointer>
+
+#include "MapTileSource.h"
+#include "TileKey.h"
+
+/*!
+ \brief Routes the tiles a MapTileSource delivers to whoever is waiting for them. The dispatcher is the
+ only thing connected to the source's tilesDelivered signal; each tile delivered looks up the subscribers
+ of its key, so it costs the same no matter how many tiles are on screen. Requests go the other way in
+ batches too: the ones made while laying out a view reach the source's thread together.
+
+ There is one dispatcher per source, shared with forSource(). Dispatchers, and their subscribers, belong
+ to the GUI thread.
+*/
+class TileDeliveryDispatcher : public QObject
+{
+    Q_OBJECT
+public:
+    /*!
+     \brief Implemented by whatever wants tiles delivered, normally a MapTileGraphicsObject
+    */
+    class Subscriber
+    {
+    public:
+        virtual ~Subscriber() {}
+
+        //The tile came in. Expired tiles are followed by a fresh copy unless the refresh fails.
+        virtual void tileDelivered(const MapTile& tile)=0;
+
+        //The source couldn't get the tile
+        virtual void tileDeliveryFailed(const TileKey& key)=0;
+    };
+
+public:
+    /*!
+     \brief Returns the dispatcher of source, creating it if there isn't one yet
+    */
+    static QSharedPointer<TileDeliveryDispatcher> forSource(QSharedPointer<MapTileSource> source);
+
+    ~TileDeliveryDispatcher();
+
+    /*!
+     \brief Delivers the tile at key to subscriber until unsubscribe() is called. Subscribing twice is the
+     same as subscribing once.
+    */
+    void subscribe(const TileKey& key, Subscriber * subscriber);
+
+    void unsubscribe(const TileKey& key, Subscriber * subscriber);
+
+    //Returns how many subscribers are waiting for the tile at key
+    int subscriberCount(const TileKey& key) const;
+
+    /*!
+     \brief Requests the tile from the source along with every other tile requested before we get back to
+     the event loop
+    */
+    void requestTile(const TileKey& key);
+
+    /*!
+     \brief Cancels a request made with requestTile(). If it hasn't been sent yet, it just isn't.
+    */
+    void cancelTile(const TileKey& key);
+
+    /*!
+     \brief Prefetches the tile (see MapTileSource::prefetchTile()) once the requests made before we get
+     back to the event loop have been sent, so that the source queues them first
+    */
+    void prefetchTile(const TileKey& key);
+
+private slots:
+    void handleTilesDelivered(QList<MapTile> tiles);
+
+    //Sends the requests made since the last time
+    void sendRequests();
+
+private:
+    explicit TileDeliveryDispatcher(QSharedPointer<MapTileSource> source);
+
+    //Returns the subscribers of key as they are now, since delivering may change them
+    QList<Subscriber *> subscribersOf(const TileKey& key) const;
+
+    bool isSubscribed(const TileKey& key, Subscriber * subscriber) const;
+
+    void deliverTile(const MapTile& tile);
+    void deliverFailure(const TileKey& key);
+
+    QSharedPointer<MapTileSource> _source;
+    QHash<TileKey, QList<Subscriber *> > _subscribers;
+
+    //Requests waiting for sendRequests()
+    QList<TileKey> _unsentRequests;
+    QList<TileKey> _unsentPrefetches;
+};
+
+#endif // TILEDELIVERYDISPATCHER_H
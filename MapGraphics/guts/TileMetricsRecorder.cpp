@@ -0,0 +1,87 @@
+#include "TileMetricsRecorder.h"
+
+#include <QMutexLocker>
+
+TileMetricsRecorder::TileMetricsRecorder()
+{
+}
+
+void TileMetricsRecorder::recordLatency(MapTileMetrics::Stage stage, qint64 msecs)
+{
+    if (stage < 0 || stage >= MapTileMetrics::StageCount)
+        return;
+
+    QMutexLocker lock(&_mutex);
+    _metrics.latencies[stage].record(msecs);
+}
+
+void TileMetricsRecorder::countRequest()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.requests++;
+}
+
+void TileMetricsRecorder::countCacheHit()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.cacheHits++;
+}
+
+void TileMetricsRecorder::countFetch()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.fetches++;
+}
+
+void TileMetricsRecorder::countReceived(quint64 bytes)
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.received++;
+    _metrics.bytesReceived += bytes;
+}
+
+void TileMetricsRecorder::countFailure()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.failures++;
+}
+
+void TileMetricsRecorder::countBlocked()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.blocked++;
+}
+
+void TileMetricsRecorder::countCancelled()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.cancelled++;
+}
+
+void TileMetricsRecorder::countCoalesced()
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.coalesced++;
+}
+
+void TileMetricsRecorder::setInFlight(int count)
+{
+    QMutexLocker lock(&_mutex);
+    _metrics.inFlight = count;
+}
+
+MapTileMetrics TileMetricsRecorder::snapshot() const
+{
+    QMutexLocker lock(&_mutex);
+    return _metrics;
+}
+
+void TileMetricsRecorder::reset()
+{
+    QMutexLocker lock(&_mutex);
+    const int inFlight = _metrics.inFlight;
+    _metrics = MapTileMetrics();
+
+    //Requests underway are still underway
+    _metrics.inFlight = inFlight;
+}
@@ -0,0 +1,37 @@
+#ifndef TILEMETRICSRECORDER_H
+#define TILEMETRICSRECORDER_H
+
+#include <QMutex>
+
+#include "MapTileMetrics.h"
+
+/*!
+ \brief Where a MapTileSource and the work it runs on the TileWorkerPool record their MapTileMetrics.
+ Thread-safe. The tier counters are kept by the MapTileCache itself, so they're not recorded here.
+*/
+class TileMetricsRecorder
+{
+public:
+    TileMetricsRecorder();
+
+    void recordLatency(MapTileMetrics::Stage stage, qint64 msecs);
+
+    void countRequest();
+    void countCacheHit();
+    void countFetch();
+    void countReceived(quint64 bytes);
+    void countFailure();
+    void countBlocked();
+    void countCancelled();
+    void countCoalesced();
+    void setInFlight(int count);
+
+    MapTileMetrics snapshot() const;
+    void reset();
+
+private:
+    mutable QMutex _mutex;
+    MapTileMetrics _metrics;
+};
+
+#endif // TILEMETRICSRECORDER_H
@@ -0,0 +1,67 @@
+#include "TileWorkerPool.h"
+
+#include <QMutexLocker>
+#include <QThread>
+
+Q_GLOBAL_STATIC(QThreadPool, tileWorkerPool)
+
+static QMutex poolSetupMutex;
+static bool poolSetupDone = false;
+
+//static
+QThreadPool *TileWorkerPool::pool()
+{
+    QThreadPool * toRet = tileWorkerPool();
+
+    QMutexLocker lock(&poolSetupMutex);
+    if (!poolSetupDone)
+    {
+        //One thread per core, but at least two so that one slow disk read can't hold up every decode
+        toRet->setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+        poolSetupDone = true;
+    }
+    return toRet;
+}
+
+//static
+int TileWorkerPool::maxThreadCount()
+{
+    return TileWorkerPool::pool()->maxThreadCount();
+}
+
+//static
+void TileWorkerPool::setMaxThreadCount(int count)
+{
+    TileWorkerPool::pool()->setMaxThreadCount(qMax(1, count));
+}
+
+TileTaskReceiver::TileTaskReceiver(QObject *receiver) :
+    _receiver(receiver)
+{
+}
+
+void TileTaskReceiver::detach()
+{
+    QMutexLocker lock(&_mutex);
+    _receiver = 0;
+}
+
+bool TileTaskReceiver::invoke(const char *member,
+                              QGenericArgument val0,
+                              QGenericArgument val1,
+                              QGenericArgument val2,
+                              QGenericArgument val3)
+{
+    //Holding the lock while posting guarantees the receiver can't finish detaching underneath us
+    QMutexLocker lock(&_mutex);
+    if (_receiver == 0)
+        return false;
+
+    return QMetaObject::invokeMethod(_receiver,
+                                     member,
+                                     Qt::QueuedConnection,
+                                     val0,
+                                     val1,
+                                     val2,
+                                     val3);
+}
@@ -0,0 +1,50 @@
+#ifndef TILEWORKERPOOL_H
+#define TILEWORKERPOOL_H
+
+#include <QGenericArgument>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+
+/*!
+ \brief The bounded pool of worker threads that MapTileSources use for disk cache I/O and image decoding,
+ so that a slow disk or a big image doesn't stall the tile source's own thread. All tile sources share
+ the same pool.
+*/
+class TileWorkerPool
+{
+public:
+    static QThreadPool * pool();
+
+    static int maxThreadCount();
+    static void setMaxThreadCount(int count);
+};
+
+/*!
+ \brief Lets work running in TileWorkerPool post its results back to a QObject (normally a MapTileSource)
+ that might be destroyed while the work runs. The owner calls detach() when it's destructing, after which
+ results are silently dropped.
+*/
+class TileTaskReceiver
+{
+public:
+    explicit TileTaskReceiver(QObject * receiver);
+
+    void detach();
+
+    /*!
+     \brief Queues a call of member on the receiver with the given arguments. Returns false if the receiver
+     has been detached.
+    */
+    bool invoke(const char * member,
+                QGenericArgument val0 = QGenericArgument(),
+                QGenericArgument val1 = QGenericArgument(),
+                QGenericArgument val2 = QGenericArgument(),
+                QGenericArgument val3 = QGenericArgument());
+
+private:
+    QMutex _mutex;
+    QObject * _receiver;
+};
+
+#endif // TILEWORKERPOOL_H
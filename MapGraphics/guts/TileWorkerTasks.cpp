@@ -0,0 +1,167 @@
+#include "TileWorkerTasks.h"
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPainter>
+#include <QtDebug>
+
+#include "MapTile.h"
+#include "TileMetricsRecorder.h"
+
+TileCacheLookupTask::TileCacheLookupTask(QSharedPointer<TileTaskReceiver> receiver,
+                                         QSharedPointer<MapTileCache> cache,
+                                         const TileKey &key,
+                                         const QDateTime &defaultExpireTime,
+                                         bool keepExpired) :
+    _receiver(receiver), _cache(cache), _key(key), _defaultExpireTime(defaultExpireTime),
+    _keepExpired(keepExpired)
+{
+}
+
+//pure-virtual from QRunnable
+void TileCacheLookupTask::run()
+{
+    CachedTile tile;
+    if (_cache->slowLookup(_key, &tile))
+    {
+        if (tile.expireTime.isNull())
+        {
+            qWarning() << "Tile" << _key.toString() << "has unknown expire time. Resetting to default.";
+            tile.expireTime = _defaultExpireTime;
+            _cache->setExpirationTime(_key, tile.expireTime);
+        }
+
+        //If the cached tile is older than we would like, throw it out (unless it's wanted while it's refreshed)
+        if (tile.isExpired() && !_keepExpired)
+        {
+            _cache->remove(_key);
+            tile = CachedTile();
+        }
+    }
+
+    _receiver->invoke("handleCacheLookupResult",
+                      Q_ARG(TileKey, _key),
+                      Q_ARG(CachedTile, tile));
+}
+
+TileCachePresenceTask::TileCachePresenceTask(QSharedPointer<TileTaskReceiver> receiver,
+                                             QSharedPointer<MapTileCache> cache,
+                                             const TileKey &key) :
+    _receiver(receiver), _cache(cache), _key(key)
+{
+}
+
+//pure-virtual from QRunnable
+void TileCachePresenceTask::run()
+{
+    //Tiles with an unknown expiration get the default one when they're looked up, so they count as fresh
+    bool cached = false;
+    if (_cache->contains(_key))
+    {
+        const QDateTime expireTime = _cache->expirationTime(_key);
+        cached = expireTime.isNull() || QDateTime::currentDateTimeUtc().secsTo(expireTime) > 0;
+    }
+
+    _receiver->invoke("handlePrefetchLookupResult",
+                      Q_ARG(TileKey, _key),
+                      Q_ARG(bool, cached));
+}
+
+TileCacheInsertTask::TileCacheInsertTask(QSharedPointer<TileTaskReceiver> receiver,
+                                         QSharedPointer<MapTileCache> cache,
+                                         const TileKey &key,
+                                         const CachedTile &tile) :
+    _receiver(receiver), _cache(cache), _key(key), _tile(tile)
+{
+}
+
+//pure-virtual from QRunnable
+void TileCacheInsertTask::run()
+{
+    _cache->slowInsert(_key, _tile);
+
+    _receiver->invoke("handleCacheInsertDone",
+                      Q_ARG(TileKey, _key));
+}
+
+TileDecodeTask::TileDecodeTask(QSharedPointer<TileTaskReceiver> receiver,
+                               QSharedPointer<TileMetricsRecorder> metrics,
+                               const TileKey &key,
+                               const CachedTile &tile) :
+    _receiver(receiver), _metrics(metrics), _key(key), _tile(tile)
+{
+}
+
+//pure-virtual from QRunnable
+void TileDecodeTask::run()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    QImage image;
+    image.loadFromData(_tile.encoded);
+
+    //Get it ready for painting while we're still off the tile source's thread
+    _tile.image = MapTile::toPaintFormat(image);
+
+    if (!_metrics.isNull())
+        _metrics->recordLatency(MapTileMetrics::Decode, timer.elapsed());
+
+    _receiver->invoke("handleDecodedTile",
+                      Q_ARG(TileKey, _key),
+                      Q_ARG(CachedTile, _tile));
+}
+
+TileDownsampleTask::TileDownsampleTask(QSharedPointer<TileTaskReceiver> receiver,
+                                       const TileKey &key,
+                                       const QList<QImage> &children) :
+    _receiver(receiver), _key(key), _children(children)
+{
+}
+
+//pure-virtual from QRunnable
+void TileDownsampleTask::run()
+{
+    //The stand-in is as big as the biggest child
+    QSize size;
+    foreach(const QImage& child, _children)
+        size = size.expandedTo(child.size());
+
+    CachedTile tile;
+    if (!size.isEmpty())
+    {
+        const int halfWidth = size.width() / 2;
+        const int halfHeight = size.height() / 2;
+
+        QImage image(size, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+
+        QPainter painter(&image);
+        for (int i = 0; i < _children.size() && i < 4; i++)
+        {
+            const QImage& child = _children.at(i);
+            if (child.isNull())
+                continue;
+
+            painter.drawImage(QPoint((i % 2) * halfWidth, (i / 2) * halfHeight),
+                              child.scaled(halfWidth, halfHeight, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+        }
+        painter.end();
+        tile.image = image;
+    }
+
+    _receiver->invoke("handleProvisionalTile",
+                      Q_ARG(TileKey, _key),
+                      Q_ARG(CachedTile, tile));
+}
+
+TileCacheFlushTask::TileCacheFlushTask(QSharedPointer<MapTileCache> cache) :
+    _cache(cache)
+{
+}
+
+//pure-virtual from QRunnable
+void TileCacheFlushTask::run()
+{
+    _cache->flush();
+}
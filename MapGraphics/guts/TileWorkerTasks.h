@@ -0,0 +1,152 @@
+#ifndef TILEWORKERTASKS_H
+#define TILEWORKERTASKS_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QList>
+#include <QImage>
+#include <QRunnable>
+#include <QSharedPointer>
+
+#include "TileKey.h"
+#include "tileCaches/MapTileCache.h"
+#include "TileWorkerPool.h"
+
+class TileMetricsRecorder;
+
+/*!
+ \brief Looks a tile up in the slow tiers of a MapTileCache (see MapTileCache::slowLookup()) on a
+ TileWorkerPool thread. Tiles with an unknown expiration get the default one. Expired tiles are removed
+ from the cache unless keepExpired is set, in which case they're returned so that they can be shown while
+ they're revalidated. Posts handleCacheLookupResult(TileKey,CachedTile) to the receiver when done; the
+ CachedTile is null if the tile wasn't cached, had expired (and wasn't kept) or couldn't be decoded.
+*/
+class TileCacheLookupTask : public QRunnable
+{
+public:
+    TileCacheLookupTask(QSharedPointer<TileTaskReceiver> receiver,
+                        QSharedPointer<MapTileCache> cache,
+                        const TileKey& key,
+                        const QDateTime& defaultExpireTime,
+                        bool keepExpired = false);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<TileTaskReceiver> _receiver;
+    QSharedPointer<MapTileCache> _cache;
+    TileKey _key;
+    QDateTime _defaultExpireTime;
+    bool _keepExpired;
+};
+
+/*!
+ \brief Finds out whether a tile is cached (and hasn't expired) on a TileWorkerPool thread, without
+ reading or decoding it. Posts handlePrefetchLookupResult(TileKey,bool) to the receiver when done.
+*/
+class TileCachePresenceTask : public QRunnable
+{
+public:
+    TileCachePresenceTask(QSharedPointer<TileTaskReceiver> receiver,
+                          QSharedPointer<MapTileCache> cache,
+                          const TileKey& key);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<TileTaskReceiver> _receiver;
+    QSharedPointer<MapTileCache> _cache;
+    TileKey _key;
+};
+
+/*!
+ \brief Inserts a tile into the slow tiers of a MapTileCache (see MapTileCache::slowInsert()) on a
+ TileWorkerPool thread, so that encoding it and writing it to disk don't hold up the tile source. Posts
+ handleCacheInsertDone(TileKey) to the receiver when done.
+*/
+class TileCacheInsertTask : public QRunnable
+{
+public:
+    TileCacheInsertTask(QSharedPointer<TileTaskReceiver> receiver,
+                        QSharedPointer<MapTileCache> cache,
+                        const TileKey& key,
+                        const CachedTile& tile);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<TileTaskReceiver> _receiver;
+    QSharedPointer<MapTileCache> _cache;
+    TileKey _key;
+    CachedTile _tile;
+};
+
+/*!
+ \brief Decodes the encoded bytes of a newly-received tile on a TileWorkerPool thread. Posts
+ handleDecodedTile(TileKey,CachedTile) to the receiver when done, with the image of the CachedTile filled
+ in. The image is null if the bytes couldn't be decoded. The time taken is recorded in the metrics.
+*/
+class TileDecodeTask : public QRunnable
+{
+public:
+    TileDecodeTask(QSharedPointer<TileTaskReceiver> receiver,
+                   QSharedPointer<TileMetricsRecorder> metrics,
+                   const TileKey& key,
+                   const CachedTile& tile);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<TileTaskReceiver> _receiver;
+    QSharedPointer<TileMetricsRecorder> _metrics;
+    TileKey _key;
+    CachedTile _tile;
+};
+
+/*!
+ \brief Puts together a stand-in for a tile of a quadtree from the decoded images of its four children (on
+ the next zoom level in) on a TileWorkerPool thread. Each child is shrunk to half size and drawn in its
+ quadrant; quadrants whose child is a null image are left transparent. Posts
+ handleProvisionalTile(TileKey,CachedTile) to the receiver when done.
+*/
+class TileDownsampleTask : public QRunnable
+{
+public:
+    /*!
+     \param children the images of the children at (2x,2y), (2x+1,2y), (2x,2y+1) and (2x+1,2y+1), in that
+     order. At least one should be non-null.
+    */
+    TileDownsampleTask(QSharedPointer<TileTaskReceiver> receiver,
+                       const TileKey& key,
+                       const QList<QImage>& children);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<TileTaskReceiver> _receiver;
+    TileKey _key;
+    QList<QImage> _children;
+};
+
+/*!
+ \brief Flushes a MapTileCache on a TileWorkerPool thread so that persisting expirations or committing
+ batched writes never holds up tile requests.
+*/
+class TileCacheFlushTask : public QRunnable
+{
+public:
+    TileCacheFlushTask(QSharedPointer<MapTileCache> cache);
+
+    //pure-virtual from QRunnable
+    virtual void run();
+
+private:
+    QSharedPointer<MapTileCache> _cache;
+};
+
+#endif // TILEWORKERTASKS_H
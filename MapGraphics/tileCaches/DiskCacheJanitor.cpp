@@ -0,0 +1,312 @@
+#include "DiskCacheJanitor.h"
+
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QWaitCondition>
+#include <QWeakPointer>
+#include <QtDebug>
+
+const quint64 DiskCacheJanitor::DEFAULT_GLOBAL_QUOTA;
+const int DiskCacheJanitor::DEFAULT_SWEEP_INTERVAL_MS;
+
+//Leave startup alone --- the first sweep waits this long after the first cache is added
+const int FIRST_SWEEP_DELAY_MS = 30 * 1000;
+
+//While the global quota is exceeded, evict at most this much from one cache before picking again
+const quint64 GLOBAL_EVICTION_CHUNK = 4 * 1024 * 1024;
+
+//Over-quota caches are trimmed to this fraction (percent) of their quota
+const quint64 LOW_WATER_PERCENT = 90;
+
+/*
+  The thread that does the actual work. It waits on a condition so that it can be woken early by
+  sweepSoon() and told to stop when the process exits.
+*/
+class DiskCacheJanitorThread : public QThread
+{
+public:
+    struct Registration
+    {
+        QWeakPointer<DiskTileCache> cache;
+        DiskTileCache * raw;
+        quint64 quota;
+        bool keepExpired;
+    };
+
+    DiskCacheJanitorThread() :
+        globalQuota(DiskCacheJanitor::DEFAULT_GLOBAL_QUOTA),
+        sweepInterval(DiskCacheJanitor::DEFAULT_SWEEP_INTERVAL_MS),
+        sweepRequested(false),
+        stopping(false)
+    {
+    }
+
+    ~DiskCacheJanitorThread()
+    {
+        QMutexLocker lock(&mutex);
+        stopping = true;
+        condition.wakeAll();
+        lock.unlock();
+
+        this->wait();
+    }
+
+    //Starts the thread if it isn't running yet. mutex must be held.
+    void ensureRunning()
+    {
+        if (this->isRunning() || stopping)
+            return;
+        this->start(QThread::LowestPriority);
+    }
+
+    QMutex mutex;
+    QWaitCondition condition;
+    QList<Registration> registrations;
+    quint64 globalQuota;
+    int sweepInterval;
+    bool sweepRequested;
+    bool stopping;
+
+protected:
+    //virtual from QThread
+    virtual void run()
+    {
+        QMutexLocker lock(&mutex);
+        int delay = FIRST_SWEEP_DELAY_MS;
+        while (!stopping)
+        {
+            if (!sweepRequested)
+                condition.wait(&mutex, delay);
+            if (stopping)
+                break;
+            sweepRequested = false;
+            delay = sweepInterval;
+
+            lock.unlock();
+            this->sweep();
+            lock.relock();
+        }
+    }
+
+private:
+    bool shouldStop()
+    {
+        QMutexLocker lock(&mutex);
+        return stopping;
+    }
+
+    void sweep()
+    {
+        //Take strong references for the duration of the sweep, forgetting caches that are gone
+        QList<QSharedPointer<DiskTileCache> > caches;
+        QList<quint64> quotas;
+        QList<bool> keepExpired;
+        QMutexLocker lock(&mutex);
+        for (int i = registrations.size() - 1; i >= 0; i--)
+        {
+            QSharedPointer<DiskTileCache> cache = registrations.at(i).cache.toStrongRef();
+            if (cache.isNull())
+            {
+                registrations.removeAt(i);
+                continue;
+            }
+            caches.prepend(cache);
+            quotas.prepend(registrations.at(i).quota);
+            keepExpired.prepend(registrations.at(i).keepExpired);
+        }
+        const quint64 global = globalQuota;
+        lock.unlock();
+
+        const QDateTime now = QDateTime::currentDateTimeUtc();
+        QList<quint64> used;
+        quint64 totalUsed = 0;
+        for (int i = 0; i < caches.size(); i++)
+        {
+            if (this->shouldStop())
+                return;
+
+            const QSharedPointer<DiskTileCache>& cache = caches.at(i);
+
+            //Get recent writes and access times into the cache's books first
+            cache->flush();
+            if (!keepExpired.at(i))
+                cache->removeExpired(now);
+
+            quint64 bytes = cache->bytesUsed();
+            const quint64 quota = quotas.at(i);
+            if (quota > 0 && bytes > quota)
+            {
+                const quint64 target = quota / 100 * LOW_WATER_PERCENT;
+                const quint64 freed = cache->evictLeastRecentlyUsed(bytes - target);
+                bytes -= qMin(bytes, freed);
+            }
+            used.append(bytes);
+            totalUsed += bytes;
+        }
+
+        if (global == 0 || totalUsed <= global)
+            return;
+
+        //Evict globally least recently used tiles a chunk at a time until we're back under the low water mark
+        quint64 excess = totalUsed - global / 100 * LOW_WATER_PERCENT;
+        while (excess > 0 && !this->shouldStop())
+        {
+            QSharedPointer<DiskTileCache> victim;
+            QDateTime oldest;
+            foreach(const QSharedPointer<DiskTileCache>& cache, caches)
+            {
+                const QDateTime access = cache->oldestAccessTime();
+                if (access.isNull())
+                    continue;
+                if (victim.isNull() || access < oldest)
+                {
+                    victim = cache;
+                    oldest = access;
+                }
+            }
+
+            //Nothing left to evict
+            if (victim.isNull())
+                break;
+
+            const quint64 freed = victim->evictLeastRecentlyUsed(qMin(excess, GLOBAL_EVICTION_CHUNK));
+            if (freed == 0)
+                break;
+            excess -= qMin(excess, freed);
+        }
+    }
+};
+
+Q_GLOBAL_STATIC(DiskCacheJanitorThread, janitorThread)
+
+//static
+void DiskCacheJanitor::addCache(QSharedPointer<DiskTileCache> cache, quint64 quota)
+{
+    if (cache.isNull())
+        return;
+
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    for (int i = 0; i < janitor->registrations.size(); i++)
+    {
+        if (janitor->registrations.at(i).raw == cache.data())
+        {
+            janitor->registrations[i].quota = quota;
+            return;
+        }
+    }
+
+    DiskCacheJanitorThread::Registration registration;
+    registration.cache = cache.toWeakRef();
+    registration.raw = cache.data();
+    registration.quota = quota;
+    registration.keepExpired = false;
+    janitor->registrations.append(registration);
+    janitor->ensureRunning();
+}
+
+//static
+void DiskCacheJanitor::removeCache(DiskTileCache *cache)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    for (int i = janitor->registrations.size() - 1; i >= 0; i--)
+    {
+        if (janitor->registrations.at(i).raw == cache)
+            janitor->registrations.removeAt(i);
+    }
+}
+
+//static
+quint64 DiskCacheJanitor::quota(DiskTileCache *cache)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    foreach(const DiskCacheJanitorThread::Registration& registration, janitor->registrations)
+    {
+        if (registration.raw == cache)
+            return registration.quota;
+    }
+    return 0;
+}
+
+//static
+void DiskCacheJanitor::setQuota(DiskTileCache *cache, quint64 quota)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    for (int i = 0; i < janitor->registrations.size(); i++)
+    {
+        if (janitor->registrations.at(i).raw == cache)
+            janitor->registrations[i].quota = quota;
+    }
+}
+
+//static
+bool DiskCacheJanitor::keepsExpired(DiskTileCache *cache)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    foreach(const DiskCacheJanitorThread::Registration& registration, janitor->registrations)
+    {
+        if (registration.raw == cache)
+            return registration.keepExpired;
+    }
+    return false;
+}
+
+//static
+void DiskCacheJanitor::setKeepsExpired(DiskTileCache *cache, bool keep)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    for (int i = 0; i < janitor->registrations.size(); i++)
+    {
+        if (janitor->registrations.at(i).raw == cache)
+            janitor->registrations[i].keepExpired = keep;
+    }
+}
+
+//static
+quint64 DiskCacheJanitor::globalQuota()
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    return janitor->globalQuota;
+}
+
+//static
+void DiskCacheJanitor::setGlobalQuota(quint64 quota)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    janitor->globalQuota = quota;
+}
+
+//static
+int DiskCacheJanitor::sweepInterval()
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    return janitor->sweepInterval;
+}
+
+//static
+void DiskCacheJanitor::setSweepInterval(int msecs)
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    janitor->sweepInterval = qMax(1000, msecs);
+}
+
+//static
+void DiskCacheJanitor::sweepSoon()
+{
+    DiskCacheJanitorThread * janitor = janitorThread();
+    QMutexLocker lock(&janitor->mutex);
+    janitor->sweepRequested = true;
+    janitor->condition.wakeAll();
+    janitor->ensureRunning();
+}
@@ -0,0 +1,79 @@
+#ifndef DISKCACHEJANITOR_H
+#define DISKCACHEJANITOR_H
+
+#include <QSharedPointer>
+
+#include "MapGraphics_global.h"
+#include "DiskTileCache.h"
+
+/**
+ * @brief Keeps disk caches from growing without bound. Every registered DiskTileCache may have its own
+ * byte quota, and all of them together share a global quota. A single low-priority background thread
+ * periodically sweeps expired tiles out of every cache (except those told to keep them), then evicts least recently used tiles from any cache
+ * over its own quota and, while the global quota is exceeded, from whichever cache holds the least recently
+ * used tile in the process.
+ *
+ * Over-quota caches are trimmed to 90% of their quota so that the janitor doesn't have to run again right
+ * away. The janitor only calls the cache methods meant for it, so tile requests are never made to wait.
+ */
+class MAPGRAPHICSSHARED_EXPORT DiskCacheJanitor
+{
+public:
+    /**
+     * @brief Starts looking after a cache. The janitor only keeps a weak reference to it, so caches that
+     * are destroyed are forgotten automatically. A quota of 0 means the cache only counts against the
+     * global quota.
+     *
+     * @param cache
+     * @param quota
+     */
+    static void addCache(QSharedPointer<DiskTileCache> cache, quint64 quota = 0);
+
+    static void removeCache(DiskTileCache * cache);
+
+    static quint64 quota(DiskTileCache * cache);
+    static void setQuota(DiskTileCache * cache, quint64 quota);
+
+    static bool keepsExpired(DiskTileCache * cache);
+
+    /**
+     * @brief Sets whether expired tiles are left in the cache rather than swept out, e.g., so that they
+     * can be shown and revalidated (see MapTileSource::setStaleWhileRevalidate()) after a long time offline.
+     * They still go when the cache is over quota, least recently used first. Off by default.
+     *
+     * @param cache
+     * @param keep
+     */
+    static void setKeepsExpired(DiskTileCache * cache, bool keep);
+
+    /**
+     * @brief Returns the quota, in bytes, shared by every cache the janitor looks after. 0 means unlimited.
+     *
+     * @return quint64
+     */
+    static quint64 globalQuota();
+
+    static void setGlobalQuota(quint64 quota);
+
+    /**
+     * @brief Returns the time between sweeps in milliseconds
+     *
+     * @return int
+     */
+    static int sweepInterval();
+
+    static void setSweepInterval(int msecs);
+
+    /**
+     * @brief Asks for a sweep as soon as possible instead of waiting for the next scheduled one
+     */
+    static void sweepSoon();
+
+    //1 GiB
+    static const quint64 DEFAULT_GLOBAL_QUOTA = Q_UINT64_C(1024) * 1024 * 1024;
+
+    //10 minutes
+    static const int DEFAULT_SWEEP_INTERVAL_MS = 10 * 60 * 1000;
+};
+
+#endif // DISKCACHEJANITOR_H
@@ -0,0 +1,37 @@
+#include "DiskTileCache.h"
+
+//pure-virtual from MapTileCacheTier
+int DiskTileCache::representations() const
+{
+    return MapTileCacheTier::Encoded;
+}
+
+//pure-virtual from MapTileCacheTier
+bool DiskTileCache::isSlow() const
+{
+    return true;
+}
+
+//virtual from MapTileCacheTier
+QString DiskTileCache::name() const
+{
+    return "disk";
+}
+
+//pure-virtual from MapTileCacheTier
+bool DiskTileCache::lookup(const TileKey &key, CachedTile *tile)
+{
+    if (tile == 0)
+        return this->contains(key);
+
+    tile->image = QImage();
+    return this->read(key, &tile->encoded, &tile->expireTime, &tile->etag, &tile->lastModified);
+}
+
+//pure-virtual from MapTileCacheTier
+void DiskTileCache::insert(const TileKey &key, const CachedTile &tile)
+{
+    if (tile.encoded.isEmpty())
+        return;
+    this->write(key, tile.encoded, tile.expireTime, tile.etag, tile.lastModified);
+}
@@ -0,0 +1,136 @@
+#ifndef DISKTILECACHE_H
+#define DISKTILECACHE_H
+
+#include <QByteArray>
+#include <QDateTime>
+
+#include "MapTileCacheTier.h"
+
+/**
+ * @brief Interface for the persistent store behind a MapTileSource's disk cache. A DiskTileCache keeps the
+ * encoded (png, jpg, etc.) bytes of tiles along with the time at which each tile expires. It is the slow,
+ * encoded-only tier of a MapTileCache; implementations only have to provide read() and write() and
+ * friends.
+ *
+ * Implementations must be safe to call from several threads at once. The housekeeping methods at the
+ * end (bytesUsed() and friends) are only called by the DiskCacheJanitor's background thread and may be
+ * slow, but they must not hold locks that read() or write() need for long.
+ */
+class MAPGRAPHICSSHARED_EXPORT DiskTileCache : public MapTileCacheTier
+{
+public:
+    virtual ~DiskTileCache() {}
+
+    //pure-virtual from MapTileCacheTier
+    virtual int representations() const;
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool isSlow() const;
+
+    //virtual from MapTileCacheTier
+    virtual QString name() const;
+
+    /**
+     * @brief Looks up a tile with read(). The image of the tile is left null --- decoding is up to the
+     * caller.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    virtual bool lookup(const TileKey& key, CachedTile * tile);
+
+    /**
+     * @brief Stores the encoded bytes of a tile with write(). Tiles without encoded bytes are ignored.
+     *
+     * @param key
+     * @param tile
+     */
+    virtual void insert(const TileKey& key, const CachedTile& tile);
+
+    /**
+     * @brief Reads the encoded bytes and the expiration time of a tile. Returns false if the tile isn't
+     * cached. Expired tiles are returned too --- it's up to the caller to decide what to do with them.
+     * expireTime is set to a null QDateTime if the expiration of the tile is unknown.
+     *
+     * If etag and lastModified are non-null, they are set to the HTTP validators stored with the tile (or
+     * emptied if there are none). Implementations for which that is costly may only do so for tiles that
+     * have expired, since those are the only ones that get revalidated.
+     *
+     * @param key
+     * @param data
+     * @param expireTime
+     * @param etag
+     * @param lastModified
+     * @return bool
+     */
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime,
+                      QByteArray * etag, QByteArray * lastModified)=0;
+
+    /**
+     * @brief Stores the encoded bytes of a tile along with its expiration time and HTTP validators (which
+     * may be empty), replacing whatever was stored for it before. Whether the write has reached the disk
+     * when this returns is up to the implementation.
+     *
+     * @param key
+     * @param data
+     * @param expireTime
+     * @param etag
+     * @param lastModified
+     */
+    virtual void write(const TileKey& key, const QByteArray& data, const QDateTime& expireTime,
+                       const QByteArray& etag, const QByteArray& lastModified)=0;
+
+    virtual bool contains(const TileKey& key)=0;
+
+    virtual void remove(const TileKey& key)=0;
+
+    /**
+     * @brief Returns the time the tile expires, or a null QDateTime if unknown
+     *
+     * @param key
+     * @return QDateTime
+     */
+    virtual QDateTime expirationTime(const TileKey& key)=0;
+
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime)=0;
+
+    /**
+     * @brief Makes sure that everything written so far is on disk
+     */
+    virtual void flush()=0;
+
+    /**
+     * @brief Returns the number of bytes of tile data in the cache
+     *
+     * @return quint64
+     */
+    virtual quint64 bytesUsed()=0;
+
+    /**
+     * @brief Removes every tile that expired before now. Returns the number of bytes freed.
+     *
+     * @param now
+     * @return quint64
+     */
+    virtual quint64 removeExpired(const QDateTime& now)=0;
+
+    /**
+     * @brief Returns the last time the least recently used tile was read or written, or a null
+     * QDateTime if the cache is empty
+     *
+     * @return QDateTime
+     */
+    virtual QDateTime oldestAccessTime()=0;
+
+    /**
+     * @brief Removes the least recently used tiles until at least the given number of bytes have been
+     * freed or the cache is empty. Returns the number of bytes freed.
+     *
+     * @param bytes
+     * @return quint64
+     */
+    virtual quint64 evictLeastRecentlyUsed(quint64 bytes)=0;
+};
+
+#endif // DISKTILECACHE_H
@@ -0,0 +1,299 @@
+#include "FileTreeDiskTileCache.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QPair>
+#include <QStringBuilder>
+#include <QVector>
+#include <QtDebug>
+
+#include <algorithm>
+
+//(last access, key) pairs, which sort oldest first
+typedef QPair<qint64, TileKey> AccessRecord;
+
+FileTreeDiskTileCache::FileTreeDiskTileCache(const QString &directory, const QString &extension) :
+    _directory(directory), _extension(extension),
+    //The old expiration table lived in the 0/0 directory of the tree. It's imported the first time.
+    _expirations(directory, directory % "/0/0/cacheExpirations.db"),
+    _inventoryBytes(0), _inventoryScanned(false)
+{
+}
+
+FileTreeDiskTileCache::~FileTreeDiskTileCache()
+{
+    this->flush();
+}
+
+bool FileTreeDiskTileCache::read(const TileKey &key, QByteArray *data, QDateTime *expireTime,
+                                 QByteArray *etag, QByteArray *lastModified)
+{
+    //Opening is enough to tell us whether the tile is there --- no need for a separate stat
+    QFile fp(this->tileFile(key));
+    if (!fp.open(QFile::ReadOnly))
+        return false;
+
+    //One read for the whole file
+    const QByteArray bytes = fp.readAll();
+    if (bytes.isEmpty())
+        return false;
+
+    this->recordAccess(key, bytes.size());
+
+    const QDateTime expires = this->expirationTime(key);
+    if (data)
+        *data = bytes;
+    if (expireTime)
+        *expireTime = expires;
+
+    //Validators are only needed to revalidate an expired tile, so spare the extra open() until then
+    QByteArray validators;
+    if ((etag || lastModified) && !expires.isNull() && expires <= QDateTime::currentDateTimeUtc())
+    {
+        QFile validatorsFp(this->validatorsFile(key));
+        if (validatorsFp.open(QFile::ReadOnly))
+            validators = validatorsFp.readAll();
+    }
+    const int newline = validators.indexOf('\n');
+    if (etag)
+        *etag = newline < 0 ? QByteArray() : validators.left(newline);
+    if (lastModified)
+        *lastModified = newline < 0 ? QByteArray() : validators.mid(newline + 1);
+    return true;
+}
+
+void FileTreeDiskTileCache::write(const TileKey &key, const QByteArray &data, const QDateTime &expireTime,
+                                  const QByteArray &etag, const QByteArray &lastModified)
+{
+    if (data.isEmpty() || !this->ensureTileDirectory(key))
+        return;
+
+    QFile fp(this->tileFile(key));
+    if (!fp.open(QIODevice::WriteOnly | QIODevice::Truncate) || fp.write(data) != data.size())
+    {
+        qWarning() << "Failed to write" << fp.fileName() << "to disk cache:" << fp.errorString();
+        fp.close();
+        fp.remove();
+        return;
+    }
+
+    this->recordAccess(key, data.size());
+    this->setExpirationTime(key, expireTime);
+
+    //Validators of an older version of the tile mustn't outlive it
+    QFile validatorsFp(this->validatorsFile(key));
+    if (etag.isEmpty() && lastModified.isEmpty())
+        validatorsFp.remove();
+    else if (!validatorsFp.open(QIODevice::WriteOnly | QIODevice::Truncate)
+             || validatorsFp.write(etag + '\n' + lastModified) < 0)
+    {
+        qWarning() << "Failed to write" << validatorsFp.fileName() << "to disk cache:" << validatorsFp.errorString();
+        validatorsFp.close();
+        validatorsFp.remove();
+    }
+}
+
+bool FileTreeDiskTileCache::contains(const TileKey &key)
+{
+    return QFile::exists(this->tileFile(key));
+}
+
+void FileTreeDiskTileCache::remove(const TileKey &key)
+{
+    const QString path = this->tileFile(key);
+    if (QFile::exists(path) && !QFile::remove(path))
+        qWarning() << "Failed to remove old cache file" << path;
+    QFile::remove(this->validatorsFile(key));
+
+    _expirations.remove(key);
+
+    QMutexLocker lock(&_mutex);
+    if (_inventory.contains(key))
+        _inventoryBytes -= _inventory.take(key).size;
+}
+
+QDateTime FileTreeDiskTileCache::expirationTime(const TileKey &key)
+{
+    return _expirations.value(key);
+}
+
+void FileTreeDiskTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    _expirations.insert(key, expireTime);
+}
+
+void FileTreeDiskTileCache::flush()
+{
+    _expirations.flush();
+}
+
+quint64 FileTreeDiskTileCache::bytesUsed()
+{
+    this->ensureInventory();
+
+    QMutexLocker lock(&_mutex);
+    return _inventoryBytes;
+}
+
+quint64 FileTreeDiskTileCache::removeExpired(const QDateTime &now)
+{
+    const QHash<TileKey, InventoryEntry> inventory = this->inventorySnapshot();
+
+    quint64 freed = 0;
+    QHash<TileKey, InventoryEntry>::const_iterator iter;
+    for (iter = inventory.constBegin(); iter != inventory.constEnd(); iter++)
+    {
+        //Tiles with unknown expirations get the default the next time they're read
+        const QDateTime expireTime = _expirations.value(iter.key());
+        if (expireTime.isNull() || expireTime >= now)
+            continue;
+
+        this->remove(iter.key());
+        freed += iter.value().size;
+    }
+    return freed;
+}
+
+QDateTime FileTreeDiskTileCache::oldestAccessTime()
+{
+    this->ensureInventory();
+
+    QMutexLocker lock(&_mutex);
+    if (_inventory.isEmpty())
+        return QDateTime();
+
+    qint64 oldest = _inventory.constBegin().value().lastAccess;
+    foreach(const InventoryEntry& entry, _inventory)
+        oldest = qMin(oldest, entry.lastAccess);
+    return QDateTime::fromMSecsSinceEpoch(oldest).toUTC();
+}
+
+quint64 FileTreeDiskTileCache::evictLeastRecentlyUsed(quint64 bytes)
+{
+    const QHash<TileKey, InventoryEntry> inventory = this->inventorySnapshot();
+
+    QVector<AccessRecord> byAge;
+    byAge.reserve(inventory.size());
+    QHash<TileKey, InventoryEntry>::const_iterator iter;
+    for (iter = inventory.constBegin(); iter != inventory.constEnd(); iter++)
+        byAge.append(AccessRecord(iter.value().lastAccess, iter.key()));
+    std::sort(byAge.begin(), byAge.end());
+
+    quint64 freed = 0;
+    foreach(const AccessRecord& record, byAge)
+    {
+        if (freed >= bytes)
+            break;
+        this->remove(record.second);
+        freed += inventory.value(record.second).size;
+    }
+    return freed;
+}
+
+QString FileTreeDiskTileCache::tileFile(const TileKey &key) const
+{
+    QString toRet = _directory % "/" % QString::number(key.z()) % "/" % QString::number(key.x()) % "/" % QString::number(key.y()) % "." % _extension;
+    return toRet;
+}
+
+//private
+QString FileTreeDiskTileCache::validatorsFile(const TileKey &key) const
+{
+    return this->tileFile(key) % ".validators";
+}
+
+//private
+bool FileTreeDiskTileCache::ensureTileDirectory(const TileKey &key)
+{
+    const TileKey column(key.x(), 0, key.z());
+
+    QMutexLocker lock(&_mutex);
+    if (_knownDirectories.contains(column))
+        return true;
+    lock.unlock();
+
+    const QString path = _directory % "/" % QString::number(key.z()) % "/" % QString::number(key.x());
+    if (!QDir().mkpath(path))
+    {
+        qWarning() << "Failed to create cache directory" << path;
+        return false;
+    }
+
+    lock.relock();
+    _knownDirectories.insert(column);
+    return true;
+}
+
+//private
+void FileTreeDiskTileCache::recordAccess(const TileKey &key, quint64 size)
+{
+    InventoryEntry entry;
+    entry.size = size;
+    entry.lastAccess = QDateTime::currentMSecsSinceEpoch();
+
+    QMutexLocker lock(&_mutex);
+    if (_inventory.contains(key))
+        _inventoryBytes -= _inventory.value(key).size;
+    _inventory.insert(key, entry);
+    _inventoryBytes += size;
+}
+
+//private
+void FileTreeDiskTileCache::ensureInventory()
+{
+    QMutexLocker lock(&_mutex);
+    if (_inventoryScanned)
+        return;
+    lock.unlock();
+
+    //Walk the tree without holding the lock. Tiles are <z>/<x>/<y>.<extension>.
+    QHash<TileKey, InventoryEntry> scanned;
+    QDirIterator iter(_directory,
+                      QStringList() << ("*." + _extension),
+                      QDir::Files,
+                      QDirIterator::Subdirectories);
+    while (iter.hasNext())
+    {
+        iter.next();
+        const QFileInfo info = iter.fileInfo();
+        const QStringList parts = QDir(_directory).relativeFilePath(info.filePath()).split('/');
+        if (parts.size() != 3)
+            continue;
+
+        bool zOk = false, xOk = false, yOk = false;
+        const quint32 z = parts.at(0).toUInt(&zOk);
+        const quint32 x = parts.at(1).toUInt(&xOk);
+        const quint32 y = info.completeBaseName().toUInt(&yOk);
+        if (!zOk || !xOk || !yOk || z > 63)
+            continue;
+
+        InventoryEntry entry;
+        entry.size = info.size();
+        entry.lastAccess = info.lastModified().toMSecsSinceEpoch();
+        scanned.insert(TileKey(x, y, quint8(z)), entry);
+    }
+
+    //Anything read or written while we were scanning is already in the inventory, and more up to date
+    lock.relock();
+    QHash<TileKey, InventoryEntry>::const_iterator scannedIter;
+    for (scannedIter = scanned.constBegin(); scannedIter != scanned.constEnd(); scannedIter++)
+    {
+        if (_inventory.contains(scannedIter.key()))
+            continue;
+        _inventory.insert(scannedIter.key(), scannedIter.value());
+        _inventoryBytes += scannedIter.value().size;
+    }
+    _inventoryScanned = true;
+}
+
+//private
+QHash<TileKey, FileTreeDiskTileCache::InventoryEntry> FileTreeDiskTileCache::inventorySnapshot()
+{
+    this->ensureInventory();
+
+    QMutexLocker lock(&_mutex);
+    return _inventory;
+}
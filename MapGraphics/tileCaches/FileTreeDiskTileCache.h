@@ -0,0 +1,111 @@
+#ifndef FILETREEDISKTILECACHE_H
+#define FILETREEDISKTILECACHE_H
+
+#include "DiskTileCache.h"
+#include "TileExpirationIndex.h"
+
+#include <QHash>
+#include <QSet>
+#include <QMutex>
+#include <QString>
+
+/**
+ * @brief DiskTileCache that stores one file per tile in a <directory>/<z>/<x>/<y>.<extension> tree. Tile
+ * expirations are kept in a TileExpirationIndex at the root of the tree; flush() persists the changes.
+ * The HTTP validators of a tile, if it has any, go in a small <y>.<extension>.validators file next to it,
+ * which is only read once the tile has expired.
+ *
+ * For eviction, the cache keeps an in-memory inventory of the size and last access time of every tile.
+ * Tiles are added to it as they are read and written, and the rest of the tree is scanned the first time
+ * the janitor asks about it. Access times aren't written to disk, so after a restart the modification
+ * time of each file stands in for when it was last used.
+ */
+class MAPGRAPHICSSHARED_EXPORT FileTreeDiskTileCache : public DiskTileCache
+{
+public:
+    FileTreeDiskTileCache(const QString& directory, const QString& extension);
+    virtual ~FileTreeDiskTileCache();
+
+    //pure-virtual from DiskTileCache
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime,
+                      QByteArray * etag, QByteArray * lastModified);
+
+    //pure-virtual from DiskTileCache
+    virtual void write(const TileKey& key, const QByteArray& data, const QDateTime& expireTime,
+                       const QByteArray& etag, const QByteArray& lastModified);
+
+    //pure-virtual from DiskTileCache
+    virtual bool contains(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual void remove(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    //pure-virtual from DiskTileCache
+    virtual void flush();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 bytesUsed();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 removeExpired(const QDateTime& now);
+
+    //pure-virtual from DiskTileCache
+    virtual QDateTime oldestAccessTime();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 evictLeastRecentlyUsed(quint64 bytes);
+
+    /**
+     * @brief Returns the full path to the file where a tile is (or would be) cached
+     *
+     * @param key
+     * @return QString
+     */
+    QString tileFile(const TileKey& key) const;
+
+private:
+    //Returns the full path to the file where the HTTP validators of a tile are kept
+    QString validatorsFile(const TileKey& key) const;
+
+    struct InventoryEntry
+    {
+        quint64 size;
+        qint64 lastAccess;
+    };
+
+    //Notes that a tile of the given size was just read or written
+    void recordAccess(const TileKey& key, quint64 size);
+
+    //Adds the tiles we haven't seen yet to the inventory by scanning the tree, the first time only
+    void ensureInventory();
+
+    //Returns a copy of the inventory, which may then be walked without holding _mutex
+    QHash<TileKey, InventoryEntry> inventorySnapshot();
+
+    //Creates the directory that will hold a tile if we haven't already done so
+    bool ensureTileDirectory(const TileKey& key);
+
+    QString _directory;
+    QString _extension;
+
+    //Thread-safe on its own
+    TileExpirationIndex _expirations;
+
+    QMutex _mutex;
+
+    //Directories (one per z,x column) we've already made sure exist, keyed by TileKey(x,0,z)
+    QSet<TileKey> _knownDirectories;
+
+    //Size and last access time (in msecs since epoch) of every tile we know of
+    QHash<TileKey, InventoryEntry> _inventory;
+    quint64 _inventoryBytes;
+    bool _inventoryScanned;
+};
+
+#endif // FILETREEDISKTILECACHE_H
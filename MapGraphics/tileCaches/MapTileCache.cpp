@@ -0,0 +1,340 @@
+#include "MapTileCache.h"
+
+#include <QBuffer>
+#include <QMutexLocker>
+#include <QtDebug>
+
+#include "MapTile.h"
+
+MapTileCache::MapTileCache()
+{
+}
+
+MapTileCache::~MapTileCache()
+{
+}
+
+void MapTileCache::addTier(QSharedPointer<MapTileCacheTier> tier, bool writeThrough)
+{
+    if (tier.isNull())
+        return;
+
+    QMutexLocker lock(&_mutex);
+    Tier toAdd;
+    toAdd.tier = tier;
+    toAdd.writeThrough = writeThrough;
+    _tiers.append(toAdd);
+
+    //Tiers above a tier that isn't write-through have to hang on to what they evict so we can demote it
+    if (_tiers.size() > 1)
+        _tiers.at(_tiers.size() - 2).tier->setCollectEvictions(!writeThrough);
+}
+
+void MapTileCache::removeTier(QSharedPointer<MapTileCacheTier> tier)
+{
+    QMutexLocker lock(&_mutex);
+    for (int i = _tiers.size() - 1; i >= 0; i--)
+    {
+        if (_tiers.at(i).tier == tier)
+            _tiers.removeAt(i);
+    }
+
+    tier->setCollectEvictions(false);
+    for (int i = 0; i < _tiers.size(); i++)
+        _tiers.at(i).tier->setCollectEvictions(i + 1 < _tiers.size() && !_tiers.at(i + 1).writeThrough);
+    lock.unlock();
+
+    QMutexLocker statsLock(&_statsMutex);
+    _tierStats.remove(tier.data());
+}
+
+QList<QSharedPointer<MapTileCacheTier> > MapTileCache::tiers() const
+{
+    QList<QSharedPointer<MapTileCacheTier> > toRet;
+    foreach(const Tier& tier, this->tierSnapshot())
+        toRet.append(tier.tier);
+    return toRet;
+}
+
+QByteArray MapTileCache::encodingFormat() const
+{
+    QMutexLocker lock(&_mutex);
+    return _encodingFormat;
+}
+
+void MapTileCache::setEncodingFormat(const QByteArray &format)
+{
+    QMutexLocker lock(&_mutex);
+    _encodingFormat = format;
+}
+
+bool MapTileCache::hasSlowTiers() const
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+    {
+        if (!MapTileCache::isFast(tier.tier.data()))
+            return true;
+    }
+    return false;
+}
+
+bool MapTileCache::fastLookup(const TileKey &key, CachedTile *tile)
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    CachedTile found;
+    for (int i = 0; i < tiers.size(); i++)
+    {
+        if (!MapTileCache::isFast(tiers.at(i).tier.data()))
+            break;
+
+        const bool hit = tiers.at(i).tier->lookup(key, &found) && !found.image.isNull();
+        this->countLookup(tiers.at(i).tier.data(), hit);
+        if (!hit)
+            continue;
+
+        //Promote into the (fast) tiers above
+        if (!found.isExpired())
+        {
+            for (int j = 0; j < i; j++)
+                this->insertInto(tiers, j, key, found);
+        }
+
+        if (tile)
+            *tile = found;
+        return true;
+    }
+    return false;
+}
+
+bool MapTileCache::peek(const TileKey &key, CachedTile *tile) const
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    CachedTile found;
+    for (int i = 0; i < tiers.size(); i++)
+    {
+        if (!MapTileCache::isFast(tiers.at(i).tier.data()))
+            break;
+
+        if (tiers.at(i).tier->lookup(key, &found) && !found.image.isNull())
+        {
+            if (tile)
+                *tile = found;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MapTileCache::slowLookup(const TileKey &key, CachedTile *tile)
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    //fastLookup() has already checked these
+    int start = 0;
+    while (start < tiers.size() && MapTileCache::isFast(tiers.at(start).tier.data()))
+        start++;
+
+    CachedTile found;
+    for (int i = start; i < tiers.size(); i++)
+    {
+        const QSharedPointer<MapTileCacheTier>& tier = tiers.at(i).tier;
+        if (!tier->lookup(key, &found))
+        {
+            this->countLookup(tier.data(), false);
+            continue;
+        }
+
+        if (found.image.isNull() && !found.image.loadFromData(found.encoded))
+        {
+            //Don't let a broken tile keep coming back
+            qWarning() << "Failed to decode" << key.toString() << "from cache. Removing it.";
+            tier->remove(key);
+            this->countLookup(tier.data(), false);
+            continue;
+        }
+        this->countLookup(tier.data(), true);
+
+        //Decoding happens off the tile source's thread, so this is the place to get it ready for painting
+        found.image = MapTile::toPaintFormat(found.image);
+
+        //There's no point keeping an expired tile any closer to the top
+        if (!found.isExpired())
+        {
+            for (int j = 0; j < i; j++)
+                this->insertInto(tiers, j, key, found);
+        }
+
+        if (tile)
+            *tile = found;
+        return true;
+    }
+    return false;
+}
+
+void MapTileCache::insert(const TileKey &key, const CachedTile &tile)
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    //insertInto() fills in the encoded bytes the first time they're needed, so we only encode once
+    CachedTile toInsert = tile;
+    for (int i = 0; i < tiers.size(); i++)
+    {
+        if (tiers.at(i).writeThrough)
+            this->insertInto(tiers, i, key, toInsert);
+    }
+}
+
+void MapTileCache::fastInsert(const TileKey &key, const CachedTile &tile)
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    CachedTile toInsert = tile;
+    for (int i = 0; i < tiers.size() && MapTileCache::isFast(tiers.at(i).tier.data()); i++)
+    {
+        if (tiers.at(i).writeThrough)
+            this->insertInto(tiers, i, key, toInsert);
+    }
+}
+
+void MapTileCache::slowInsert(const TileKey &key, const CachedTile &tile)
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    //fastInsert() has already done these
+    int start = 0;
+    while (start < tiers.size() && MapTileCache::isFast(tiers.at(start).tier.data()))
+        start++;
+
+    CachedTile toInsert = tile;
+    for (int i = start; i < tiers.size(); i++)
+    {
+        if (tiers.at(i).writeThrough)
+            this->insertInto(tiers, i, key, toInsert);
+    }
+}
+
+void MapTileCache::remove(const TileKey &key)
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+        tier.tier->remove(key);
+}
+
+bool MapTileCache::contains(const TileKey &key)
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+    {
+        if (tier.tier->contains(key))
+            return true;
+    }
+    return false;
+}
+
+QDateTime MapTileCache::expirationTime(const TileKey &key)
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+    {
+        const QDateTime toRet = tier.tier->expirationTime(key);
+        if (!toRet.isNull())
+            return toRet;
+    }
+    return QDateTime();
+}
+
+void MapTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+        tier.tier->setExpirationTime(key, expireTime);
+}
+
+void MapTileCache::flush()
+{
+    foreach(const Tier& tier, this->tierSnapshot())
+        tier.tier->flush();
+}
+
+QList<MapTileCache::TierStats> MapTileCache::tierStats() const
+{
+    const QList<Tier> tiers = this->tierSnapshot();
+
+    QList<MapTileCache::TierStats> toRet;
+    QMutexLocker lock(&_statsMutex);
+    foreach(const Tier& tier, tiers)
+    {
+        MapTileCache::TierStats stats = _tierStats.value(tier.tier.data());
+        stats.name = tier.tier->name();
+        toRet.append(stats);
+    }
+    return toRet;
+}
+
+void MapTileCache::resetTierStats()
+{
+    QMutexLocker lock(&_statsMutex);
+    _tierStats.clear();
+}
+
+//static
+QByteArray MapTileCache::encode(const QImage &image, const QByteArray &format)
+{
+    //No compression for lossy file types!
+    const int quality = 100;
+
+    QByteArray toRet;
+    QBuffer buffer(&toRet);
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, format.isEmpty() ? 0 : format.constData(), quality))
+        return QByteArray();
+    return toRet;
+}
+
+//private
+QList<MapTileCache::Tier> MapTileCache::tierSnapshot() const
+{
+    QMutexLocker lock(&_mutex);
+    return _tiers;
+}
+
+//private
+void MapTileCache::insertInto(const QList<MapTileCache::Tier> &tiers, int index, const TileKey &key, CachedTile &tile)
+{
+    const QSharedPointer<MapTileCacheTier>& tier = tiers.at(index).tier;
+    if ((tier->representations() & MapTileCacheTier::Encoded) && tile.encoded.isEmpty() && !tile.image.isNull())
+    {
+        tile.encoded = MapTileCache::encode(tile.image, this->encodingFormat());
+        if (tile.encoded.isEmpty())
+            qWarning() << "Failed to encode" << key.toString() << "for cache";
+    }
+
+    tier->insert(key, tile);
+    this->demote(tiers, index);
+}
+
+//private
+void MapTileCache::demote(const QList<MapTileCache::Tier> &tiers, int index)
+{
+    if (index + 1 >= tiers.size() || tiers.at(index + 1).writeThrough)
+        return;
+
+    typedef QPair<TileKey, CachedTile> Evicted;
+    foreach(Evicted evicted, tiers.at(index).tier->takeEvicted())
+        this->insertInto(tiers, index + 1, evicted.first, evicted.second);
+}
+
+//private static
+bool MapTileCache::isFast(const MapTileCacheTier *tier)
+{
+    return !tier->isSlow() && (tier->representations() & MapTileCacheTier::Decoded);
+}
+
+//private
+void MapTileCache::countLookup(const MapTileCacheTier *tier, bool hit)
+{
+    QMutexLocker lock(&_statsMutex);
+    MapTileCache::TierStats& stats = _tierStats[tier];
+    if (hit)
+        stats.hits++;
+    else
+        stats.misses++;
+}
@@ -0,0 +1,205 @@
+#ifndef MAPTILECACHE_H
+#define MAPTILECACHE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+
+#include "MapTileCacheTier.h"
+
+/**
+ * @brief A stack of MapTileCacheTiers, fastest first, that together make up a MapTileSource's cache. The
+ * default stack is decoded tiles in RAM, then encoded tiles in RAM, then encoded tiles on disk, but any
+ * tiers may be used.
+ *
+ * Lookups go down the stack until a tier has the tile, which is then promoted into the tiers above it.
+ * Tiles are inserted into every write-through tier. Tiers that aren't write-through only get tiles that
+ * are promoted into them or demoted (evicted) from the tier just above them.
+ *
+ * Lookups are split in two so that a MapTileSource never waits on I/O or decoding in its own thread:
+ * fastLookup() only checks the tiers that hold decoded images in RAM, and slowLookup() (to be called from
+ * a worker thread) checks the rest and decodes what it finds. Inserts are split the same way, with
+ * fastInsert() and slowInsert().
+ *
+ * Thread-safe.
+ */
+class MAPGRAPHICSSHARED_EXPORT MapTileCache
+{
+public:
+    /**
+     * @brief Hits and misses of the lookups this cache made in one of its tiers. Tiers shared with other
+     * caches count only the lookups made through this one.
+     */
+    struct TierStats
+    {
+        TierStats() : hits(0), misses(0) {}
+
+        QString name;
+        quint64 hits;
+        quint64 misses;
+    };
+
+public:
+    MapTileCache();
+    ~MapTileCache();
+
+    /**
+     * @brief Adds a tier below all the others
+     *
+     * @param tier
+     * @param writeThrough true if tiles should be inserted into this tier whenever they are inserted into
+     * the cache
+     */
+    void addTier(QSharedPointer<MapTileCacheTier> tier, bool writeThrough = true);
+
+    void removeTier(QSharedPointer<MapTileCacheTier> tier);
+
+    QList<QSharedPointer<MapTileCacheTier> > tiers() const;
+
+    /**
+     * @brief Returns the format (as in QImage::save()) tiles are encoded in for tiers that keep encoded bytes
+     *
+     * @return QByteArray
+     */
+    QByteArray encodingFormat() const;
+
+    void setEncodingFormat(const QByteArray& format);
+
+    /**
+     * @brief Returns true if some tiers can only be checked with slowLookup()
+     *
+     * @return bool
+     */
+    bool hasSlowTiers() const;
+
+    /**
+     * @brief Looks for a decoded tile in the tiers that keep decoded images and don't block, stopping at
+     * the first tier that doesn't qualify. Expired tiles are returned too. Cheap enough to call from any
+     * thread.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    bool fastLookup(const TileKey& key, CachedTile * tile);
+
+    /**
+     * @brief Like fastLookup(), but nothing is promoted and the lookup isn't counted in tierStats(). For
+     * looking at what's cached without it counting as a request for the tile.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    bool peek(const TileKey& key, CachedTile * tile) const;
+
+    /**
+     * @brief Looks for a tile in the tiers fastLookup() doesn't check. If the tile is found, it is decoded
+     * if necessary and (unless it has expired) promoted into the tiers above the one it was found in. Returns
+     * false on a miss or if the tile couldn't be decoded. May block --- call it from a worker thread.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    bool slowLookup(const TileKey& key, CachedTile * tile);
+
+    /**
+     * @brief Inserts a tile into every write-through tier. If a tier keeps encoded bytes but the tile has
+     * none, the image is encoded (once) in encodingFormat().
+     *
+     * @param key
+     * @param tile
+     */
+    void insert(const TileKey& key, const CachedTile& tile);
+
+    /**
+     * @brief Inserts a tile into the write-through tiers fastLookup() checks. Cheap enough to call from any
+     * thread.
+     *
+     * @param key
+     * @param tile
+     */
+    void fastInsert(const TileKey& key, const CachedTile& tile);
+
+    /**
+     * @brief Inserts a tile into the write-through tiers fastInsert() doesn't, encoding it (once) if a tier
+     * keeps encoded bytes and the tile has none. fastInsert() followed by slowInsert() is the same as
+     * insert(). May block --- call it from a worker thread.
+     *
+     * @param key
+     * @param tile
+     */
+    void slowInsert(const TileKey& key, const CachedTile& tile);
+
+    void remove(const TileKey& key);
+
+    bool contains(const TileKey& key);
+
+    /**
+     * @brief Returns the expiration time the first tier that knows it has for the tile, or a null
+     * QDateTime if none do
+     *
+     * @param key
+     * @return QDateTime
+     */
+    QDateTime expirationTime(const TileKey& key);
+
+    void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    /**
+     * @brief Flushes every tier
+     */
+    void flush();
+
+    /**
+     * @brief Returns the lookup counters of each tier, fastest first
+     *
+     * @return QList<MapTileCache::TierStats>
+     */
+    QList<MapTileCache::TierStats> tierStats() const;
+
+    void resetTierStats();
+
+    /**
+     * @brief Encodes image in format. Returns an empty QByteArray on failure.
+     *
+     * @param image
+     * @param format
+     * @return QByteArray
+     */
+    static QByteArray encode(const QImage& image, const QByteArray& format);
+
+private:
+    struct Tier
+    {
+        QSharedPointer<MapTileCacheTier> tier;
+        bool writeThrough;
+    };
+
+    //Returns a snapshot of the tiers so that we don't hold _mutex while calling into them
+    QList<Tier> tierSnapshot() const;
+
+    //Inserts into one tier, encoding if needed, then demotes whatever that tier evicted
+    void insertInto(const QList<Tier>& tiers, int index, const TileKey& key, CachedTile& tile);
+
+    //Hands the tiles evicted from tiers[index] to the tier below it if that one isn't write-through
+    void demote(const QList<Tier>& tiers, int index);
+
+    //True if fastLookup() checks the tier
+    static bool isFast(const MapTileCacheTier * tier);
+
+    void countLookup(const MapTileCacheTier * tier, bool hit);
+
+    mutable QMutex _mutex;
+    QList<Tier> _tiers;
+    QByteArray _encodingFormat;
+
+    //Lookup counters by tier. Kept apart from _mutex so that counting never waits on tier changes.
+    mutable QMutex _statsMutex;
+    QHash<const MapTileCacheTier *, TierStats> _tierStats;
+};
+
+#endif // MAPTILECACHE_H
@@ -0,0 +1,52 @@
+#include "MapTileCacheTier.h"
+
+#include <QMutexLocker>
+
+//Never keep more than this many evicted tiles around for demotion --- nobody is asking for them
+const int MAX_COLLECTED_EVICTIONS = 256;
+
+MapTileCacheTier::MapTileCacheTier() :
+    _collectEvictions(false)
+{
+}
+
+MapTileCacheTier::~MapTileCacheTier()
+{
+}
+
+QString MapTileCacheTier::name() const
+{
+    return "tier";
+}
+
+void MapTileCacheTier::flush()
+{
+}
+
+void MapTileCacheTier::setCollectEvictions(bool collect)
+{
+    QMutexLocker lock(&_evictedMutex);
+    _collectEvictions = collect;
+    if (!collect)
+        _evicted.clear();
+}
+
+QList<QPair<TileKey, CachedTile> > MapTileCacheTier::takeEvicted()
+{
+    QMutexLocker lock(&_evictedMutex);
+    QList<QPair<TileKey, CachedTile> > toRet;
+    toRet.swap(_evicted);
+    return toRet;
+}
+
+//protected
+void MapTileCacheTier::tileEvicted(const TileKey &key, const CachedTile &tile)
+{
+    QMutexLocker lock(&_evictedMutex);
+    if (!_collectEvictions)
+        return;
+
+    _evicted.append(qMakePair(key, tile));
+    while (_evicted.size() > MAX_COLLECTED_EVICTIONS)
+        _evicted.removeFirst();
+}
@@ -0,0 +1,157 @@
+#ifndef MAPTILECACHETIER_H
+#define MAPTILECACHETIER_H
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QImage>
+#include <QList>
+#include <QMetaType>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief What a cache tier holds for one tile: the decoded image, the encoded (png, jpg, etc.) bytes it
+ * came from, or both, along with the time the tile expires. Tiles that came from an HTTP server may also
+ * carry the ETag and Last-Modified headers they were served with, which are used to revalidate the tile
+ * once it expires. Tiers that can't keep them may drop them.
+ */
+struct MAPGRAPHICSSHARED_EXPORT CachedTile
+{
+    QImage image;
+    QByteArray encoded;
+    QDateTime expireTime;
+    QByteArray etag;
+    QByteArray lastModified;
+
+    bool isNull() const
+    {
+        return image.isNull() && encoded.isEmpty();
+    }
+
+    /**
+     * @brief Returns true if the tile expired at or before now. Tiles with an unknown expiration never
+     * expire.
+     *
+     * @param now
+     * @return bool
+     */
+    bool isExpired(const QDateTime& now = QDateTime::currentDateTimeUtc()) const
+    {
+        return !expireTime.isNull() && now.secsTo(expireTime) <= 0;
+    }
+};
+Q_DECLARE_METATYPE(CachedTile)
+
+/**
+ * @brief One level of a MapTileCache. A tier keeps decoded images, encoded bytes, or both (see
+ * representations()), and says whether looking things up in it may block on I/O (see isSlow()).
+ *
+ * Tiers return expired tiles like any other --- deciding what to do with them is up to whoever asked.
+ * Tiers that evict tiles on their own (e.g., to stay within a budget) report them with tileEvicted() so
+ * that the MapTileCache can demote them to the next tier down.
+ *
+ * Implementations must be safe to call from several threads at once.
+ */
+class MAPGRAPHICSSHARED_EXPORT MapTileCacheTier
+{
+public:
+    /**
+     * @brief The parts of a CachedTile a tier can keep
+     */
+    enum Representation
+    {
+        Decoded = 0x1,
+        Encoded = 0x2
+    };
+
+public:
+    MapTileCacheTier();
+    virtual ~MapTileCacheTier();
+
+    /**
+     * @brief Returns the Representation flags of the parts of a CachedTile this tier keeps. Parts it
+     * doesn't keep are dropped on insert.
+     *
+     * @return int
+     */
+    virtual int representations() const=0;
+
+    /**
+     * @brief Returns true if lookups may block on I/O, in which case they are only made from worker threads
+     *
+     * @return bool
+     */
+    virtual bool isSlow() const=0;
+
+    /**
+     * @brief Returns a short description of the tier (e.g., "disk") for metrics and debugging
+     *
+     * @return QString
+     */
+    virtual QString name() const;
+
+    /**
+     * @brief Looks up a tile. Returns false on a miss.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    virtual bool lookup(const TileKey& key, CachedTile * tile)=0;
+
+    virtual void insert(const TileKey& key, const CachedTile& tile)=0;
+
+    virtual bool contains(const TileKey& key)=0;
+
+    virtual void remove(const TileKey& key)=0;
+
+    /**
+     * @brief Returns the time the tile expires, or a null QDateTime if the tier doesn't have the tile or
+     * doesn't know
+     *
+     * @param key
+     * @return QDateTime
+     */
+    virtual QDateTime expirationTime(const TileKey& key)=0;
+
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime)=0;
+
+    /**
+     * @brief Persists anything the tier has buffered. Does nothing by default.
+     */
+    virtual void flush();
+
+    /**
+     * @brief Turns on (or off) collecting evicted tiles for takeEvicted(). Off by default.
+     *
+     * @param collect
+     */
+    void setCollectEvictions(bool collect);
+
+    /**
+     * @brief Returns the tiles evicted since the last call, oldest first, if collecting is on
+     *
+     * @return QList<QPair<TileKey, CachedTile> >
+     */
+    QList<QPair<TileKey, CachedTile> > takeEvicted();
+
+protected:
+    /**
+     * @brief Implementations call this when they evict a tile on their own accord
+     *
+     * @param key
+     * @param tile
+     */
+    void tileEvicted(const TileKey& key, const CachedTile& tile);
+
+private:
+    QMutex _evictedMutex;
+    bool _collectEvictions;
+    QList<QPair<TileKey, CachedTile> > _evicted;
+};
+
+#endif // MAPTILECACHETIER_H
@@ -0,0 +1,338 @@
+#include "MemoryTileCache.h"
+
+#include <QMutexLocker>
+#include <QtDebug>
+
+const quint64 MemoryTileCache::DEFAULT_BUDGET;
+
+//static
+QMutex MemoryTileCache::_registryMutex;
+QList<MemoryTileCache *> MemoryTileCache::_registry = QList<MemoryTileCache *>();
+QMutex MemoryTileCache::_globalMutex;
+quint64 MemoryTileCache::_globalBudget = 0;
+quint64 MemoryTileCache::_globalBytesUsed = 0;
+quint64 MemoryTileCache::_useCounter = 0;
+
+MemoryTileCache::MemoryTileCache(int representations, quint64 budget) :
+    _representations(representations), _newest(0), _oldest(0), _budget(budget), _bytesUsed(0),
+    _hits(0), _misses(0), _insertions(0), _evictions(0)
+{
+    QMutexLocker lock(&_registryMutex);
+    _registry.append(this);
+}
+
+MemoryTileCache::~MemoryTileCache()
+{
+    QMutexLocker lock(&_registryMutex);
+    _registry.removeAll(this);
+    lock.unlock();
+
+    this->clear();
+}
+
+//pure-virtual from MapTileCacheTier
+int MemoryTileCache::representations() const
+{
+    return _representations;
+}
+
+//pure-virtual from MapTileCacheTier
+bool MemoryTileCache::isSlow() const
+{
+    return false;
+}
+
+//virtual from MapTileCacheTier
+QString MemoryTileCache::name() const
+{
+    return (_representations & MapTileCacheTier::Decoded) ? "decoded memory" : "encoded memory";
+}
+
+bool MemoryTileCache::lookup(const TileKey &key, CachedTile *tile)
+{
+    QMutexLocker lock(&_mutex);
+    Entry * entry = _entries.value(key, 0);
+    if (entry == 0)
+    {
+        _misses++;
+        return false;
+    }
+
+    _hits++;
+    this->touch(entry);
+    if (tile)
+        *tile = entry->tile;
+    return true;
+}
+
+void MemoryTileCache::insert(const TileKey &key, const CachedTile &tile)
+{
+    //Keep only the parts we're meant to
+    CachedTile toCache;
+    toCache.expireTime = tile.expireTime;
+    toCache.etag = tile.etag;
+    toCache.lastModified = tile.lastModified;
+    if (_representations & MapTileCacheTier::Decoded)
+        toCache.image = tile.image;
+    if (_representations & MapTileCacheTier::Encoded)
+    {
+        toCache.encoded = tile.encoded;
+
+        //Network replies and the like tend to leave slack at the end of the buffer that we'd pay for unseen
+        if (toCache.encoded.capacity() > toCache.encoded.size())
+            toCache.encoded.squeeze();
+    }
+    if (toCache.isNull())
+        return;
+
+    const quint64 cost = MemoryTileCache::tileCost(toCache);
+
+    QMutexLocker lock(&_mutex);
+
+    //Get rid of any old version of the tile first
+    Entry * old = _entries.value(key, 0);
+    if (old != 0)
+        this->removeEntry(old);
+
+    //Don't bother caching things that can never fit
+    if (cost > _budget)
+        return;
+
+    Entry * entry = new Entry();
+    entry->key = key;
+    entry->tile = toCache;
+    entry->cost = cost;
+    entry->lastUse = 0;
+    entry->newer = 0;
+    entry->older = 0;
+    _entries.insert(key, entry);
+    this->touch(entry);
+
+    _bytesUsed += cost;
+    _insertions++;
+    MemoryTileCache::addGlobalBytesUsed(cost);
+
+    this->trimToBudget();
+
+    //We must not hold our own lock while enforcing the global budget since that locks the other caches
+    lock.unlock();
+    MemoryTileCache::enforceGlobalBudget();
+}
+
+bool MemoryTileCache::contains(const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    return _entries.contains(key);
+}
+
+void MemoryTileCache::remove(const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    Entry * entry = _entries.value(key, 0);
+    if (entry != 0)
+        this->removeEntry(entry);
+}
+
+QDateTime MemoryTileCache::expirationTime(const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    Entry * entry = _entries.value(key, 0);
+    if (entry == 0)
+        return QDateTime();
+    return entry->tile.expireTime;
+}
+
+void MemoryTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    QMutexLocker lock(&_mutex);
+    Entry * entry = _entries.value(key, 0);
+    if (entry != 0)
+        entry->tile.expireTime = expireTime;
+}
+
+void MemoryTileCache::clear()
+{
+    QMutexLocker lock(&_mutex);
+    while (_oldest != 0)
+        this->removeEntry(_oldest);
+}
+
+quint64 MemoryTileCache::budget() const
+{
+    QMutexLocker lock(&_mutex);
+    return _budget;
+}
+
+void MemoryTileCache::setBudget(quint64 bytes)
+{
+    QMutexLocker lock(&_mutex);
+    _budget = bytes;
+    this->trimToBudget();
+}
+
+quint64 MemoryTileCache::bytesUsed() const
+{
+    QMutexLocker lock(&_mutex);
+    return _bytesUsed;
+}
+
+MemoryTileCache::Stats MemoryTileCache::stats() const
+{
+    QMutexLocker lock(&_mutex);
+    MemoryTileCache::Stats toRet;
+    toRet.hits = _hits;
+    toRet.misses = _misses;
+    toRet.insertions = _insertions;
+    toRet.evictions = _evictions;
+    toRet.bytesUsed = _bytesUsed;
+    toRet.budget = _budget;
+    toRet.count = _entries.size();
+    return toRet;
+}
+
+//static
+quint64 MemoryTileCache::globalBudget()
+{
+    QMutexLocker lock(&_globalMutex);
+    return _globalBudget;
+}
+
+//static
+void MemoryTileCache::setGlobalBudget(quint64 bytes)
+{
+    QMutexLocker lock(&_globalMutex);
+    _globalBudget = bytes;
+    lock.unlock();
+
+    MemoryTileCache::enforceGlobalBudget();
+}
+
+//static
+quint64 MemoryTileCache::globalBytesUsed()
+{
+    QMutexLocker lock(&_globalMutex);
+    return _globalBytesUsed;
+}
+
+//static
+quint64 MemoryTileCache::imageCost(const QImage &image)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,10,0)
+    return image.sizeInBytes();
+#else
+    return image.byteCount();
+#endif
+}
+
+//static
+quint64 MemoryTileCache::tileCost(const CachedTile &tile)
+{
+    return MemoryTileCache::imageCost(tile.image) + tile.encoded.size() + tile.etag.size() + tile.lastModified.size();
+}
+
+//private
+void MemoryTileCache::removeEntry(MemoryTileCache::Entry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        _newest = entry->older;
+
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        _oldest = entry->newer;
+
+    _entries.remove(entry->key);
+    _bytesUsed -= entry->cost;
+    MemoryTileCache::addGlobalBytesUsed(-qint64(entry->cost));
+    delete entry;
+}
+
+//private
+void MemoryTileCache::touch(MemoryTileCache::Entry *entry)
+{
+    QMutexLocker globalLock(&_globalMutex);
+    entry->lastUse = ++_useCounter;
+    globalLock.unlock();
+
+    if (entry == _newest)
+        return;
+
+    //Unlink (if linked)
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    if (_oldest == entry)
+        _oldest = entry->newer;
+
+    //Relink at the front
+    entry->older = _newest;
+    entry->newer = 0;
+    if (_newest)
+        _newest->newer = entry;
+    _newest = entry;
+    if (_oldest == 0)
+        _oldest = entry;
+}
+
+//private
+void MemoryTileCache::evictOldest()
+{
+    //Offer it to whoever's below us before it's gone
+    this->tileEvicted(_oldest->key, _oldest->tile);
+    this->removeEntry(_oldest);
+    _evictions++;
+}
+
+//private
+void MemoryTileCache::trimToBudget()
+{
+    while (_bytesUsed > _budget && _oldest != 0)
+        this->evictOldest();
+}
+
+//private static
+void MemoryTileCache::enforceGlobalBudget()
+{
+    QMutexLocker registryLock(&_registryMutex);
+
+    while (true)
+    {
+        QMutexLocker globalLock(&_globalMutex);
+        if (_globalBudget == 0 || _globalBytesUsed <= _globalBudget)
+            return;
+        globalLock.unlock();
+
+        //Find the cache whose least-recently-used tile is the oldest in the process
+        MemoryTileCache * victim = 0;
+        quint64 oldestUse = 0;
+        foreach(MemoryTileCache * cache, _registry)
+        {
+            QMutexLocker cacheLock(&cache->_mutex);
+            if (cache->_oldest == 0)
+                continue;
+            if (victim == 0 || cache->_oldest->lastUse < oldestUse)
+            {
+                victim = cache;
+                oldestUse = cache->_oldest->lastUse;
+            }
+        }
+
+        //Nothing left to evict
+        if (victim == 0)
+            return;
+
+        QMutexLocker victimLock(&victim->_mutex);
+        if (victim->_oldest != 0)
+            victim->evictOldest();
+    }
+}
+
+//private static
+void MemoryTileCache::addGlobalBytesUsed(qint64 delta)
+{
+    QMutexLocker lock(&_globalMutex);
+    _globalBytesUsed += delta;
+}
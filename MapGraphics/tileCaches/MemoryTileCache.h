@@ -0,0 +1,199 @@
+#ifndef MEMORYTILECACHE_H
+#define MEMORYTILECACHE_H
+
+#include <QImage>
+#include <QDateTime>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+
+#include "MapTileCacheTier.h"
+
+/**
+ * @brief A thread-safe, least-recently-used in-memory MapTileCacheTier that is budgeted in bytes rather
+ * than in number of tiles. It keeps decoded images, encoded bytes or both, depending on the
+ * representations it is created with. The cost of each tile is the size of its pixel buffer plus the size
+ * of its encoded bytes, so a cache holds four times fewer decoded 512px tiles than 256px tiles.
+ *
+ * Every cache has its own budget. In addition, all caches in the process share a global budget: when the
+ * total size of every MemoryTileCache exceeds it, the least recently used tiles are evicted from whichever
+ * cache holds them.
+ */
+class MAPGRAPHICSSHARED_EXPORT MemoryTileCache : public MapTileCacheTier
+{
+public:
+    /**
+     * @brief Snapshot of the counters kept by a MemoryTileCache
+     */
+    struct Stats
+    {
+        Stats() : hits(0), misses(0), insertions(0), evictions(0), bytesUsed(0), budget(0), count(0) {}
+
+        quint64 hits;
+        quint64 misses;
+        quint64 insertions;
+        quint64 evictions;
+        quint64 bytesUsed;
+        quint64 budget;
+        int count;
+    };
+
+public:
+    /**
+     * @brief Creates a cache that keeps the given MapTileCacheTier::Representation flags of each tile
+     *
+     * @param representations
+     * @param budget
+     */
+    explicit MemoryTileCache(int representations = MapTileCacheTier::Decoded,
+                             quint64 budget = MemoryTileCache::DEFAULT_BUDGET);
+    virtual ~MemoryTileCache();
+
+    //pure-virtual from MapTileCacheTier
+    virtual int representations() const;
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool isSlow() const;
+
+    //virtual from MapTileCacheTier
+    virtual QString name() const;
+
+    /**
+     * @brief Looks up a tile. On a hit, copies the (implicitly-shared) tile into tile (if non-null), marks
+     * it as most recently used and returns true. Returns false on a miss.
+     *
+     * @param key
+     * @param tile
+     * @return bool
+     */
+    virtual bool lookup(const TileKey& key, CachedTile * tile);
+
+    /**
+     * @brief Inserts the parts of a tile this cache keeps, replacing any tile already cached under key.
+     * Tiles larger than the whole budget are not cached.
+     *
+     * @param key
+     * @param tile
+     */
+    virtual void insert(const TileKey& key, const CachedTile& tile);
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool contains(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual void remove(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    void clear();
+
+    quint64 budget() const;
+
+    /**
+     * @brief Sets the budget of this cache in bytes. Shrinking the budget evicts immediately.
+     *
+     * @param bytes
+     */
+    void setBudget(quint64 bytes);
+
+    quint64 bytesUsed() const;
+
+    MemoryTileCache::Stats stats() const;
+
+    /**
+     * @brief Returns the budget shared by every MemoryTileCache in the process. 0 means unlimited.
+     *
+     * @return quint64
+     */
+    static quint64 globalBudget();
+
+    /**
+     * @brief Sets the budget, in bytes, shared by every MemoryTileCache in the process. 0 means unlimited.
+     *
+     * @param bytes
+     */
+    static void setGlobalBudget(quint64 bytes);
+
+    /**
+     * @brief Returns the number of bytes held by all MemoryTileCaches in the process.
+     *
+     * @return quint64
+     */
+    static quint64 globalBytesUsed();
+
+    /**
+     * @brief Returns the cost in bytes of keeping image in a cache
+     *
+     * @param image
+     * @return quint64
+     */
+    static quint64 imageCost(const QImage& image);
+
+    /**
+     * @brief Returns the cost in bytes of keeping tile in a cache
+     *
+     * @param tile
+     * @return quint64
+     */
+    static quint64 tileCost(const CachedTile& tile);
+
+    //100 tiles of 256x256 32-bit pixels, for a cache with nothing behind it. MapTileSource gives its decoded
+    //tier 32 tiles instead (see MapTileSource::setMemoryCacheBudget()), since its encoded tier backs it up.
+    static const quint64 DEFAULT_BUDGET = 100 * 256 * 256 * 4;
+
+private:
+    struct Entry
+    {
+        TileKey key;
+        CachedTile tile;
+        quint64 cost;
+        quint64 lastUse;
+        Entry * newer;
+        Entry * older;
+    };
+
+    //Unlinks entry from the recency list and frees it. _mutex must be held.
+    void removeEntry(Entry * entry);
+
+    //Removes the least recently used entry and reports it evicted. _mutex must be held.
+    void evictOldest();
+
+    //Moves entry to the most-recently-used end. _mutex must be held.
+    void touch(Entry * entry);
+
+    //Evicts from the least-recently-used end until we fit in our own budget. _mutex must be held.
+    void trimToBudget();
+
+    //Evicts the least recently used tiles of all caches until the global budget is satisfied
+    static void enforceGlobalBudget();
+
+    static void addGlobalBytesUsed(qint64 delta);
+
+    const int _representations;
+
+    mutable QMutex _mutex;
+    QHash<TileKey, Entry *> _entries;
+    Entry * _newest;
+    Entry * _oldest;
+    quint64 _budget;
+    quint64 _bytesUsed;
+
+    quint64 _hits;
+    quint64 _misses;
+    quint64 _insertions;
+    quint64 _evictions;
+
+    static QMutex _registryMutex;
+    static QList<MemoryTileCache *> _registry;
+
+    static QMutex _globalMutex;
+    static quint64 _globalBudget;
+    static quint64 _globalBytesUsed;
+    static quint64 _useCounter;
+};
+
+#endif // MEMORYTILECACHE_H
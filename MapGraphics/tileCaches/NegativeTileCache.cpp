@@ -0,0 +1,143 @@
+#include "NegativeTileCache.h"
+
+#include <QMutexLocker>
+
+//Tiles the server doesn't have are unlikely to show up soon...
+const int DEFAULT_NOT_FOUND_TTL_SECS = 24 * 60 * 60;
+
+//...while a struggling server or a dropped connection may be back in a moment
+const int DEFAULT_SERVER_ERROR_TTL_SECS = 30;
+const int DEFAULT_NETWORK_ERROR_TTL_SECS = 10;
+const int DEFAULT_INVALID_TILE_TTL_SECS = 60 * 60;
+
+const int DEFAULT_MAXIMUM_BACKOFF_SECS = 60 * 60;
+
+//Pruning walks every failure, so only do it once there are a fair number of them
+const int PRUNE_THRESHOLD = 1024;
+
+NegativeTileCache::NegativeTileCache() :
+    _backoffEnabled(true), _maximumBackoff(DEFAULT_MAXIMUM_BACKOFF_SECS)
+{
+    _timeToLive[NotFound] = DEFAULT_NOT_FOUND_TTL_SECS;
+    _timeToLive[ServerError] = DEFAULT_SERVER_ERROR_TTL_SECS;
+    _timeToLive[NetworkError] = DEFAULT_NETWORK_ERROR_TTL_SECS;
+    _timeToLive[InvalidTile] = DEFAULT_INVALID_TILE_TTL_SECS;
+}
+
+bool NegativeTileCache::isBlocked(const TileKey &key, QDateTime *retryAt)
+{
+    QMutexLocker lock(&_mutex);
+    if (_failures.isEmpty())
+        return false;
+
+    QHash<TileKey, Failure>::const_iterator iter = _failures.constFind(key);
+    if (iter == _failures.constEnd() || iter.value().retryAt <= QDateTime::currentMSecsSinceEpoch())
+        return false;
+
+    if (retryAt)
+        *retryAt = QDateTime::fromMSecsSinceEpoch(iter.value().retryAt).toUTC();
+    return true;
+}
+
+void NegativeTileCache::recordFailure(const TileKey &key, NegativeTileCache::FailureClass failure)
+{
+    if (failure < 0 || failure >= FailureClassCount)
+        return;
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QMutexLocker lock(&_mutex);
+    if (_failures.size() >= PRUNE_THRESHOLD)
+        this->prune(now);
+
+    Failure& entry = _failures[key];
+    entry.failures = entry.isStale(now) ? 1 : entry.failures + 1;
+
+    //Double the wait for every failure in a row, without letting the shift run away
+    qint64 delayMSecs = qint64(_timeToLive[failure]) * 1000;
+    if (_backoffEnabled && entry.failures > 1)
+    {
+        delayMSecs <<= qMin(entry.failures - 1, 20);
+        delayMSecs = qMin(delayMSecs, qint64(qMax(_maximumBackoff, _timeToLive[failure])) * 1000);
+    }
+
+    //Up to 25% more, depending on the tile, so that tiles that failed together don't come due together
+    delayMSecs += delayMSecs * (qHash(key) % 256) / 1024;
+
+    entry.delay = delayMSecs;
+    entry.retryAt = now + delayMSecs;
+}
+
+void NegativeTileCache::recordSuccess(const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    if (!_failures.isEmpty())
+        _failures.remove(key);
+}
+
+void NegativeTileCache::clear()
+{
+    QMutexLocker lock(&_mutex);
+    _failures.clear();
+}
+
+int NegativeTileCache::timeToLive(NegativeTileCache::FailureClass failure) const
+{
+    if (failure < 0 || failure >= FailureClassCount)
+        return 0;
+
+    QMutexLocker lock(&_mutex);
+    return _timeToLive[failure];
+}
+
+void NegativeTileCache::setTimeToLive(NegativeTileCache::FailureClass failure, int secs)
+{
+    if (failure < 0 || failure >= FailureClassCount)
+        return;
+
+    QMutexLocker lock(&_mutex);
+    _timeToLive[failure] = qMax(0, secs);
+}
+
+bool NegativeTileCache::backoffEnabled() const
+{
+    QMutexLocker lock(&_mutex);
+    return _backoffEnabled;
+}
+
+void NegativeTileCache::setBackoffEnabled(bool enabled)
+{
+    QMutexLocker lock(&_mutex);
+    _backoffEnabled = enabled;
+}
+
+int NegativeTileCache::maximumBackoff() const
+{
+    QMutexLocker lock(&_mutex);
+    return _maximumBackoff;
+}
+
+void NegativeTileCache::setMaximumBackoff(int secs)
+{
+    QMutexLocker lock(&_mutex);
+    _maximumBackoff = qMax(0, secs);
+}
+
+int NegativeTileCache::count() const
+{
+    QMutexLocker lock(&_mutex);
+    return _failures.size();
+}
+
+//private
+void NegativeTileCache::prune(qint64 now)
+{
+    QHash<TileKey, Failure>::iterator iter = _failures.begin();
+    while (iter != _failures.end())
+    {
+        if (iter.value().isStale(now))
+            iter = _failures.erase(iter);
+        else
+            iter++;
+    }
+}
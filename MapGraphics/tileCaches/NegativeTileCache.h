@@ -0,0 +1,134 @@
+#ifndef NEGATIVETILECACHE_H
+#define NEGATIVETILECACHE_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QMutex>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief Remembers tiles that couldn't be retrieved so that they aren't requested again right away. Each
+ * failure is kept for a time-to-live that depends on why the tile failed: a tile the server doesn't have
+ * (e.g., open ocean) is left alone for a long time, while a server or network error is retried much
+ * sooner. With backoff enabled, each further failure of the same tile doubles the wait, up to a maximum,
+ * so that a flapping server isn't hammered. Retries of different tiles are spread out a little so that
+ * they don't all come due at once.
+ *
+ * A success forgets the failures of the tile. Thread-safe.
+ */
+class MAPGRAPHICSSHARED_EXPORT NegativeTileCache
+{
+public:
+    /**
+     * @brief Why a tile couldn't be retrieved
+     */
+    enum FailureClass
+    {
+        //The server says the tile doesn't exist (e.g., HTTP 404 or 410)
+        NotFound,
+        //The server couldn't serve the tile right now (e.g., HTTP 5xx or 429)
+        ServerError,
+        //The server couldn't be reached or the transfer failed
+        NetworkError,
+        //The tile arrived but couldn't be decoded
+        InvalidTile,
+        FailureClassCount
+    };
+
+public:
+    NegativeTileCache();
+
+    /**
+     * @brief Returns true if the tile failed recently enough that it shouldn't be requested yet. Sets
+     * retryAt (if non-null) to the time after which it may be requested again.
+     *
+     * @param key
+     * @param retryAt
+     * @return bool
+     */
+    bool isBlocked(const TileKey& key, QDateTime * retryAt = 0);
+
+    /**
+     * @brief Records that the tile failed, and blocks it for the time-to-live of the failure class (times
+     * the backoff, if enabled).
+     *
+     * @param key
+     * @param failure
+     */
+    void recordFailure(const TileKey& key, NegativeTileCache::FailureClass failure);
+
+    /**
+     * @brief Forgets the failures of a tile that has now been retrieved
+     *
+     * @param key
+     */
+    void recordSuccess(const TileKey& key);
+
+    /**
+     * @brief Forgets all failures, e.g., when the network comes back
+     */
+    void clear();
+
+    /**
+     * @brief Returns how long (in seconds) a tile is blocked after its first failure of the given class
+     *
+     * @param failure
+     * @return int
+     */
+    int timeToLive(NegativeTileCache::FailureClass failure) const;
+
+    void setTimeToLive(NegativeTileCache::FailureClass failure, int secs);
+
+    bool backoffEnabled() const;
+
+    /**
+     * @brief Enables or disables exponential backoff. Enabled by default.
+     *
+     * @param enabled
+     */
+    void setBackoffEnabled(bool enabled);
+
+    /**
+     * @brief Returns the longest (in seconds) a tile is blocked for with backoff
+     *
+     * @return int
+     */
+    int maximumBackoff() const;
+
+    void setMaximumBackoff(int secs);
+
+    /**
+     * @brief Returns the number of tiles currently remembered as failed
+     *
+     * @return int
+     */
+    int count() const;
+
+private:
+    struct Failure
+    {
+        Failure() : retryAt(0), delay(0), failures(0) {}
+
+        //msecs since epoch, and msecs
+        qint64 retryAt;
+        qint64 delay;
+        int failures;
+
+        //A failure is remembered for as long again as it blocked the tile, so that backoff applies if the
+        //retry fails too. Past that, we've waited long enough to start over.
+        inline bool isStale(qint64 now) const { return retryAt + delay < now; }
+    };
+
+    //Forgets stale failures. _mutex must be held.
+    void prune(qint64 now);
+
+    mutable QMutex _mutex;
+    QHash<TileKey, Failure> _failures;
+    int _timeToLive[FailureClassCount];
+    bool _backoffEnabled;
+    int _maximumBackoff;
+};
+
+#endif // NEGATIVETILECACHE_H
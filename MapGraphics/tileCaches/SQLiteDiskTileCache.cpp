@@ -0,0 +1,556 @@
+#include "SQLiteDiskTileCache.h"
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QRunnable>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStringBuilder>
+#include <QStringList>
+#include <QThreadStorage>
+#include <QVariant>
+#include <QtDebug>
+
+#include "guts/TileWorkerPool.h"
+
+const int SQLITE_SCHEMA_VERSION = 3;
+
+//How many tiles evictLeastRecentlyUsed() looks at per transaction
+const int EVICTION_BATCH_SIZE = 256;
+
+//Commit a batch once it has this many writes in it
+const int BATCH_SIZE = 64;
+
+//How long a connection waits for another one to finish writing before giving up
+const int BUSY_TIMEOUT_MS = 5000;
+
+//Numbers caches and threads so that connection names are never reused, not even at the same address
+static QAtomicInt nextCacheSerial(0);
+static QAtomicInt nextThreadSerial(0);
+
+/*
+ The connections a thread has opened, to any cache. QThreadStorage deletes it when the thread exits, and
+ it closes them. Connections of caches that are already gone were closed by the cache.
+*/
+class ThreadConnections
+{
+public:
+    ThreadConnections() : serial(nextThreadSerial.fetchAndAddOrdered(1))
+    {
+    }
+
+    ~ThreadConnections()
+    {
+        foreach(const QString& connection, connections)
+            QSqlDatabase::removeDatabase(connection);
+    }
+
+    const int serial;
+    QStringList connections;
+};
+static QThreadStorage<ThreadConnections *> threadConnections;
+
+class SQLiteDiskTileCache::BatchCommitTask : public QRunnable
+{
+public:
+    explicit BatchCommitTask(QSharedPointer<SQLiteDiskTileCache::CommitGuard> guard) :
+        _guard(guard)
+    {
+    }
+
+    //pure-virtual from QRunnable
+    virtual void run()
+    {
+        //A cache destructing waits for us if we've started, and commits the batch itself if we haven't
+        QMutexLocker lock(&_guard->mutex);
+        if (_guard->cache)
+            _guard->cache->flush();
+    }
+
+private:
+    QSharedPointer<SQLiteDiskTileCache::CommitGuard> _guard;
+};
+
+SQLiteDiskTileCache::SQLiteDiskTileCache(const QString &databaseFile, const QString &name, const QString &extension) :
+    _databaseFile(databaseFile), _name(name), _extension(extension), _schemaReady(false),
+    _commitGuard(new CommitGuard()), _commitScheduled(false)
+{
+    _commitGuard->cache = this;
+    _connectionPrefix = "MapGraphicsSQLiteCache-" % QString::number(nextCacheSerial.fetchAndAddOrdered(1)) % "-";
+
+    const QString directory = QFileInfo(_databaseFile).absolutePath();
+    if (!QDir().mkpath(directory))
+        qWarning() << "Failed to create cache directory" << directory;
+}
+
+SQLiteDiskTileCache::~SQLiteDiskTileCache()
+{
+    //A commit that hasn't started yet won't; we do it here instead
+    QMutexLocker guardLock(&_commitGuard->mutex);
+    _commitGuard->cache = 0;
+    guardLock.unlock();
+
+    this->flush();
+
+    //Close our connections in every thread that's still running
+    foreach(const QString& connection, QSqlDatabase::connectionNames())
+    {
+        if (connection.startsWith(_connectionPrefix))
+            QSqlDatabase::removeDatabase(connection);
+    }
+}
+
+bool SQLiteDiskTileCache::read(const TileKey &key, QByteArray *data, QDateTime *expireTime,
+                               QByteArray *etag, QByteArray *lastModified)
+{
+    //Writes that haven't been committed yet take precedence over what's in the database
+    PendingWrite pending;
+    QMutexLocker pendingLock(&_pendingMutex);
+    const bool havePending = this->findPending(key, &pending);
+    pendingLock.unlock();
+
+    if (havePending && pending.hasData)
+    {
+        if (data)
+            *data = pending.data;
+        if (expireTime)
+            *expireTime = pending.expireTime;
+        if (etag)
+            *etag = pending.etag;
+        if (lastModified)
+            *lastModified = pending.lastModified;
+        return true;
+    }
+
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return false;
+
+    QSqlQuery query(db);
+    query.prepare("SELECT data, expires, etag, last_modified FROM tiles WHERE key = ?");
+    query.addBindValue(qint64(key.packed()));
+    if (!query.exec() || !query.next())
+        return false;
+
+    //Don't write to the database for every read --- the access time goes out with the next batch
+    pendingLock.relock();
+    _accesses.insert(key, QDateTime::currentMSecsSinceEpoch());
+    pendingLock.unlock();
+
+    if (data)
+        *data = query.value(0).toByteArray();
+
+    if (expireTime)
+    {
+        if (havePending)
+            *expireTime = pending.expireTime;
+        else if (query.value(1).isNull())
+            *expireTime = QDateTime();
+        else
+            *expireTime = QDateTime::fromMSecsSinceEpoch(query.value(1).toLongLong()).toUTC();
+    }
+    if (etag)
+        *etag = query.value(2).toByteArray();
+    if (lastModified)
+        *lastModified = query.value(3).toByteArray();
+    return true;
+}
+
+void SQLiteDiskTileCache::write(const TileKey &key, const QByteArray &data, const QDateTime &expireTime,
+                                const QByteArray &etag, const QByteArray &lastModified)
+{
+    if (data.isEmpty())
+        return;
+
+    PendingWrite write;
+    write.data = data;
+    write.expireTime = expireTime;
+    write.etag = etag;
+    write.lastModified = lastModified;
+    write.hasData = true;
+    this->queueWrite(key, write);
+}
+
+bool SQLiteDiskTileCache::contains(const TileKey &key)
+{
+    PendingWrite pending;
+    QMutexLocker pendingLock(&_pendingMutex);
+    if (this->findPending(key, &pending) && pending.hasData)
+        return true;
+    pendingLock.unlock();
+
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return false;
+
+    QSqlQuery query(db);
+    query.prepare("SELECT 1 FROM tiles WHERE key = ?");
+    query.addBindValue(qint64(key.packed()));
+    return query.exec() && query.next();
+}
+
+void SQLiteDiskTileCache::remove(const TileKey &key)
+{
+    //Wait for any batch in progress so that it can't put the tile back after we delete it
+    QMutexLocker writeLock(&_writeMutex);
+
+    QMutexLocker pendingLock(&_pendingMutex);
+    _pending.remove(key);
+    pendingLock.unlock();
+
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return;
+
+    QSqlQuery query(db);
+    query.prepare("DELETE FROM tiles WHERE key = ?");
+    query.addBindValue(qint64(key.packed()));
+    if (!query.exec())
+        qWarning() << "Failed to remove" << key.toString() << "from" << _databaseFile << query.lastError().text();
+}
+
+QDateTime SQLiteDiskTileCache::expirationTime(const TileKey &key)
+{
+    PendingWrite pending;
+    QMutexLocker pendingLock(&_pendingMutex);
+    if (this->findPending(key, &pending))
+        return pending.expireTime;
+    pendingLock.unlock();
+
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return QDateTime();
+
+    QSqlQuery query(db);
+    query.prepare("SELECT expires FROM tiles WHERE key = ?");
+    query.addBindValue(qint64(key.packed()));
+    if (!query.exec() || !query.next() || query.value(0).isNull())
+        return QDateTime();
+
+    return QDateTime::fromMSecsSinceEpoch(query.value(0).toLongLong()).toUTC();
+}
+
+void SQLiteDiskTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    PendingWrite write;
+    write.expireTime = expireTime;
+    this->queueWrite(key, write);
+}
+
+void SQLiteDiskTileCache::flush()
+{
+    QMutexLocker writeLock(&_writeMutex);
+
+    //Take the current batch. Readers keep seeing it in _committing until it's in the database.
+    QMutexLocker pendingLock(&_pendingMutex);
+    if (_pending.isEmpty() && _accesses.isEmpty())
+        return;
+    _committing.swap(_pending);
+    QHash<TileKey, qint64> accesses;
+    accesses.swap(_accesses);
+    _commitScheduled = false;
+    pendingLock.unlock();
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    QSqlDatabase db = this->database();
+    if (db.isOpen() && db.transaction())
+    {
+        QSqlQuery insert(db);
+        insert.prepare("INSERT OR REPLACE INTO tiles (key, expires, last_access, size, data, etag, last_modified) "
+                       "VALUES (?, ?, ?, ?, ?, ?, ?)");
+        QSqlQuery update(db);
+        update.prepare("UPDATE tiles SET expires = ? WHERE key = ?");
+
+        QHash<TileKey, PendingWrite>::const_iterator iter;
+        for (iter = _committing.constBegin(); iter != _committing.constEnd(); iter++)
+        {
+            const PendingWrite& write = iter.value();
+            const QVariant expires = write.expireTime.isNull() ? QVariant(QVariant::LongLong)
+                                                               : QVariant(write.expireTime.toMSecsSinceEpoch());
+            if (write.hasData)
+            {
+                insert.addBindValue(qint64(iter.key().packed()));
+                insert.addBindValue(expires);
+                insert.addBindValue(now);
+                insert.addBindValue(write.data.size());
+                insert.addBindValue(write.data);
+                insert.addBindValue(write.etag.isEmpty() ? QVariant(QVariant::ByteArray) : QVariant(write.etag));
+                insert.addBindValue(write.lastModified.isEmpty() ? QVariant(QVariant::ByteArray)
+                                                                 : QVariant(write.lastModified));
+                if (!insert.exec())
+                    qWarning() << "Failed to put" << iter.key().toString() << "into" << _databaseFile << insert.lastError().text();
+            }
+            else
+            {
+                update.addBindValue(expires);
+                update.addBindValue(qint64(iter.key().packed()));
+                update.exec();
+            }
+        }
+
+        QSqlQuery touch(db);
+        touch.prepare("UPDATE tiles SET last_access = ? WHERE key = ?");
+        QHash<TileKey, qint64>::const_iterator accessIter;
+        for (accessIter = accesses.constBegin(); accessIter != accesses.constEnd(); accessIter++)
+        {
+            touch.addBindValue(accessIter.value());
+            touch.addBindValue(qint64(accessIter.key().packed()));
+            touch.exec();
+        }
+
+        if (!db.commit())
+            qWarning() << "Failed to commit tiles to" << _databaseFile << db.lastError().text();
+    }
+    else
+        qWarning() << "Dropping" << _committing.size() << "tile writes to" << _databaseFile;
+
+    pendingLock.relock();
+    _committing.clear();
+}
+
+quint64 SQLiteDiskTileCache::bytesUsed()
+{
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return 0;
+
+    QSqlQuery query(db);
+    if (!query.exec("SELECT COALESCE(SUM(size), 0) FROM tiles") || !query.next())
+        return 0;
+    return query.value(0).toULongLong();
+}
+
+quint64 SQLiteDiskTileCache::removeExpired(const QDateTime &now)
+{
+    //Keep batches from being committed while we delete so that we know what we freed
+    QMutexLocker writeLock(&_writeMutex);
+
+    QSqlDatabase db = this->database();
+    if (!db.isOpen() || !db.transaction())
+        return 0;
+
+    const qint64 nowMSecs = now.toMSecsSinceEpoch();
+    quint64 freed = 0;
+
+    QSqlQuery query(db);
+    query.prepare("SELECT COALESCE(SUM(size), 0) FROM tiles WHERE expires < ?");
+    query.addBindValue(nowMSecs);
+    if (query.exec() && query.next())
+        freed = query.value(0).toULongLong();
+
+    query.prepare("DELETE FROM tiles WHERE expires < ?");
+    query.addBindValue(nowMSecs);
+    if (!query.exec() || !db.commit())
+    {
+        qWarning() << "Failed to remove expired tiles from" << _databaseFile << query.lastError().text();
+        db.rollback();
+        return 0;
+    }
+    return freed;
+}
+
+QDateTime SQLiteDiskTileCache::oldestAccessTime()
+{
+    QSqlDatabase db = this->database();
+    if (!db.isOpen())
+        return QDateTime();
+
+    //Tiles from before we tracked access times count as the oldest of all
+    QSqlQuery query(db);
+    if (!query.exec("SELECT MIN(COALESCE(last_access, 0)) FROM tiles") || !query.next() || query.value(0).isNull())
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(query.value(0).toLongLong()).toUTC();
+}
+
+quint64 SQLiteDiskTileCache::evictLeastRecentlyUsed(quint64 bytes)
+{
+    quint64 freed = 0;
+    while (freed < bytes)
+    {
+        //Work in small transactions so that the writer isn't kept waiting long
+        QMutexLocker writeLock(&_writeMutex);
+
+        QSqlDatabase db = this->database();
+        if (!db.isOpen() || !db.transaction())
+            break;
+
+        QSqlQuery select(db);
+        select.prepare("SELECT key, size FROM tiles ORDER BY last_access LIMIT ?");
+        select.addBindValue(EVICTION_BATCH_SIZE);
+        if (!select.exec())
+        {
+            db.rollback();
+            break;
+        }
+
+        QSqlQuery remove(db);
+        remove.prepare("DELETE FROM tiles WHERE key = ?");
+        int removed = 0;
+        while (freed < bytes && select.next())
+        {
+            remove.addBindValue(select.value(0));
+            if (!remove.exec())
+                continue;
+            freed += select.value(1).toULongLong();
+            removed++;
+        }
+        select.finish();
+
+        if (!db.commit())
+        {
+            qWarning() << "Failed to evict tiles from" << _databaseFile << db.lastError().text();
+            db.rollback();
+            break;
+        }
+
+        //Nothing left to evict
+        if (removed == 0)
+            break;
+    }
+    return freed;
+}
+
+//static
+bool SQLiteDiskTileCache::isAvailable()
+{
+    return QSqlDatabase::isDriverAvailable("QSQLITE");
+}
+
+//private
+QSqlDatabase SQLiteDiskTileCache::database()
+{
+    if (!threadConnections.hasLocalData())
+        threadConnections.setLocalData(new ThreadConnections());
+    ThreadConnections * local = threadConnections.localData();
+
+    const QString connection = _connectionPrefix % QString::number(local->serial);
+    if (QSqlDatabase::contains(connection))
+        return QSqlDatabase::database(connection, false);
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", connection);
+    db.setDatabaseName(_databaseFile);
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=" % QString::number(BUSY_TIMEOUT_MS));
+    local->connections.append(connection);
+
+    if (!db.open())
+    {
+        qWarning() << "Failed to open tile cache database" << _databaseFile << db.lastError().text();
+        return db;
+    }
+
+    //WAL lets the other threads' connections keep reading while a batch is being committed
+    QSqlQuery pragma(db);
+    pragma.exec("PRAGMA journal_mode=WAL");
+    pragma.exec("PRAGMA synchronous=NORMAL");
+
+    QMutexLocker schemaLock(&_schemaMutex);
+    if (!_schemaReady)
+        _schemaReady = this->createSchema(db);
+
+    return db;
+}
+
+//private
+bool SQLiteDiskTileCache::createSchema(QSqlDatabase &db)
+{
+    QSqlQuery query(db);
+    if (!query.exec("CREATE TABLE IF NOT EXISTS tiles ("
+                    "key INTEGER PRIMARY KEY, "
+                    "expires INTEGER, "
+                    "last_access INTEGER, "
+                    "size INTEGER NOT NULL, "
+                    "data BLOB NOT NULL, "
+                    "etag BLOB, "
+                    "last_modified BLOB)"))
+    {
+        qWarning() << "Failed to create tiles table in" << _databaseFile << query.lastError().text();
+        return false;
+    }
+
+    //Version 1 databases didn't track access times, and versions before 3 didn't keep HTTP validators
+    QHash<QString, QString> addedColumns;
+    addedColumns.insert("last_access", "INTEGER");
+    addedColumns.insert("etag", "BLOB");
+    addedColumns.insert("last_modified", "BLOB");
+    query.exec("PRAGMA table_info(tiles)");
+    while (query.next())
+        addedColumns.remove(query.value(1).toString());
+
+    QHash<QString, QString>::const_iterator column;
+    for (column = addedColumns.constBegin(); column != addedColumns.constEnd(); column++)
+    {
+        if (!query.exec("ALTER TABLE tiles ADD COLUMN " % column.key() % " " % column.value()))
+        {
+            qWarning() << "Failed to upgrade tiles table in" << _databaseFile << query.lastError().text();
+            return false;
+        }
+    }
+
+    //For the janitor
+    query.exec("CREATE INDEX IF NOT EXISTS tiles_last_access ON tiles (last_access)");
+    query.exec("CREATE INDEX IF NOT EXISTS tiles_expires ON tiles (expires)");
+
+    if (!query.exec("CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT)"))
+    {
+        qWarning() << "Failed to create metadata table in" << _databaseFile << query.lastError().text();
+        return false;
+    }
+
+    QHash<QString, QString> metadata;
+    metadata.insert("name", _name);
+    metadata.insert("format", _extension);
+    metadata.insert("schema", QString::number(SQLITE_SCHEMA_VERSION));
+
+    query.prepare("INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)");
+    QHash<QString, QString>::const_iterator iter;
+    for (iter = metadata.constBegin(); iter != metadata.constEnd(); iter++)
+    {
+        query.addBindValue(iter.key());
+        query.addBindValue(iter.value());
+        query.exec();
+    }
+
+    return true;
+}
+
+//private
+bool SQLiteDiskTileCache::findPending(const TileKey &key, SQLiteDiskTileCache::PendingWrite *write) const
+{
+    if (_pending.contains(key))
+    {
+        *write = _pending.value(key);
+        return true;
+    }
+    else if (_committing.contains(key))
+    {
+        *write = _committing.value(key);
+        return true;
+    }
+    return false;
+}
+
+//private
+void SQLiteDiskTileCache::queueWrite(const TileKey &key, const SQLiteDiskTileCache::PendingWrite &write)
+{
+    QMutexLocker lock(&_pendingMutex);
+
+    //An expiration-only update of a tile that's still waiting to be written just changes its expiration
+    PendingWrite merged = write;
+    if (!write.hasData && _pending.contains(key))
+    {
+        merged = _pending.value(key);
+        merged.expireTime = write.expireTime;
+    }
+    _pending.insert(key, merged);
+
+    //Whoever is writing (normally a tile source) shouldn't wait on the disk. Smaller batches wait for flush().
+    if (_pending.size() < BATCH_SIZE || _commitScheduled)
+        return;
+    _commitScheduled = true;
+    lock.unlock();
+
+    TileWorkerPool::pool()->start(new BatchCommitTask(_commitGuard));
+}
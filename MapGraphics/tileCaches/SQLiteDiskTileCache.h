@@ -0,0 +1,125 @@
+#ifndef SQLITEDISKTILECACHE_H
+#define SQLITEDISKTILECACHE_H
+
+#include "DiskTileCache.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QSqlDatabase>
+#include <QString>
+
+/**
+ * @brief DiskTileCache that keeps every tile, expiration and a little metadata about the source in a
+ * single SQLite database file. The database runs in WAL mode so that readers don't block the writer,
+ * and writes are buffered and committed in batches: on the TileWorkerPool once a batch is big enough, and
+ * otherwise whenever flush() is called (MapTileSource does so every couple of seconds). The time each tile
+ * was last read is batched up the same way and kept in the database for least-recently-used eviction. The
+ * HTTP validators of each tile are kept alongside it.
+ *
+ * QSqlDatabase connections can only be used from the thread that created them, so each thread that
+ * touches the cache gets its own connection to the same file. It's closed when the thread exits.
+ */
+class MAPGRAPHICSSHARED_EXPORT SQLiteDiskTileCache : public DiskTileCache
+{
+public:
+    SQLiteDiskTileCache(const QString& databaseFile, const QString& name, const QString& extension);
+    virtual ~SQLiteDiskTileCache();
+
+    //pure-virtual from DiskTileCache
+    virtual bool read(const TileKey& key, QByteArray * data, QDateTime * expireTime,
+                      QByteArray * etag, QByteArray * lastModified);
+
+    //pure-virtual from DiskTileCache
+    virtual void write(const TileKey& key, const QByteArray& data, const QDateTime& expireTime,
+                       const QByteArray& etag, const QByteArray& lastModified);
+
+    //pure-virtual from DiskTileCache
+    virtual bool contains(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual void remove(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //pure-virtual from DiskTileCache
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    //pure-virtual from DiskTileCache
+    virtual void flush();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 bytesUsed();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 removeExpired(const QDateTime& now);
+
+    //pure-virtual from DiskTileCache
+    virtual QDateTime oldestAccessTime();
+
+    //pure-virtual from DiskTileCache
+    virtual quint64 evictLeastRecentlyUsed(quint64 bytes);
+
+    /**
+     * @brief Returns true if the Qt SQLite driver needed by this class is available
+     *
+     * @return bool
+     */
+    static bool isAvailable();
+
+private:
+    struct PendingWrite
+    {
+        PendingWrite() : hasData(false) {}
+
+        QByteArray data;
+        QDateTime expireTime;
+        QByteArray etag;
+        QByteArray lastModified;
+        bool hasData;
+    };
+
+    //Returns the calling thread's connection to the database, opening it if necessary
+    QSqlDatabase database();
+
+    //Creates the tables if they don't exist yet
+    bool createSchema(QSqlDatabase& db);
+
+    //Looks for key in the writes that haven't been committed yet. _pendingMutex must be held.
+    bool findPending(const TileKey& key, PendingWrite * write) const;
+
+    //Adds a write to the batch and has the batch committed on the worker pool if it's big enough
+    void queueWrite(const TileKey& key, const PendingWrite& write);
+
+    //Commits the batch on the worker pool, unless the cache is gone by then
+    class BatchCommitTask;
+    struct CommitGuard
+    {
+        QMutex mutex;
+        SQLiteDiskTileCache * cache;
+    };
+
+    QString _databaseFile;
+    QString _name;
+    QString _extension;
+    QString _connectionPrefix;
+
+    QMutex _schemaMutex;
+    bool _schemaReady;
+    QSharedPointer<CommitGuard> _commitGuard;
+
+    //Writes waiting for the next batch, and the batch that is being committed right now
+    mutable QMutex _pendingMutex;
+    QHash<TileKey, PendingWrite> _pending;
+    QHash<TileKey, PendingWrite> _committing;
+    bool _commitScheduled;
+
+    //When tiles were last read (msecs since epoch), waiting for the next batch
+    QHash<TileKey, qint64> _accesses;
+
+    //Serializes batch commits
+    QMutex _writeMutex;
+};
+
+#endif // SQLITEDISKTILECACHE_H
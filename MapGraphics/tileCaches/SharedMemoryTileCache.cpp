@@ -0,0 +1,436 @@
+#include "SharedMemoryTileCache.h"
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QFileInfo>
+#include <QThread>
+#include <QtDebug>
+
+#include <cstring>
+
+const quint32 SharedMemoryTileCache::DEFAULT_SLOT_COUNT;
+const quint32 SharedMemoryTileCache::DEFAULT_SLOT_SIZE;
+const quint32 SharedMemoryTileCache::WAYS;
+
+const quint32 ARENA_MAGIC = 0x4D475341; // "MGSA"
+const quint32 ARENA_VERSION = 2;
+
+//Values of ArenaHeader::state
+const int ARENA_UNINITIALIZED = 0;
+const int ARENA_INITIALIZING = 1;
+const int ARENA_READY = 2;
+
+//How many times a reader retries a slot that changed underneath it
+const int READ_RETRIES = 3;
+
+//How long we wait for another process to finish setting up the arena
+const int INITIALIZATION_WAIT_MS = 1000;
+
+//QBasicAtomicInt only has load() and store() from Qt 5 on. Qt 4's fetch-and-store/add do the same job.
+static int atomicLoadRelaxed(QBasicAtomicInt& value)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,0,0)
+    return value.load();
+#else
+    return value.fetchAndAddRelaxed(0);
+#endif
+}
+
+static int atomicLoadAcquire(QBasicAtomicInt& value)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,0,0)
+    return value.loadAcquire();
+#else
+    return value.fetchAndAddAcquire(0);
+#endif
+}
+
+static void atomicStoreRelaxed(QBasicAtomicInt& value, int newValue)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,0,0)
+    value.store(newValue);
+#else
+    value.fetchAndStoreRelaxed(newValue);
+#endif
+}
+
+static void atomicStoreRelease(QBasicAtomicInt& value, int newValue)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(5,0,0)
+    value.storeRelease(newValue);
+#else
+    value.fetchAndStoreRelease(newValue);
+#endif
+}
+
+//QThread::msleep() is protected before Qt 5
+class ArenaWaiter : public QThread
+{
+public:
+    static void msleep(unsigned long msecs)
+    {
+        QThread::msleep(msecs);
+    }
+};
+
+/*
+  The file starts with an ArenaHeader, followed by slotCount slots of slotSize bytes each. A slot is a
+  SlotHeader followed by the encoded tile and then its validators (ETag, a newline, and Last-Modified). A
+  slot with size 0 is empty. New files are all zeros, which is an uninitialized header and empty slots.
+*/
+struct SharedMemoryTileCache::ArenaHeader
+{
+    quint32 magic;
+    quint32 version;
+    QBasicAtomicInt state;
+    quint32 slotCount;
+    quint32 slotSize;
+    QBasicAtomicInt clock;
+    quint8 padding[40];
+};
+
+struct SharedMemoryTileCache::SlotHeader
+{
+    QBasicAtomicInt sequence;
+    QBasicAtomicInt lastUse;
+    quint32 size;
+    quint32 validatorSize;
+    quint64 key;
+    qint64 expireMSecs;
+};
+
+SharedMemoryTileCache::SharedMemoryTileCache(const QString &arenaFile, quint32 slotCount, quint32 slotSize) :
+    _file(arenaFile),
+    _mapped(0),
+    _slotCount(qMax(WAYS, slotCount - slotCount % WAYS)),
+    _slotSize(qMax<quint32>(slotSize, sizeof(SlotHeader) + 1)),
+    _valid(false)
+{
+    //Keep the slots 8-byte aligned
+    _slotSize += (8 - _slotSize % 8) % 8;
+
+    _valid = this->open();
+}
+
+SharedMemoryTileCache::~SharedMemoryTileCache()
+{
+    if (_mapped != 0)
+        _file.unmap(_mapped);
+    _file.close();
+}
+
+bool SharedMemoryTileCache::isValid() const
+{
+    return _valid;
+}
+
+//pure-virtual from MapTileCacheTier
+int SharedMemoryTileCache::representations() const
+{
+    return MapTileCacheTier::Encoded;
+}
+
+//pure-virtual from MapTileCacheTier
+bool SharedMemoryTileCache::isSlow() const
+{
+    //It's only memory, even if it's someone else's
+    return false;
+}
+
+//virtual from MapTileCacheTier
+QString SharedMemoryTileCache::name() const
+{
+    return "shared memory";
+}
+
+//pure-virtual from MapTileCacheTier
+bool SharedMemoryTileCache::lookup(const TileKey &key, CachedTile *tile)
+{
+    if (!_valid)
+        return false;
+
+    QByteArray data;
+    QByteArray validators;
+    qint64 expireMSecs = 0;
+    const quint32 first = this->bucket(key);
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        if (!this->readSlot(i, key, tile ? &data : 0, tile ? &validators : 0, &expireMSecs))
+            continue;
+
+        //Readers only ever write the use stamp, which is advisory
+        atomicStoreRelaxed(this->slot(i)->lastUse, this->nextUse());
+
+        if (tile)
+        {
+            tile->image = QImage();
+            tile->encoded = data;
+            tile->expireTime = expireMSecs == 0 ? QDateTime()
+                                                : QDateTime::fromMSecsSinceEpoch(expireMSecs).toUTC();
+            const int newline = validators.indexOf('\n');
+            tile->etag = newline < 0 ? QByteArray() : validators.left(newline);
+            tile->lastModified = newline < 0 ? QByteArray() : validators.mid(newline + 1);
+        }
+        return true;
+    }
+    return false;
+}
+
+//pure-virtual from MapTileCacheTier
+void SharedMemoryTileCache::insert(const TileKey &key, const CachedTile &tile)
+{
+    const quint32 payload = _slotSize - sizeof(SlotHeader);
+    if (!_valid || tile.encoded.isEmpty() || quint32(tile.encoded.size()) > payload)
+        return;
+
+    //Pick a slot in the bucket: the tile's own if it's there, else an empty one, else the least recently used
+    const quint32 first = this->bucket(key);
+    quint32 victim = first;
+    int victimRank = 3;
+    int victimUse = 0;
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        SlotHeader * header = this->slot(i);
+        const int use = atomicLoadRelaxed(header->lastUse);
+        int rank = 2;
+        if (header->size != 0 && header->key == key.packed())
+            rank = 0;
+        else if (header->size == 0)
+            rank = 1;
+
+        //Use stamps wrap around, so compare them by difference
+        if (rank < victimRank || (rank == victimRank && rank == 2 && use - victimUse < 0))
+        {
+            victim = i;
+            victimRank = rank;
+            victimUse = use;
+        }
+    }
+
+    //The validators go after the tile if there's room. Without them the tile just can't be revalidated.
+    QByteArray validators;
+    if (!tile.etag.isEmpty() || !tile.lastModified.isEmpty())
+        validators = tile.etag + '\n' + tile.lastModified;
+    if (quint32(tile.encoded.size() + validators.size()) > payload)
+        validators.clear();
+
+    //Someone else is writing there. Inserting is best-effort, so just skip it.
+    if (!this->lockSlot(victim))
+        return;
+
+    SlotHeader * header = this->slot(victim);
+    uchar * data = reinterpret_cast<uchar *>(header) + sizeof(SlotHeader);
+    header->key = key.packed();
+    header->size = tile.encoded.size();
+    header->validatorSize = validators.size();
+    header->expireMSecs = tile.expireTime.isNull() ? 0 : tile.expireTime.toMSecsSinceEpoch();
+    memcpy(data, tile.encoded.constData(), tile.encoded.size());
+    memcpy(data + tile.encoded.size(), validators.constData(), validators.size());
+    atomicStoreRelaxed(header->lastUse, this->nextUse());
+
+    this->unlockSlot(victim);
+}
+
+//pure-virtual from MapTileCacheTier
+bool SharedMemoryTileCache::contains(const TileKey &key)
+{
+    if (!_valid)
+        return false;
+
+    qint64 expireMSecs = 0;
+    const quint32 first = this->bucket(key);
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        if (this->readSlot(i, key, 0, 0, &expireMSecs))
+            return true;
+    }
+    return false;
+}
+
+//pure-virtual from MapTileCacheTier
+void SharedMemoryTileCache::remove(const TileKey &key)
+{
+    if (!_valid)
+        return;
+
+    const quint32 first = this->bucket(key);
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        if (this->slot(i)->key != key.packed() || !this->lockSlot(i))
+            continue;
+
+        SlotHeader * header = this->slot(i);
+        if (header->key == key.packed())
+            header->size = 0;
+        this->unlockSlot(i);
+    }
+}
+
+//pure-virtual from MapTileCacheTier
+QDateTime SharedMemoryTileCache::expirationTime(const TileKey &key)
+{
+    if (!_valid)
+        return QDateTime();
+
+    qint64 expireMSecs = 0;
+    const quint32 first = this->bucket(key);
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        if (this->readSlot(i, key, 0, 0, &expireMSecs))
+            return expireMSecs == 0 ? QDateTime() : QDateTime::fromMSecsSinceEpoch(expireMSecs).toUTC();
+    }
+    return QDateTime();
+}
+
+//pure-virtual from MapTileCacheTier
+void SharedMemoryTileCache::setExpirationTime(const TileKey &key, const QDateTime &expireTime)
+{
+    if (!_valid)
+        return;
+
+    const quint32 first = this->bucket(key);
+    for (quint32 i = first; i < first + WAYS; i++)
+    {
+        if (this->slot(i)->key != key.packed() || !this->lockSlot(i))
+            continue;
+
+        SlotHeader * header = this->slot(i);
+        if (header->key == key.packed() && header->size != 0)
+            header->expireMSecs = expireTime.isNull() ? 0 : expireTime.toMSecsSinceEpoch();
+        this->unlockSlot(i);
+    }
+}
+
+//private
+bool SharedMemoryTileCache::open()
+{
+    const QString directory = QFileInfo(_file.fileName()).absolutePath();
+    if (!QDir().mkpath(directory) || !_file.open(QIODevice::ReadWrite))
+    {
+        qWarning() << "Failed to open shared tile arena" << _file.fileName() << _file.errorString();
+        return false;
+    }
+
+    //Every process sizes the file the same way, so it doesn't matter who does it first
+    const qint64 size = qint64(sizeof(ArenaHeader)) + qint64(_slotCount) * _slotSize;
+    if (_file.size() < size && !_file.resize(size))
+    {
+        qWarning() << "Failed to size shared tile arena" << _file.fileName() << _file.errorString();
+        return false;
+    }
+
+    _mapped = _file.map(0, size);
+    if (_mapped == 0)
+    {
+        qWarning() << "Failed to map shared tile arena" << _file.fileName() << _file.errorString();
+        return false;
+    }
+
+    //The first process to get here writes the geometry. Everyone else waits for it to finish.
+    ArenaHeader * header = reinterpret_cast<ArenaHeader *>(_mapped);
+    if (header->state.testAndSetAcquire(ARENA_UNINITIALIZED, ARENA_INITIALIZING))
+    {
+        header->magic = ARENA_MAGIC;
+        header->version = ARENA_VERSION;
+        header->slotCount = _slotCount;
+        header->slotSize = _slotSize;
+        atomicStoreRelease(header->state, ARENA_READY);
+    }
+    else
+    {
+        int waited = 0;
+        while (atomicLoadAcquire(header->state) != ARENA_READY && waited < INITIALIZATION_WAIT_MS)
+        {
+            ArenaWaiter::msleep(10);
+            waited += 10;
+        }
+    }
+
+    if (atomicLoadAcquire(header->state) != ARENA_READY
+            || header->magic != ARENA_MAGIC
+            || header->version != ARENA_VERSION
+            || header->slotCount != _slotCount
+            || header->slotSize != _slotSize)
+    {
+        qWarning() << "Shared tile arena" << _file.fileName() << "was set up differently. Not using it.";
+        return false;
+    }
+    return true;
+}
+
+//private
+SharedMemoryTileCache::SlotHeader *SharedMemoryTileCache::slot(quint32 index) const
+{
+    return reinterpret_cast<SlotHeader *>(_mapped + sizeof(ArenaHeader) + quint64(index) * _slotSize);
+}
+
+//private
+quint32 SharedMemoryTileCache::bucket(const TileKey &key) const
+{
+    //Fibonacci hashing spreads neighboring tiles over the whole arena. It must be the same in every process.
+    const quint64 hash = key.packed() * Q_UINT64_C(0x9E3779B97F4A7C15);
+    const quint32 buckets = _slotCount / WAYS;
+    return quint32((hash >> 32) % buckets) * WAYS;
+}
+
+//private
+bool SharedMemoryTileCache::readSlot(quint32 index, const TileKey &key, QByteArray *data, QByteArray *validators,
+                                     qint64 *expireMSecs) const
+{
+    const quint32 payload = _slotSize - sizeof(SlotHeader);
+    SlotHeader * header = this->slot(index);
+
+    for (int attempt = 0; attempt < READ_RETRIES; attempt++)
+    {
+        //Odd means a writer has it
+        const int before = atomicLoadAcquire(header->sequence);
+        if (before & 1)
+            return false;
+
+        const quint32 size = header->size;
+        const quint32 validatorSize = header->validatorSize;
+        if (size == 0 || size > payload || validatorSize > payload - size || header->key != key.packed())
+            return false;
+
+        *expireMSecs = header->expireMSecs;
+        const uchar * slotData = reinterpret_cast<const uchar *>(header) + sizeof(SlotHeader);
+        if (data)
+        {
+            data->resize(size);
+            memcpy(data->data(), slotData, size);
+        }
+        if (validators)
+        {
+            validators->resize(validatorSize);
+            memcpy(validators->data(), slotData + size, validatorSize);
+        }
+
+        //A full barrier so that the copy above can't be reordered after the check
+        if (header->sequence.fetchAndAddOrdered(0) == before)
+            return true;
+    }
+    return false;
+}
+
+//private
+bool SharedMemoryTileCache::lockSlot(quint32 index) const
+{
+    SlotHeader * header = this->slot(index);
+    const int sequence = atomicLoadAcquire(header->sequence);
+    if (sequence & 1)
+        return false;
+    return header->sequence.testAndSetAcquire(sequence, sequence + 1);
+}
+
+//private
+void SharedMemoryTileCache::unlockSlot(quint32 index) const
+{
+    this->slot(index)->sequence.fetchAndAddRelease(1);
+}
+
+//private
+int SharedMemoryTileCache::nextUse() const
+{
+    ArenaHeader * header = reinterpret_cast<ArenaHeader *>(_mapped);
+    return header->clock.fetchAndAddRelaxed(1);
+}
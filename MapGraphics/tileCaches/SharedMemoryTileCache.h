@@ -0,0 +1,111 @@
+#ifndef SHAREDMEMORYTILECACHE_H
+#define SHAREDMEMORYTILECACHE_H
+
+#include <QFile>
+#include <QString>
+
+#include "MapTileCacheTier.h"
+
+/**
+ * @brief MapTileCacheTier that keeps encoded tiles in a fixed-size arena file that is memory mapped by
+ * every process using it, so that co-located applications showing the same tiles find the ones a sibling
+ * already fetched.
+ *
+ * The arena is a set-associative table of fixed-size slots: a tile can only live in one of the few slots
+ * of the bucket its key hashes to, and evicts the least recently used tile there. Tiles bigger than a
+ * slot aren't cached. Every slot is guarded by a sequence lock, so readers never block or write anything
+ * but a use stamp: they copy the slot and retry if a writer got in the way. Writers take a slot by
+ * making its sequence number odd and skip the insert if another writer has it.
+ *
+ * If a process dies in the middle of writing a slot, that slot stays unusable until the arena file is
+ * deleted. The arena is never bigger than slotCount * slotSize plus a small header.
+ */
+class MAPGRAPHICSSHARED_EXPORT SharedMemoryTileCache : public MapTileCacheTier
+{
+public:
+    /**
+     * @brief Opens (creating if needed) the arena in the given file. Every process using the same file
+     * must use the same slotCount and slotSize --- if the file was set up differently, the cache stays
+     * empty.
+     *
+     * @param arenaFile
+     * @param slotCount
+     * @param slotSize
+     */
+    SharedMemoryTileCache(const QString& arenaFile,
+                          quint32 slotCount = SharedMemoryTileCache::DEFAULT_SLOT_COUNT,
+                          quint32 slotSize = SharedMemoryTileCache::DEFAULT_SLOT_SIZE);
+    virtual ~SharedMemoryTileCache();
+
+    /**
+     * @brief Returns false if the arena couldn't be set up, in which case the cache never has anything
+     *
+     * @return bool
+     */
+    bool isValid() const;
+
+    //pure-virtual from MapTileCacheTier
+    virtual int representations() const;
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool isSlow() const;
+
+    //virtual from MapTileCacheTier
+    virtual QString name() const;
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool lookup(const TileKey& key, CachedTile * tile);
+
+    //pure-virtual from MapTileCacheTier
+    virtual void insert(const TileKey& key, const CachedTile& tile);
+
+    //pure-virtual from MapTileCacheTier
+    virtual bool contains(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual void remove(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual QDateTime expirationTime(const TileKey& key);
+
+    //pure-virtual from MapTileCacheTier
+    virtual void setExpirationTime(const TileKey& key, const QDateTime& expireTime);
+
+    //1024 slots of 64 KiB: 64 MiB
+    static const quint32 DEFAULT_SLOT_COUNT = 1024;
+    static const quint32 DEFAULT_SLOT_SIZE = 64 * 1024;
+
+    //Slots per bucket
+    static const quint32 WAYS = 4;
+
+private:
+    struct ArenaHeader;
+    struct SlotHeader;
+
+    //Maps the arena and sets it up if we're the first
+    bool open();
+
+    SlotHeader * slot(quint32 index) const;
+
+    //Returns the index of the first slot of the bucket for key
+    quint32 bucket(const TileKey& key) const;
+
+    //Reads a slot with the sequence lock. Returns false if it doesn't hold key (or was being written).
+    bool readSlot(quint32 index, const TileKey& key, QByteArray * data, QByteArray * validators,
+                  qint64 * expireMSecs) const;
+
+    //Takes a slot's sequence lock for writing. Returns false if another writer has it.
+    bool lockSlot(quint32 index) const;
+    void unlockSlot(quint32 index) const;
+
+    //Returns a fresh stamp from the arena's use clock
+    int nextUse() const;
+
+    QFile _file;
+    uchar * _mapped;
+    quint32 _slotCount;
+    quint32 _slotSize;
+    bool _valid;
+};
+
+#endif // SHAREDMEMORYTILECACHE_H
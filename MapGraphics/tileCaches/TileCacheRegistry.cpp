@@ -0,0 +1,50 @@
+#include "TileCacheRegistry.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWeakPointer>
+
+static QMutex registryMutex;
+static QHash<QString, QWeakPointer<MapTileCacheTier> > registry;
+
+//Forgets tiers nobody uses any more. registryMutex must be held.
+static void pruneRegistry()
+{
+    QHash<QString, QWeakPointer<MapTileCacheTier> >::iterator iter = registry.begin();
+    while (iter != registry.end())
+    {
+        if (iter.value().isNull())
+            iter = registry.erase(iter);
+        else
+            iter++;
+    }
+}
+
+//static
+QSharedPointer<MapTileCacheTier> TileCacheRegistry::tier(const QString &key)
+{
+    QMutexLocker lock(&registryMutex);
+    return registry.value(key).toStrongRef();
+}
+
+//static
+QSharedPointer<MapTileCacheTier> TileCacheRegistry::addTier(const QString &key, QSharedPointer<MapTileCacheTier> tier)
+{
+    QMutexLocker lock(&registryMutex);
+    QSharedPointer<MapTileCacheTier> existing = registry.value(key).toStrongRef();
+    if (!existing.isNull())
+        return existing;
+
+    pruneRegistry();
+    registry.insert(key, tier.toWeakRef());
+    return tier;
+}
+
+//static
+int TileCacheRegistry::count()
+{
+    QMutexLocker lock(&registryMutex);
+    pruneRegistry();
+    return registry.size();
+}
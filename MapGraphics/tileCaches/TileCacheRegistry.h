@@ -0,0 +1,48 @@
+#ifndef TILECACHEREGISTRY_H
+#define TILECACHEREGISTRY_H
+
+#include <QSharedPointer>
+#include <QString>
+
+#include "MapGraphics_global.h"
+#include "MapTileCacheTier.h"
+
+/**
+ * @brief Process-wide table of the cache tiers in use, so that MapTileSources showing the same tiles
+ * (e.g., two views of the same OSM server) share one set of tiers instead of downloading, decoding and
+ * holding every tile once each. Tiers are registered under a key made up by whoever registers them and
+ * are held weakly: a tier is dropped from the table once the last source using it lets go.
+ *
+ * Thread-safe.
+ */
+class MAPGRAPHICSSHARED_EXPORT TileCacheRegistry
+{
+public:
+    /**
+     * @brief Returns the tier registered under key, or a null pointer if there isn't one (any more)
+     *
+     * @param key
+     * @return QSharedPointer<MapTileCacheTier>
+     */
+    static QSharedPointer<MapTileCacheTier> tier(const QString& key);
+
+    /**
+     * @brief Registers tier under key, unless another tier got there first. Returns whichever tier is
+     * registered under key afterwards, which is what the caller should use. The usual pattern is to call
+     * tier(), and if it returns null, create a tier and call addTier().
+     *
+     * @param key
+     * @param tier
+     * @return QSharedPointer<MapTileCacheTier>
+     */
+    static QSharedPointer<MapTileCacheTier> addTier(const QString& key, QSharedPointer<MapTileCacheTier> tier);
+
+    /**
+     * @brief Returns the number of tiers currently registered
+     *
+     * @return int
+     */
+    static int count();
+};
+
+#endif // TILECACHEREGISTRY_H
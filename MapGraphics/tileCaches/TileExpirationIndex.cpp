@@ -0,0 +1,381 @@
+#include "TileExpirationIndex.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QStringBuilder>
+#include <QtDebug>
+#if QT_VERSION >= QT_VERSION_CHECK(5,1,0)
+#include <QSaveFile>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+const quint32 INDEX_MAGIC = 0x4D474549; // "MGEI"
+const quint32 INDEX_VERSION = 1;
+
+//Compact once the journal has this many records, or a quarter as many as the index, whichever is more
+const quint64 MIN_COMPACTION_JOURNAL_RECORDS = 4096;
+
+TileExpirationIndex::TileExpirationIndex(const QString &directory, const QString &legacyFile) :
+    _legacyPath(legacyFile),
+    _opened(false),
+    _mapped(0),
+    _records(0),
+    _recordCount(0),
+    _journalCount(0),
+    _compactionRequested(false),
+    _legacyImported(false)
+{
+    _indexPath = directory % "/expirations.idx";
+    _journalPath = directory % "/expirations.journal";
+}
+
+TileExpirationIndex::~TileExpirationIndex()
+{
+    this->flush();
+
+    QMutexLocker lock(&_mutex);
+    this->unmapIndex();
+}
+
+QDateTime TileExpirationIndex::value(const TileKey &key)
+{
+    QMutexLocker lock(&_mutex);
+    this->open();
+
+    qint64 expireMSecs = 0;
+    if (_overlay.contains(key))
+        expireMSecs = _overlay.value(key);
+    else if (!this->findInIndex(key, &expireMSecs))
+        return QDateTime();
+
+    //0 marks a removed tile
+    if (expireMSecs == 0)
+        return QDateTime();
+    return QDateTime::fromMSecsSinceEpoch(expireMSecs).toUTC();
+}
+
+void TileExpirationIndex::insert(const TileKey &key, const QDateTime &expireTime)
+{
+    if (expireTime.isNull())
+    {
+        this->remove(key);
+        return;
+    }
+
+    Record record;
+    record.key = key.packed();
+    record.expireMSecs = expireTime.toMSecsSinceEpoch();
+
+    QMutexLocker lock(&_mutex);
+    this->open();
+    _overlay.insert(key, record.expireMSecs);
+    _unjournaled.append(record);
+}
+
+void TileExpirationIndex::remove(const TileKey &key)
+{
+    Record record;
+    record.key = key.packed();
+    record.expireMSecs = 0;
+
+    QMutexLocker lock(&_mutex);
+    this->open();
+    _overlay.insert(key, 0);
+    _unjournaled.append(record);
+}
+
+void TileExpirationIndex::flush()
+{
+    QMutexLocker flushLock(&_flushMutex);
+
+    //If nobody ever looked at the index there's nothing to do
+    QMutexLocker lock(&_mutex);
+    if (!_opened)
+        return;
+    QVector<Record> toAppend;
+    toAppend.swap(_unjournaled);
+    lock.unlock();
+
+    if (!toAppend.isEmpty())
+    {
+        QDir().mkpath(QFileInfo(_journalPath).absolutePath());
+        QFile journal(_journalPath);
+        const qint64 bytes = qint64(toAppend.size()) * sizeof(Record);
+        if (journal.open(QIODevice::WriteOnly | QIODevice::Append)
+                && journal.write(reinterpret_cast<const char *>(toAppend.constData()), bytes) == bytes)
+        {
+            lock.relock();
+            _journalCount += toAppend.size();
+            lock.unlock();
+        }
+        else
+        {
+            //Keep the changes around (they're still in the overlay) and try again next time
+            qWarning() << "Failed to append to expiration journal" << _journalPath << journal.errorString();
+            lock.relock();
+            _unjournaled = toAppend + _unjournaled;
+            lock.unlock();
+        }
+    }
+
+    lock.relock();
+    const bool due = _compactionRequested
+            || _journalCount >= qMax<quint64>(MIN_COMPACTION_JOURNAL_RECORDS, _recordCount / 4);
+    lock.unlock();
+
+    if (due)
+        this->compact();
+}
+
+//private
+void TileExpirationIndex::open()
+{
+    if (_opened)
+        return;
+
+    //If we try to do this and succeed or even fail, don't try again
+    _opened = true;
+
+    this->mapIndex();
+
+    //Replay the journal on top of the index
+    QFile journal(_journalPath);
+    if (journal.open(QIODevice::ReadOnly))
+    {
+        const QByteArray bytes = journal.readAll();
+        journal.close();
+
+        const int count = bytes.size() / int(sizeof(Record));
+        for (int i = 0; i < count; i++)
+        {
+            Record record;
+            memcpy(&record, bytes.constData() + i * sizeof(Record), sizeof(Record));
+            _overlay.insert(TileKey::fromPacked(record.key), record.expireMSecs);
+        }
+        _journalCount = count;
+
+        //Drop a record that was only half-written (e.g., we crashed) so later appends stay aligned
+        if (bytes.size() % sizeof(Record) != 0)
+            QFile::resize(_journalPath, qint64(count) * sizeof(Record));
+    }
+
+    if (_records == 0 && _journalCount == 0)
+        this->importLegacyFile();
+}
+
+//private
+bool TileExpirationIndex::findInIndex(const TileKey &key, qint64 *expireMSecs) const
+{
+    if (_records == 0)
+        return false;
+
+    const quint64 packed = key.packed();
+    quint64 low = 0;
+    quint64 high = _recordCount;
+    while (low < high)
+    {
+        const quint64 mid = low + (high - low) / 2;
+        const quint64 midKey = _records[mid].key;
+        if (midKey == packed)
+        {
+            *expireMSecs = _records[mid].expireMSecs;
+            return true;
+        }
+        else if (midKey < packed)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return false;
+}
+
+//private
+void TileExpirationIndex::importLegacyFile()
+{
+    if (_legacyPath.isEmpty())
+        return;
+
+    QFile fp(_legacyPath);
+    if (!fp.exists())
+        return;
+
+    if (!fp.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Failed to open cache expiration file for reading:" << fp.errorString();
+        return;
+    }
+
+    //The old format is keyed on the "x,y,z" string form
+    QHash<QString, QDateTime> stored;
+    QDataStream stream(&fp);
+    stream >> stored;
+
+    QHash<QString, QDateTime>::const_iterator iter;
+    for (iter = stored.constBegin(); iter != stored.constEnd(); iter++)
+    {
+        bool ok = false;
+        const TileKey key = TileKey::fromString(iter.key(), &ok);
+        if (ok && iter.value().isValid())
+            _overlay.insert(key, iter.value().toMSecsSinceEpoch());
+    }
+
+    //Get it all into an index at the next flush
+    _legacyImported = true;
+    _compactionRequested = true;
+    qDebug() << "Imported" << stored.size() << "cache expirations from" << _legacyPath;
+}
+
+//private
+void TileExpirationIndex::compact()
+{
+    //Only compaction changes the mapping, and we hold _flushMutex, so we may read the index unlocked
+    QMutexLocker lock(&_mutex);
+    const QHash<TileKey, qint64> snapshot = _overlay;
+    lock.unlock();
+
+    //Merge the sorted index with the (sorted) changes, dropping removed tiles
+    QVector<Record> changes;
+    changes.reserve(snapshot.size());
+    QHash<TileKey, qint64>::const_iterator iter;
+    for (iter = snapshot.constBegin(); iter != snapshot.constEnd(); iter++)
+    {
+        Record record;
+        record.key = iter.key().packed();
+        record.expireMSecs = iter.value();
+        changes.append(record);
+    }
+    std::sort(changes.begin(), changes.end());
+
+    QVector<Record> merged;
+    merged.reserve(int(_recordCount) + changes.size());
+    quint64 i = 0;
+    int j = 0;
+    while (i < _recordCount || j < changes.size())
+    {
+        Record record;
+        if (j >= changes.size() || (i < _recordCount && _records[i].key < changes[j].key))
+            record = _records[i++];
+        else
+        {
+            //A change replaces the index record with the same key
+            if (i < _recordCount && _records[i].key == changes[j].key)
+                i++;
+            record = changes[j++];
+        }
+
+        if (record.expireMSecs != 0)
+            merged.append(record);
+    }
+
+    Header header;
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.count = merged.size();
+
+    QDir().mkpath(QFileInfo(_indexPath).absolutePath());
+#if QT_VERSION >= QT_VERSION_CHECK(5,1,0)
+    QSaveFile fp(_indexPath);
+#else
+    QFile fp(_indexPath % ".new");
+#endif
+    if (!fp.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qWarning() << "Failed to open expiration index for writing:" << fp.errorString();
+        return;
+    }
+    fp.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+    fp.write(reinterpret_cast<const char *>(merged.constData()), qint64(merged.size()) * sizeof(Record));
+
+    //Swap the new index in. We have to let go of the old mapping first for the sake of Windows.
+    lock.relock();
+    this->unmapIndex();
+#if QT_VERSION >= QT_VERSION_CHECK(5,1,0)
+    const bool committed = fp.commit();
+#else
+    fp.close();
+    QFile::remove(_indexPath);
+    const bool committed = (fp.error() == QFile::NoError) && QFile::rename(fp.fileName(), _indexPath);
+#endif
+    this->mapIndex();
+
+    if (!committed)
+    {
+        qWarning() << "Failed to write expiration index" << _indexPath;
+        return;
+    }
+
+    //Everything in the journal is in the new index now
+    QFile::resize(_journalPath, 0);
+    _journalCount = 0;
+    _compactionRequested = false;
+
+    //Changes made while we were merging stay in the overlay
+    for (iter = snapshot.constBegin(); iter != snapshot.constEnd(); iter++)
+    {
+        if (_overlay.value(iter.key(), -1) == iter.value())
+            _overlay.remove(iter.key());
+    }
+
+    if (_legacyImported)
+    {
+        QFile::remove(_legacyPath);
+        _legacyImported = false;
+    }
+}
+
+//private
+void TileExpirationIndex::mapIndex()
+{
+    this->unmapIndex();
+
+    _indexFile.setFileName(_indexPath);
+    if (!_indexFile.open(QIODevice::ReadOnly))
+        return;
+
+    const qint64 size = _indexFile.size();
+    if (size < qint64(sizeof(Header)))
+    {
+        _indexFile.close();
+        return;
+    }
+
+    uchar * mapped = _indexFile.map(0, size);
+    if (mapped == 0)
+    {
+        qWarning() << "Failed to map expiration index" << _indexPath << _indexFile.errorString();
+        _indexFile.close();
+        return;
+    }
+
+    Header header;
+    memcpy(&header, mapped, sizeof(Header));
+    if (header.magic != INDEX_MAGIC
+            || header.version != INDEX_VERSION
+            || sizeof(Header) + header.count * sizeof(Record) > quint64(size))
+    {
+        qWarning() << "Ignoring bad expiration index" << _indexPath;
+        _indexFile.unmap(mapped);
+        _indexFile.close();
+        return;
+    }
+
+    _mapped = mapped;
+    _records = reinterpret_cast<const Record *>(mapped + sizeof(Header));
+    _recordCount = header.count;
+}
+
+//private
+void TileExpirationIndex::unmapIndex()
+{
+    if (_mapped != 0)
+        _indexFile.unmap(_mapped);
+    if (_indexFile.isOpen())
+        _indexFile.close();
+    _mapped = 0;
+    _records = 0;
+    _recordCount = 0;
+}
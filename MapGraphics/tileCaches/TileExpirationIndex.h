@@ -0,0 +1,116 @@
+#ifndef TILEEXPIRATIONINDEX_H
+#define TILEEXPIRATIONINDEX_H
+
+#include <QDateTime>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief Persistent table of tile expiration times, made of two files:
+ *
+ * - a compacted index: a small header followed by (key, expiration) records sorted by key. It is memory
+ *   mapped and binary searched, so opening it costs the same no matter how many tiles it holds.
+ * - an append-only journal of the changes made since the index was last compacted.
+ *
+ * Nothing is read until the first lookup or change. Changes are kept in memory until flush() appends them
+ * to the journal, and once the journal is big enough flush() also folds it into a new index. flush() is
+ * meant to be called periodically from a background thread; lookups and changes never touch the disk
+ * except for opening the files the first time.
+ */
+class MAPGRAPHICSSHARED_EXPORT TileExpirationIndex
+{
+public:
+    /**
+     * @brief Creates an index stored in the given directory. legacyFile is the old whole-table
+     * expiration file (QDataStream of QHash<QString,QDateTime>), which is imported if there is no index yet.
+     *
+     * @param directory
+     * @param legacyFile
+     */
+    TileExpirationIndex(const QString& directory, const QString& legacyFile = QString());
+    ~TileExpirationIndex();
+
+    /**
+     * @brief Returns when the tile expires, or a null QDateTime if we don't know
+     *
+     * @param key
+     * @return QDateTime
+     */
+    QDateTime value(const TileKey& key);
+
+    void insert(const TileKey& key, const QDateTime& expireTime);
+
+    void remove(const TileKey& key);
+
+    /**
+     * @brief Appends the changes made since the last flush to the journal, and compacts the journal into
+     * the index if it has grown big enough. Thread-safe, but may take a while --- call it off the hot path.
+     */
+    void flush();
+
+private:
+    struct Record
+    {
+        quint64 key;
+        qint64 expireMSecs;
+
+        bool operator<(const Record& other) const { return key < other.key; }
+    };
+
+    struct Header
+    {
+        quint32 magic;
+        quint32 version;
+        quint64 count;
+    };
+
+    //Maps the index and replays the journal the first time we need them. _mutex must be held.
+    void open();
+
+    //Binary searches the memory-mapped index. _mutex must be held.
+    bool findInIndex(const TileKey& key, qint64 * expireMSecs) const;
+
+    //Reads the old QDataStream expiration table into _overlay. _mutex must be held.
+    void importLegacyFile();
+
+    //Merges the index with the changes in the overlay and writes a new index. _flushMutex must be held.
+    void compact();
+
+    //Maps the index file, or forgets the current mapping if it can't. _mutex must be held.
+    void mapIndex();
+
+    //Forgets the current mapping of the index. _mutex must be held.
+    void unmapIndex();
+
+    QString _indexPath;
+    QString _journalPath;
+    QString _legacyPath;
+
+    //Protects everything below
+    QMutex _mutex;
+    bool _opened;
+    QFile _indexFile;
+    uchar * _mapped;
+    const Record * _records;
+    quint64 _recordCount;
+
+    //Changes since the index was compacted (0 means removed). Checked before the index.
+    QHash<TileKey, qint64> _overlay;
+
+    //Changes that haven't been appended to the journal yet
+    QVector<Record> _unjournaled;
+    quint64 _journalCount;
+    bool _compactionRequested;
+    bool _legacyImported;
+
+    //Serializes flush() and compaction. Always taken before _mutex.
+    QMutex _flushMutex;
+};
+
+#endif // TILEEXPIRATIONINDEX_H
@@ -0,0 +1,189 @@
+#include "TilePack.h"
+
+#include <QtEndian>
+#include <QtDebug>
+
+#include <cstring>
+
+const quint32 TilePack::VERSION;
+const int TilePack::HEADER_SIZE;
+const int TilePack::INDEX_ENTRY_SIZE;
+const int TilePack::BLOB_ALIGNMENT;
+
+const char PACK_MAGIC[4] = {'M', 'G', 'T', 'P'};
+
+//Spreads the low 29 bits of v out to the even bits of the result
+static quint64 spreadBits(quint32 v)
+{
+    quint64 toRet = v & 0x1FFFFFFF;
+    toRet = (toRet | (toRet << 16)) & Q_UINT64_C(0x0000FFFF0000FFFF);
+    toRet = (toRet | (toRet << 8)) & Q_UINT64_C(0x00FF00FF00FF00FF);
+    toRet = (toRet | (toRet << 4)) & Q_UINT64_C(0x0F0F0F0F0F0F0F0F);
+    toRet = (toRet | (toRet << 2)) & Q_UINT64_C(0x3333333333333333);
+    toRet = (toRet | (toRet << 1)) & Q_UINT64_C(0x5555555555555555);
+    return toRet;
+}
+
+TilePack::TilePack(const QString &packFile) :
+    _file(packFile), _mapped(0), _tileCount(0), _index(0), _blob(0), _blobSize(0), _minZoom(0), _maxZoom(0),
+    _tileSize(256)
+{
+    if (!_file.open(QFile::ReadOnly))
+    {
+        _errorString = _file.errorString();
+        return;
+    }
+
+    const qint64 fileSize = _file.size();
+    if (fileSize < HEADER_SIZE)
+    {
+        _errorString = "File is too small to be a tile pack";
+        return;
+    }
+
+    const uchar * mapped = _file.map(0, fileSize);
+    if (mapped == 0)
+    {
+        _errorString = _file.errorString();
+        return;
+    }
+
+    const quint32 version = qFromLittleEndian<quint32>(mapped + 4);
+    if (memcmp(mapped, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || version != VERSION)
+    {
+        _errorString = "Not a tile pack, or an unsupported version";
+        _file.unmap(const_cast<uchar *>(mapped));
+        return;
+    }
+
+    const quint32 tileCount = qFromLittleEndian<quint32>(mapped + 8);
+    const quint64 indexOffset = qFromLittleEndian<quint64>(mapped + 16);
+    const quint64 blobOffset = qFromLittleEndian<quint64>(mapped + 24);
+    const quint64 blobSize = qFromLittleEndian<quint64>(mapped + 32);
+
+    //Make sure the index and blob region are really there before we trust them. The header may be garbage,
+    //so nothing is added up where it could wrap around.
+    const quint64 size = quint64(fileSize);
+    if (indexOffset < quint64(HEADER_SIZE)
+            || indexOffset > size
+            || quint64(tileCount) > (size - indexOffset) / INDEX_ENTRY_SIZE
+            || blobOffset > size
+            || blobSize > size - blobOffset)
+    {
+        _errorString = "Tile pack is truncated";
+        _file.unmap(const_cast<uchar *>(mapped));
+        return;
+    }
+
+    _mapped = mapped;
+    _tileCount = tileCount;
+    _index = mapped + indexOffset;
+    _blob = mapped + blobOffset;
+    _blobSize = blobSize;
+    _minZoom = mapped[40];
+    _maxZoom = mapped[41];
+    _tileSize = qFromLittleEndian<quint16>(mapped + 42);
+    _format = QString::fromLatin1(reinterpret_cast<const char *>(mapped + 44),
+                                  qstrnlen(reinterpret_cast<const char *>(mapped + 44), 8));
+}
+
+TilePack::~TilePack()
+{
+    if (_mapped != 0)
+        _file.unmap(const_cast<uchar *>(_mapped));
+    _file.close();
+}
+
+bool TilePack::isValid() const
+{
+    return _mapped != 0;
+}
+
+QString TilePack::errorString() const
+{
+    return _errorString;
+}
+
+QString TilePack::fileName() const
+{
+    return _file.fileName();
+}
+
+quint32 TilePack::tileCount() const
+{
+    return _tileCount;
+}
+
+quint8 TilePack::minZoomLevel() const
+{
+    return _minZoom;
+}
+
+quint8 TilePack::maxZoomLevel() const
+{
+    return _maxZoom;
+}
+
+quint16 TilePack::tileSize() const
+{
+    return _tileSize;
+}
+
+QString TilePack::format() const
+{
+    return _format;
+}
+
+bool TilePack::contains(const TileKey &key) const
+{
+    return this->findEntry(key) != 0;
+}
+
+QByteArray TilePack::tile(const TileKey &key) const
+{
+    const uchar * entry = this->findEntry(key);
+    if (entry == 0)
+        return QByteArray();
+
+    const quint64 offset = quint64(qFromLittleEndian<quint32>(entry + 8)) * BLOB_ALIGNMENT;
+    const quint32 length = qFromLittleEndian<quint32>(entry + 12);
+    if (length > _blobSize || offset > _blobSize - length)
+    {
+        qWarning() << "Tile" << key.toString() << "runs past the end of" << _file.fileName();
+        return QByteArray();
+    }
+
+    //A copy, so that the bytes outlive the mapping no matter where they end up
+    return QByteArray(reinterpret_cast<const char *>(_blob + offset), length);
+}
+
+//static
+quint64 TilePack::zOrderKey(const TileKey &key)
+{
+    return (quint64(key.z()) << 58) | (spreadBits(key.x()) << 1) | spreadBits(key.y());
+}
+
+//private
+const uchar *TilePack::findEntry(const TileKey &key) const
+{
+    if (_mapped == 0 || _tileCount == 0)
+        return 0;
+
+    //Binary search of the sorted index, right in the mapping
+    const quint64 wanted = TilePack::zOrderKey(key);
+    quint32 low = 0;
+    quint32 high = _tileCount;
+    while (low < high)
+    {
+        const quint32 middle = low + (high - low) / 2;
+        const uchar * entry = _index + quint64(middle) * INDEX_ENTRY_SIZE;
+        const quint64 entryKey = qFromLittleEndian<quint64>(entry);
+        if (entryKey == wanted)
+            return entry;
+        else if (entryKey < wanted)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return 0;
+}
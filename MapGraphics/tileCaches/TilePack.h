@@ -0,0 +1,109 @@
+#ifndef TILEPACK_H
+#define TILEPACK_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief Read-only view of a tile pack: a single file holding a whole tile tree, meant for shipping
+ * basemaps to machines that will never be online. The file is memory-mapped, so finding and reading a
+ * tile is a binary search and a memcpy with no system calls.
+ *
+ * A pack is a header, then an index of every tile sorted by zOrderKey(), then the encoded tiles back to
+ * back. All integers are little-endian. Packs are built with TilePackBuilder.
+ *
+ *  Header (64 bytes):
+ *   0  magic "MGTP"           16 index offset (u64)     40 min zoom (u8)
+ *   4  version (u32)          24 blob offset (u64)      41 max zoom (u8)
+ *   8  tile count (u32)       32 blob size (u64)        42 tile size (u16)
+ *   12 reserved (u32)                                   44 format, NUL-padded (char[8])
+ *
+ *  Index entry (16 bytes): z-order key (u64), offset of the tile in the blob region (u32 * 8), length (u32)
+ *
+ * Thread-safe: nothing changes after the constructor.
+ */
+class MAPGRAPHICSSHARED_EXPORT TilePack
+{
+public:
+    static const quint32 VERSION = 1;
+    static const int HEADER_SIZE = 64;
+    static const int INDEX_ENTRY_SIZE = 16;
+
+    //Tiles start at multiples of this within the blob region, so their offsets fit in 32 bits
+    static const int BLOB_ALIGNMENT = 8;
+
+public:
+    /**
+     * @brief Opens and maps the pack. Check isValid() afterwards.
+     *
+     * @param packFile
+     */
+    explicit TilePack(const QString& packFile);
+    ~TilePack();
+
+    bool isValid() const;
+
+    /**
+     * @brief Returns why the pack couldn't be opened, if it couldn't
+     *
+     * @return QString
+     */
+    QString errorString() const;
+
+    QString fileName() const;
+
+    quint32 tileCount() const;
+    quint8 minZoomLevel() const;
+    quint8 maxZoomLevel() const;
+    quint16 tileSize() const;
+
+    /**
+     * @brief Returns the format (png, jpg, etc.) the tiles are encoded in
+     *
+     * @return QString
+     */
+    QString format() const;
+
+    bool contains(const TileKey& key) const;
+
+    /**
+     * @brief Returns a copy of the encoded tile, or an empty QByteArray if the pack doesn't have it
+     *
+     * @param key
+     * @return QByteArray
+     */
+    QByteArray tile(const TileKey& key) const;
+
+    /**
+     * @brief Returns the key tiles are sorted by in the index: the zoom level in the top six bits, then the
+     * bits of x and y interleaved. Tiles that are close on the map end up close in the index and blob
+     * region, so looking at one area touches few pages.
+     *
+     * @param key
+     * @return quint64
+     */
+    static quint64 zOrderKey(const TileKey& key);
+
+private:
+    //Returns the index entry of the tile, or 0
+    const uchar * findEntry(const TileKey& key) const;
+
+    QFile _file;
+    const uchar * _mapped;
+    QString _errorString;
+
+    quint32 _tileCount;
+    const uchar * _index;
+    const uchar * _blob;
+    quint64 _blobSize;
+    quint8 _minZoom;
+    quint8 _maxZoom;
+    quint16 _tileSize;
+    QString _format;
+};
+
+#endif // TILEPACK_H
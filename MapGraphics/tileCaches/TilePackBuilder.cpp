@@ -0,0 +1,144 @@
+#include "TilePackBuilder.h"
+
+#include <QtEndian>
+#include <QtDebug>
+
+#include <algorithm>
+#include <cstring>
+
+#include "TilePack.h"
+
+//Copying the blob region into the pack goes this many bytes at a time
+const qint64 COPY_CHUNK_SIZE = 1024 * 1024;
+
+TilePackBuilder::TilePackBuilder(const QString &packFile, const QString &format, quint16 tileSize) :
+    _packFile(packFile), _format(format.toLatin1().left(8)), _tileSize(tileSize),
+    _blobFile(packFile + ".blob"), _blobSize(0), _minZoom(0xFF), _maxZoom(0)
+{
+    if (!_blobFile.open(QFile::ReadWrite | QFile::Truncate))
+        _errorString = _blobFile.errorString();
+}
+
+TilePackBuilder::~TilePackBuilder()
+{
+    //Whether or not we finished, the blob is of no more use
+    _blobFile.close();
+    _blobFile.remove();
+}
+
+bool TilePackBuilder::addTile(const TileKey &key, const QByteArray &encoded)
+{
+    if (!_blobFile.isOpen() || encoded.isEmpty())
+        return false;
+
+    const quint64 zOrderKey = TilePack::zOrderKey(key);
+    if (_seen.contains(zOrderKey))
+        return false;
+
+    //Offsets are stored in units of the alignment so that they fit in 32 bits
+    const quint64 padding = (TilePack::BLOB_ALIGNMENT - _blobSize % TilePack::BLOB_ALIGNMENT) % TilePack::BLOB_ALIGNMENT;
+    const quint64 offset = _blobSize + padding;
+    if (offset / TilePack::BLOB_ALIGNMENT > 0xFFFFFFFFULL)
+    {
+        _errorString = "Tile pack is full";
+        return false;
+    }
+
+    if (padding > 0 && _blobFile.write(QByteArray(int(padding), '\0')) != qint64(padding))
+    {
+        _errorString = _blobFile.errorString();
+        return false;
+    }
+    if (_blobFile.write(encoded) != encoded.size())
+    {
+        _errorString = _blobFile.errorString();
+        return false;
+    }
+    _blobSize = offset + encoded.size();
+
+    Entry entry;
+    entry.zOrderKey = zOrderKey;
+    entry.offset = quint32(offset / TilePack::BLOB_ALIGNMENT);
+    entry.length = encoded.size();
+    _seen.insert(zOrderKey);
+    _entries.append(entry);
+
+    _minZoom = qMin(_minZoom, key.z());
+    _maxZoom = qMax(_maxZoom, key.z());
+    return true;
+}
+
+int TilePackBuilder::tileCount() const
+{
+    return _entries.size();
+}
+
+bool TilePackBuilder::finish()
+{
+    if (!_blobFile.isOpen())
+        return false;
+
+    QFile pack(_packFile);
+    if (!pack.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        _errorString = pack.errorString();
+        return false;
+    }
+
+    std::sort(_entries.begin(), _entries.end());
+    const quint64 indexOffset = TilePack::HEADER_SIZE;
+    quint64 blobOffset = indexOffset + quint64(_entries.size()) * TilePack::INDEX_ENTRY_SIZE;
+    blobOffset += (TilePack::BLOB_ALIGNMENT - blobOffset % TilePack::BLOB_ALIGNMENT) % TilePack::BLOB_ALIGNMENT;
+
+    QByteArray header(TilePack::HEADER_SIZE, '\0');
+    uchar * h = reinterpret_cast<uchar *>(header.data());
+    memcpy(h, "MGTP", 4);
+    qToLittleEndian<quint32>(TilePack::VERSION, h + 4);
+    qToLittleEndian<quint32>(_entries.size(), h + 8);
+    qToLittleEndian<quint64>(indexOffset, h + 16);
+    qToLittleEndian<quint64>(blobOffset, h + 24);
+    qToLittleEndian<quint64>(_blobSize, h + 32);
+    h[40] = _entries.isEmpty() ? 0 : _minZoom;
+    h[41] = _maxZoom;
+    qToLittleEndian<quint16>(_tileSize, h + 42);
+    memcpy(h + 44, _format.constData(), _format.size());
+
+    QByteArray index(int(blobOffset - indexOffset), '\0');
+    uchar * i = reinterpret_cast<uchar *>(index.data());
+    foreach(const Entry& entry, _entries)
+    {
+        qToLittleEndian<quint64>(entry.zOrderKey, i);
+        qToLittleEndian<quint32>(entry.offset, i + 8);
+        qToLittleEndian<quint32>(entry.length, i + 12);
+        i += TilePack::INDEX_ENTRY_SIZE;
+    }
+
+    bool ok = (pack.write(header) == header.size() && pack.write(index) == index.size());
+
+    //Then the tiles themselves
+    _blobFile.flush();
+    ok = ok && _blobFile.seek(0);
+    while (ok && !_blobFile.atEnd())
+    {
+        const QByteArray chunk = _blobFile.read(COPY_CHUNK_SIZE);
+        ok = !chunk.isEmpty() && pack.write(chunk) == chunk.size();
+    }
+
+    if (!ok)
+    {
+        _errorString = pack.error() != QFile::NoError ? pack.errorString() : _blobFile.errorString();
+        pack.close();
+        pack.remove();
+        return false;
+    }
+
+    pack.close();
+    _blobFile.close();
+    _blobFile.remove();
+    return true;
+}
+
+QString TilePackBuilder::errorString() const
+{
+    return _errorString;
+}
@@ -0,0 +1,76 @@
+#ifndef TILEPACKBUILDER_H
+#define TILEPACKBUILDER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include "MapGraphics_global.h"
+#include "TileKey.h"
+
+/**
+ * @brief Writes a tile pack (see TilePack). Tiles can be added in any order; their bytes go straight to a
+ * temporary file so that only the index is held in memory. finish() sorts the index and writes the pack.
+ */
+class MAPGRAPHICSSHARED_EXPORT TilePackBuilder
+{
+public:
+    /**
+     * @brief Starts a pack that will be written to packFile
+     *
+     * @param packFile
+     * @param format the format (png, jpg, etc.) the tiles are encoded in. At most 8 characters.
+     * @param tileSize
+     */
+    TilePackBuilder(const QString& packFile, const QString& format, quint16 tileSize = 256);
+    ~TilePackBuilder();
+
+    /**
+     * @brief Adds an encoded tile. Returns false if it couldn't be written, or if the tile was already
+     * added.
+     *
+     * @param key
+     * @param encoded
+     * @return bool
+     */
+    bool addTile(const TileKey& key, const QByteArray& encoded);
+
+    int tileCount() const;
+
+    /**
+     * @brief Writes the pack. Returns false (see errorString()) on failure, in which case no pack is left
+     * behind.
+     *
+     * @return bool
+     */
+    bool finish();
+
+    QString errorString() const;
+
+private:
+    struct Entry
+    {
+        quint64 zOrderKey;
+        quint32 offset;
+        quint32 length;
+
+        inline bool operator <(const Entry& other) const { return zOrderKey < other.zOrderKey; }
+    };
+
+    QString _packFile;
+    QByteArray _format;
+    quint16 _tileSize;
+
+    QFile _blobFile;
+    quint64 _blobSize;
+    QVector<Entry> _entries;
+    QSet<quint64> _seen;
+    quint8 _minZoom;
+    quint8 _maxZoom;
+
+    QString _errorString;
+};
+
+#endif // TILEPACKBUILDER_H
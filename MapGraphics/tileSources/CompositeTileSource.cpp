@@ -127,6 +127,102 @@ QString CompositeTileSource::tileFileExtension() const
     return "jpg";
 }
 
+MapTileMetrics CompositeTileSource::metrics() const
+{
+    MapTileMetrics toRet = MapTileSource::metrics();
+
+    QMutexLocker lock(_globalMutex);
+    foreach(QSharedPointer<MapTileSource> source, _childSources)
+        toRet.merge(source->metrics());
+    return toRet;
+}
+
+void CompositeTileSource::resetMetrics()
+{
+    MapTileSource::resetMetrics();
+
+    QMutexLocker lock(_globalMutex);
+    foreach(QSharedPointer<MapTileSource> source, _childSources)
+        source->resetMetrics();
+}
+
+void CompositeTileSource::setRequestFocus(const QPointF &centerQGS, quint8 zoomLevel)
+{
+    MapTileSource::setRequestFocus(centerQGS, zoomLevel);
+
+    //Our layers get our requests in order already, but may have a backlog of their own
+    QMutexLocker lock(_globalMutex);
+    foreach(QSharedPointer<MapTileSource> source, _childSources)
+        source->setRequestFocus(centerQGS, zoomLevel);
+}
+
+void CompositeTileSource::prefetchTile(quint32 x, quint32 y, quint8 z)
+{
+    //It's our layers that have caches to put the tile in. We report on it once they all have.
+    QMutexLocker lock(_globalMutex);
+    PendingPrefetch& pending = _pendingPrefetches[TileKey(x,y,z)];
+    for (int i = 0; i < _childSources.size(); i++)
+    {
+        if (!_childEnabledFlags.at(i) || pending.waitingOn.contains(_childSources.at(i).data()))
+            continue;
+        pending.waitingOn.insert(_childSources.at(i).data());
+        _childSources.at(i)->prefetchTile(x, y, z);
+    }
+
+    //Without any enabled layers there's nothing to wait for, but we still answer from our own thread
+    if (pending.waitingOn.isEmpty())
+        QMetaObject::invokeMethod(this, "finishPrefetches", Qt::QueuedConnection);
+}
+
+MapTile CompositeTileSource::peekCachedTile(quint32 x, quint32 y, quint8 z) const
+{
+    QMutexLocker lock(_globalMutex);
+
+    //Bottom layer first, like when we composite tiles for real
+    QList<MapTile> layers;
+    QList<qreal> opacities;
+    for (int i = _childSources.size() - 1; i >= 0; i--)
+    {
+        if (!_childEnabledFlags.at(i))
+            continue;
+        const MapTile peeked = _childSources.at(i)->peekCachedTile(x, y, z);
+        if (peeked.isNull())
+            continue;
+        layers.append(peeked);
+        opacities.append(_childSources.size() == 1 ? 1.0 : _childOpacities.at(i));
+    }
+    lock.unlock();
+
+    if (layers.isEmpty())
+        return MapTile();
+
+    //The composite expires when its first layer does
+    QDateTime expireTime;
+    foreach(const MapTile& layer, layers)
+    {
+        if (!layer.expireTime().isNull() && (expireTime.isNull() || layer.expireTime() < expireTime))
+            expireTime = layer.expireTime();
+    }
+
+    if (layers.size() == 1 && opacities.first() == 1.0)
+        return MapTile(TileKey(x,y,z), layers.first().image(), expireTime);
+
+    QImage toRet(this->tileSize(),
+                 this->tileSize(),
+                 QImage::Format_ARGB32_Premultiplied);
+    toRet.fill(Qt::transparent);
+    QPainter painter(&toRet);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    for (int i = 0; i < layers.size(); i++)
+    {
+        painter.setOpacity(opacities.at(i));
+        painter.drawImage(0,0,layers.at(i).image());
+    }
+    painter.end();
+
+    return MapTile(TileKey(x,y,z), toRet, expireTime);
+}
+
 void CompositeTileSource::addSourceTop(QSharedPointer<MapTileSource> source, qreal opacity)
 {
     QMutexLocker lock(_globalMutex);
@@ -140,10 +236,12 @@ void CompositeTileSource::addSourceTop(QSharedPointer<MapTileSource> source, qre
     _childOpacities.insert(0,opacity);
     _childEnabledFlags.insert(0,true);
 
+    //Tiles (and failures) come back a batch at a time
     connect(source.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
+            SIGNAL(tilesDelivered(QList<MapTile>)),
             this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+            SLOT(handleTilesDelivered(QList<MapTile>)));
+    this->connectChildPrefetches(source);
 
     this->sourceAdded(0);
     this->sourcesChanged();
@@ -163,10 +261,12 @@ void CompositeTileSource::addSourceBottom(QSharedPointer<MapTileSource> source,
     _childOpacities.append(opacity);
     _childEnabledFlags.append(true);
 
+    //Tiles (and failures) come back a batch at a time
     connect(source.data(),
-            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
+            SIGNAL(tilesDelivered(QList<MapTile>)),
             this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+            SLOT(handleTilesDelivered(QList<MapTile>)));
+    this->connectChildPrefetches(source);
 
     this->sourceAdded(_childSources.size()-1);
     this->sourcesChanged();
@@ -199,10 +299,26 @@ void CompositeTileSource::removeSource(int index)
     if (index < 0 || index >= _childSources.size())
         return;
 
+    //The prefetches it was working on won't be hearing from it
+    QObject * removed = _childSources.at(index).data();
+    disconnect(removed, 0, this, 0);
+    for (QHash<TileKey, PendingPrefetch>::iterator iter = _pendingPrefetches.begin(); iter != _pendingPrefetches.end(); ++iter)
+        iter.value().waitingOn.remove(removed);
+    QMetaObject::invokeMethod(this, "finishPrefetches", Qt::QueuedConnection);
+
     _childSources.removeAt(index);
     _childOpacities.removeAt(index);
     _childEnabledFlags.removeAt(index);
+
+    /*
+      What we have of the tiles underway is indexed by the old layout, so it's thrown away. Whoever is waiting
+      on them is told they're unavailable (in our own thread, before the requests that follow
+      allTilesInvalidated() get there), so that those requests start over rather than join a dead fetch.
+    */
+    const QList<TileKey> abandoned = _pendingTiles.keys();
     this->clearPendingTiles();
+    if (!abandoned.isEmpty())
+        QMetaObject::invokeMethod(this, "abandonTiles", Qt::QueuedConnection, Q_ARG(QList<TileKey>, abandoned));
 
     this->sourceRemoved(index);
     this->sourcesChanged();
@@ -280,13 +396,13 @@ void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
     //If we have no child sources, just print a message about that
     if (_childSources.isEmpty())
     {
-        QImage * toRet = new QImage(this->tileSize(),
-                                    this->tileSize(),
-                                    QImage::Format_ARGB32_Premultiplied);
-        QPainter painter(toRet);
-        painter.fillRect(toRet->rect(),
+        QImage toRet(this->tileSize(),
+                     this->tileSize(),
+                     QImage::Format_ARGB32_Premultiplied);
+        QPainter painter(&toRet);
+        painter.fillRect(toRet.rect(),
                          Qt::white);
-        painter.drawText(toRet->rect(),
+        painter.drawText(toRet.rect(),
                          QString("Composite Source Empty"),
                          QTextOption(Qt::AlignCenter));
         painter.end();
@@ -294,105 +410,263 @@ void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
         return;
     }
 
-    //Allocate space in memory to store the tiles as they come before we composite them.
-    //If we already have a space allocated from a previous un-finished request, clear it and start over
-    QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (_pendingTiles.contains(cacheID))
-    {
-        QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-        foreach(QImage * tile, *tiles)
-            delete tile;
-        tiles->clear();
-    }
-    //Otherwise, create a new space
-    else
-        _pendingTiles.insert(cacheID,new QMap<quint32,QImage *>());
+    //Make room to store the tiles as they come before we composite them. MapTileSource doesn't fetch a
+    //tile twice at once, so if we already have room it's left over from a request that was given up on.
+    _pendingTiles.insert(TileKey(x,y,z), QMap<quint32, MapTile>());
+    _childRequests[TileKey(x,y,z)]++;
 
-    //Request tiles from all of our beautiful children
-    for (int i = 0; i < _childSources.size(); i++)
+    //Request tiles from all of our beautiful children, along with whatever else we're asked for right now
+    _unsentChildRequests.append(TileKey(x,y,z));
+    if (_unsentChildRequests.size() == 1)
+        QMetaObject::invokeMethod(this, "sendChildRequests", Qt::QueuedConnection);
+}
+
+//protected
+void CompositeTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    QMutexLocker lock(_globalMutex);
+
+    //Forget what we have so far and tell the children we've stopped waiting for the rest
+    const TileKey key(x,y,z);
+    if (_pendingTiles.remove(key) == 0)
+        return;
+
+    //The requests we haven't sent yet needn't be sent at all
+    const int requests = _childRequests.take(key) - _unsentChildRequests.removeAll(key);
+    foreach(QSharedPointer<MapTileSource> child, _childSources)
     {
-        QSharedPointer<MapTileSource> child = _childSources.at(i);
-        child->requestTile(x,y,z);
+        for (int i = 0; i < requests; i++)
+            child->cancelTile(x,y,z);
     }
 }
 
 //private slot
-void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+void CompositeTileSource::handleTilesDelivered(QList<MapTile> tiles)
 {
     QMutexLocker lock(_globalMutex);
-    QObject * sender = QObject::sender();
-    MapTileSource * tileSource = qobject_cast<MapTileSource *>(sender);
 
-    //Make sure this slot was called from a signal off a MapTileSource
-    if (!tileSource)
-    {
-        qWarning() << this << "failed MapTileSource cast";
+    //Make sure this is a notification from a MapTileSource that we care about
+    const int tileSourceIndex = this->senderChildIndex();
+    if (tileSourceIndex == -1)
         return;
-    }
 
-    //Make sure this is a notification from a MapTileSource that we care about
-    int tileSourceIndex = -1;
-    for (int i = 0; i < _childSources.size(); i++)
+    foreach(const MapTile& tile, tiles)
     {
-        if (_childSources[i].data() != tileSource)
+        //A child's stand-in doesn't count; we wait for its real tile
+        if (tile.isProvisional())
             continue;
-        tileSourceIndex = i;
-        break;
+        else if (tile.isNull())
+            this->childTileFailed(tileSourceIndex, tile.key());
+        else
+            this->childTileRetrieved(tileSourceIndex, tile);
     }
+}
 
-    if (tileSourceIndex == -1)
-    {
-        qWarning() << this << "received tile from unknown source...";
+//private slot
+void CompositeTileSource::sendChildRequests()
+{
+    QMutexLocker lock(_globalMutex);
+    if (_unsentChildRequests.isEmpty())
         return;
-    }
 
+    //One batch per child, however many tiles are in it
+    foreach(QSharedPointer<MapTileSource> child, _childSources)
+        child->requestTiles(_unsentChildRequests);
+    _unsentChildRequests.clear();
+}
+
+//private slot
+void CompositeTileSource::clearPendingTiles()
+{
+    _pendingTiles.clear();
+    _childRequests.clear();
+    _unsentChildRequests.clear();
+}
+
+//private slot
+void CompositeTileSource::handleChildPrefetched(quint32 x, quint32 y, quint8 z, bool downloaded, quint64 bytes)
+{
+    QMutexLocker lock(_globalMutex);
+    this->childPrefetchFinished(TileKey(x,y,z), downloaded, bytes, false);
+}
+
+//private slot
+void CompositeTileSource::handleChildFailed(quint32 x, quint32 y, quint8 z)
+{
+    QMutexLocker lock(_globalMutex);
+    this->childPrefetchFinished(TileKey(x,y,z), false, 0, true);
+}
 
-    //Make sure that this is a tile we're interested in
-    const QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (!_pendingTiles.contains(cacheID))
+//private slot
+void CompositeTileSource::finishPrefetches()
+{
+    QMutexLocker lock(_globalMutex);
+    QHash<TileKey, PendingPrefetch>::iterator iter = _pendingPrefetches.begin();
+    while (iter != _pendingPrefetches.end())
     {
-        qWarning() << this << "received unknown tile" << x << y << z << "from" << tileSource;
-        return;
+        if (!iter.value().waitingOn.isEmpty())
+        {
+            ++iter;
+            continue;
+        }
+
+        const TileKey key = iter.key();
+        const PendingPrefetch finished = iter.value();
+        iter = _pendingPrefetches.erase(iter);
+        this->reportPrefetch(key, finished);
     }
+}
 
-    //Make sure the tile is non-null
-    QImage * tile = tileSource->getFinishedTile(x,y,z);
-    if (!tile)
+//private slot
+void CompositeTileSource::abandonTiles(QList<TileKey> keys)
+{
+    QMutexLocker lock(_globalMutex);
+    foreach(const TileKey& key, keys)
     {
-        qWarning() << this << "received null tile" << x << y << z << "from" << tileSource;
-        return;
+        if (!_pendingTiles.contains(key))
+            this->abandonFetch(key.x(), key.y(), key.z());
     }
+}
 
-    //qDebug() << this << "Retrieved tile" << x << y << z << "from" << tileSource;
+//private
+void CompositeTileSource::childTileRetrieved(int tileSourceIndex, const MapTile &tile)
+{
+    //Make sure that this is a tile we're interested in. It may have been cancelled on its way here.
+    const TileKey key = tile.key();
+    if (!_pendingTiles.contains(key))
+        return;
 
     /*
       Put the tile into our pendingTiles structure. If it was the last tile we wanted, build
       our finishied product and notify our client. If we've already received this tile because
       it was requested twice for some reason (e.g. crazy zooming in/out) then let's just go ahead
-      and delete the new version and go about our day.
+      and drop the new version and go about our day --- unless what we have is expired or a failure,
+      in which case the new version is the fresh copy we've been waiting for.
     */
-    QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-    if (tiles->contains(tileSourceIndex))
+    QMap<quint32, MapTile>& tiles = _pendingTiles[key];
+    if (tiles.contains(tileSourceIndex))
     {
-        delete tile;
+        const MapTile& existing = tiles.value(tileSourceIndex);
+        if (!existing.isNull() && !existing.isExpired())
+            return;
+    }
+    tiles.insert(tileSourceIndex,tile);
+
+    this->finishTileIfComplete(key);
+}
+
+//private
+void CompositeTileSource::childTileFailed(int tileSourceIndex, const TileKey &key)
+{
+    if (!_pendingTiles.contains(key))
         return;
+
+    /*
+      A layer that failed (or failed recently enough that the child didn't even try, see
+      MapTileSource::negativeCache()) is left out of the composite rather than holding up the others. If
+      the failure was a refresh, the child's stale copy is the best we'll get for now, so we stop waiting for
+      a fresh one.
+    */
+    QMap<quint32, MapTile>& tiles = _pendingTiles[key];
+    const MapTile existing = tiles.value(tileSourceIndex);
+    if (existing.isNull())
+        tiles.insert(tileSourceIndex, MapTile(key, QImage()));
+    else if (existing.isExpired())
+        tiles.insert(tileSourceIndex, MapTile(key, existing.image()));
+    else
+        return;
+
+    this->finishTileIfComplete(key);
+}
+
+//private
+int CompositeTileSource::senderChildIndex() const
+{
+    //Make sure this slot was called from a signal off a MapTileSource
+    MapTileSource * tileSource = qobject_cast<MapTileSource *>(QObject::sender());
+    if (!tileSource)
+    {
+        qWarning() << this << "failed MapTileSource cast";
+        return -1;
+    }
+
+    for (int i = 0; i < _childSources.size(); i++)
+    {
+        if (_childSources[i].data() == tileSource)
+            return i;
     }
-    tiles->insert(tileSourceIndex,tile);
+
+    qWarning() << this << "received tile from unknown source...";
+    return -1;
+}
+
+//private
+void CompositeTileSource::finishTileIfComplete(const TileKey &key)
+{
+    const QMap<quint32, MapTile>& tiles = _pendingTiles[key];
 
     //Still waiting for a tile or two?
-    if (tiles->size() < _childSources.size())
+    if (tiles.size() < _childSources.size())
         return;
 
-    //Time to build the finished composite tile
-    QImage * toRet = new QImage(this->tileSize(),
-                                this->tileSize(),
-                                QImage::Format_ARGB32_Premultiplied);
-    QPainter painter(toRet);
+    //The composite expires when its first layer does
+    QDateTime expireTime;
+    bool anyExpired = false;
+    bool allFailed = true;
+    foreach(const MapTile& childTile, tiles)
+    {
+        if (childTile.isNull())
+            continue;
+        allFailed = false;
+        if (!childTile.expireTime().isNull() && (expireTime.isNull() || childTile.expireTime() < expireTime))
+            expireTime = childTile.expireTime();
+        anyExpired |= childTile.isExpired();
+    }
+
+    //If a layer is expired, its fresh copy is on the way. Keep the others around to composite it with.
+    const QMap<quint32, MapTile> finished = tiles;
+    if (!anyExpired)
+    {
+        _pendingTiles.remove(key);
+        _childRequests.remove(key);
+    }
+
+    /*
+      Nothing to draw. Our client hears about it like it would from any other source, but the failure isn't
+      ours to remember: each child already blocks its own failed tiles, and only for as long as its failures
+      warrant.
+    */
+    if (allFailed)
+    {
+        this->reportTileUnavailable(key.x(),key.y(),key.z());
+        return;
+    }
+
+    //A lone layer is drawn opaque no matter what, so we can pass its tile along without drawing a copy
+    if (finished.size() == 1 && _childEnabledFlags[0])
+    {
+        const MapTile& only = finished.value(0);
+        if (only.image().width() == this->tileSize() && only.image().height() == this->tileSize())
+        {
+            this->prepareNewlyReceivedTile(key.x(),key.y(),key.z(),only.image(),expireTime);
+            return;
+        }
+    }
+
+    //Time to build the finished composite tile. Failed layers are left transparent.
+    QImage toRet(this->tileSize(),
+                 this->tileSize(),
+                 QImage::Format_ARGB32_Premultiplied);
+    toRet.fill(Qt::transparent);
+    QPainter painter(&toRet);
     painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     painter.setOpacity(1.0);
-    for (int i = tiles->size()-1; i >= 0; i--)
+    for (int i = finished.size()-1; i >= 0; i--)
     {
-        QImage * childTile = tiles->value(i);
+        const MapTile& childTile = finished.value(i);
+        if (childTile.isNull())
+            continue;
+
         qreal opacity = _childOpacities[i];
 
         //If there are no other layers, we need to be opaque no matter what
@@ -402,28 +676,54 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
         if (_childEnabledFlags[i] == false)
             opacity = 0.0;
         painter.setOpacity(opacity);
-        painter.drawImage(0,0,*childTile);
-        delete childTile;
+        painter.drawImage(0,0,childTile.image());
     }
-    delete tiles;
-    _pendingTiles.remove(cacheID);
     painter.end();
 
-    this->prepareNewlyReceivedTile(x,y,z,toRet);
+    this->prepareNewlyReceivedTile(key.x(),key.y(),key.z(),toRet,expireTime);
 }
 
-//private slot
-void CompositeTileSource::clearPendingTiles()
+//private
+void CompositeTileSource::connectChildPrefetches(QSharedPointer<MapTileSource> child)
 {
-    QList<QMap<quint32, QImage *> * > pendingTiles = _pendingTiles.values();
-    for (int i = 0; i < pendingTiles.size(); i++)
-    {
-        QMap<quint32, QImage *> * tiles = pendingTiles.at(i);
-        foreach(QImage * tile, tiles->values())
-            delete tile;
-        delete tiles;
-    }
-    _pendingTiles.clear();
+    connect(child.data(),
+            SIGNAL(tilePrefetched(quint32,quint32,quint8,bool,quint64)),
+            this,
+            SLOT(handleChildPrefetched(quint32,quint32,quint8,bool,quint64)));
+
+    //A tile the child couldn't get for a request is one it couldn't get for a prefetch either
+    connect(child.data(),
+            SIGNAL(tileFailed(quint32,quint32,quint8)),
+            this,
+            SLOT(handleChildFailed(quint32,quint32,quint8)));
+}
+
+//private
+void CompositeTileSource::childPrefetchFinished(const TileKey &key, bool downloaded, quint64 bytes, bool failed)
+{
+    //Failures of tiles that were only requested, and repeated reports, are none of our business
+    QHash<TileKey, PendingPrefetch>::iterator iter = _pendingPrefetches.find(key);
+    if (iter == _pendingPrefetches.end() || !iter.value().waitingOn.remove(this->sender()))
+        return;
+
+    iter.value().downloaded |= downloaded;
+    iter.value().bytes += bytes;
+    iter.value().failed |= failed;
+    if (!iter.value().waitingOn.isEmpty())
+        return;
+
+    const PendingPrefetch finished = iter.value();
+    _pendingPrefetches.erase(iter);
+    this->reportPrefetch(key, finished);
+}
+
+//private
+void CompositeTileSource::reportPrefetch(const TileKey &key, const PendingPrefetch &prefetch)
+{
+    if (prefetch.failed)
+        this->tileFailed(key.x(), key.y(), key.z());
+    else
+        this->tilePrefetched(key.x(), key.y(), key.z(), prefetch.downloaded, prefetch.bytes);
 }
 
 //private
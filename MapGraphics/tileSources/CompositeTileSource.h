@@ -9,6 +9,7 @@
 #include <QMap>
 #include <QSharedPointer>
 #include <QMutex>
+#include <QSet>
 
 class MAPGRAPHICSSHARED_EXPORT CompositeTileSource : public MapTileSource
 {
@@ -41,6 +42,47 @@ public:
     //pure-virtual from MapTileSource
     virtual QString tileFileExtension() const;
 
+    /**
+     * @brief Returns our own metrics combined with those of every layer. The tiers of each layer are listed
+     * under the layer's name.
+     *
+     * @return MapTileMetrics
+     */
+    virtual MapTileMetrics metrics() const;
+
+    //virtual from MapTileSource
+    virtual void resetMetrics();
+
+    /**
+     * @brief Orders our own queue and that of every layer around the focus
+     *
+     * @param centerQGS
+     * @param zoomLevel
+     */
+    virtual void setRequestFocus(const QPointF& centerQGS, quint8 zoomLevel);
+
+    /**
+     * @brief We don't cache composites, so the tile is prefetched by every enabled layer instead. Once they
+     * all have it, tilePrefetched is emitted (downloaded if any layer downloaded it, with the bytes of all of
+     * them), or tileFailed if any of them failed.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    virtual void prefetchTile(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief We don't cache composites, so this composites whatever our enabled layers have decoded in RAM
+     * instead. Layers that don't have the tile are left out. Null if none of them have it.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @return MapTile
+     */
+    virtual MapTile peekCachedTile(quint32 x, quint32 y, quint8 z) const;
+
 
     void addSourceTop(QSharedPointer<MapTileSource>, qreal opacity = 1.0);
     void addSourceBottom(QSharedPointer<MapTileSource>, qreal opacity = 1.0);
@@ -59,6 +101,11 @@ protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
+
+    //virtual from MapTileSource
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
     
 signals:
     /*!
@@ -76,18 +123,73 @@ signals:
 public slots:
 
 private slots:
-    void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
+    void handleTilesDelivered(QList<MapTile> tiles);
+
+    //Hands the children the tiles we've been asked for since the last time
+    void sendChildRequests();
+
     void clearPendingTiles();
 
+    //A layer has finished (or failed) a prefetch we passed on to it
+    void handleChildPrefetched(quint32 x, quint32 y, quint8 z, bool downloaded, quint64 bytes);
+    void handleChildFailed(quint32 x, quint32 y, quint8 z);
+
+    //Reports the prefetches that aren't waiting on any layer anymore
+    void finishPrefetches();
+
+    //Ends the fetches that removeSource() gave up on, unless they've been started again since
+    void abandonTiles(QList<TileKey> keys);
+
 private:
+    //A prefetch we've passed on to our layers
+    struct PendingPrefetch
+    {
+        PendingPrefetch() : downloaded(false), bytes(0), failed(false) {}
+
+        //The layers that haven't reported on it yet
+        QSet<QObject *> waitingOn;
+        bool downloaded;
+        quint64 bytes;
+        bool failed;
+    };
+
     void doChildThreading(QSharedPointer<MapTileSource>);
+
+    //Hears about the prefetches we pass on to the child
+    void connectChildPrefetches(QSharedPointer<MapTileSource> child);
+
+    //Counts a layer's report on a prefetch. _globalMutex must be held.
+    void childPrefetchFinished(const TileKey& key, bool downloaded, quint64 bytes, bool failed);
+
+    //Emits tilePrefetched, or tileFailed if a layer failed
+    void reportPrefetch(const TileKey& key, const PendingPrefetch& prefetch);
+
+    //Returns the index of the child that sent the signal we're handling, or -1. _globalMutex must be held.
+    int senderChildIndex() const;
+
+    //Takes a child's tile, or its failure to get one, for a composite. _globalMutex must be held.
+    void childTileRetrieved(int tileSourceIndex, const MapTile& tile);
+    void childTileFailed(int tileSourceIndex, const TileKey& key);
+
+    //Composites the tile and hands it on once every child has answered. _globalMutex must be held.
+    void finishTileIfComplete(const TileKey& key);
+
     QMutex * _globalMutex;
     QList<QSharedPointer<MapTileSource> > _childSources;
     QList<qreal> _childOpacities;
     QList<bool> _childEnabledFlags;
 
-    //A hash of QString:QMap pointer to quint32:QImage pointer
-    QHash<QString, QMap<quint32, QImage *> * > _pendingTiles;
+    //The tiles we've received from each child (by index) for every tile we're compositing
+    QHash<TileKey, QMap<quint32, MapTile> > _pendingTiles;
+
+    //How many times we've asked the children for each pending tile, so that cancelling undoes all of them
+    QHash<TileKey, int> _childRequests;
+
+    //Tiles we have yet to ask the children for, which we do a batch at a time
+    QList<TileKey> _unsentChildRequests;
+
+    //Prefetches our layers are working on
+    QHash<TileKey, PendingPrefetch> _pendingPrefetches;
     
 };
 
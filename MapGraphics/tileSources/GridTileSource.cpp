@@ -79,15 +79,15 @@ void GridTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
     quint64 rightScenePixel = leftScenePixel + this->tileSize();
     quint64 bottomScenePixel = topScenePixel + this->tileSize();
 
-    QImage * toRet = new QImage(this->tileSize(),
-                                this->tileSize(),
-                                QImage::Format_ARGB32_Premultiplied);
+    QImage toRet(this->tileSize(),
+                 this->tileSize(),
+                 QImage::Format_ARGB32_Premultiplied);
     //It is important to fill with transparent first!
-    toRet->fill(qRgba(0,0,0,0));
+    toRet.fill(qRgba(0,0,0,0));
 
-    QPainter painter(toRet);
+    QPainter painter(&toRet);
     painter.setPen(Qt::black);
-    //painter.fillRect(toRet->rect(),QColor(0,0,0,0));
+    //painter.fillRect(toRet.rect(),QColor(0,0,0,0));
 
     qreal everyNDegrees = 10.0;
 
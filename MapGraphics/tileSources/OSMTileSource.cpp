@@ -75,28 +75,61 @@ QString OSMTileSource::tileFileExtension() const
     return _url.getExt();
 }
 
+QString OSMTileSource::cacheIdentity() const
+{
+    //Sources with the same name but different servers mustn't share tiles
+    return this->name() % "|" % _url.getTemplate();
+}
+
 //protected
 void OSMTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    this->sendRequest(TileKey(x,y,z), QByteArray(), QByteArray());
+}
+
+//protected
+void OSMTileSource::refreshTile(quint32 x, quint32 y, quint8 z, const QByteArray &etag, const QByteArray &lastModified)
+{
+    this->sendRequest(TileKey(x,y,z), etag, lastModified);
+}
+
+//protected
+void OSMTileSource::cancelFetch(quint32 x, quint32 y, quint8 z)
+{
+    QNetworkReply * reply = _pendingTiles.take(TileKey(x,y,z));
+    if (reply == 0)
+        return;
+    _pendingReplies.remove(reply);
+
+    //The tile didn't fail, so don't let the aborted reply say it did
+    QObject::disconnect(reply,
+                        SIGNAL(finished()),
+                        this,
+                        SLOT(handleNetworkRequestFinished()));
+    reply->abort();
+    reply->deleteLater();
+}
+
+//private
+void OSMTileSource::sendRequest(const TileKey &key, const QByteArray &etag, const QByteArray &lastModified)
 {
     MapGraphicsNetwork * network = MapGraphicsNetwork::getInstance();
 
     QUrl url;
 
-    url = _url.toQUrl(x,y,z);
-
-    //Use the unique cacheID to see if this tile has already been requested
-    const QString cacheID = this->createCacheID(x,y,z);
-    if (_pendingRequests.contains(cacheID))
-        return;
-    _pendingRequests.insert(cacheID);
+    url = _url.toQUrl(key.x(),key.y(),key.z());
 
-    //Build the request
+    //Build the request. If we have a stale copy, the server can tell us it's still good instead of resending it.
     QNetworkRequest request(url);
-    qDebug() << request.url().toString();
+    if (!etag.isEmpty())
+        request.setRawHeader("If-None-Match", etag);
+    if (!lastModified.isEmpty())
+        request.setRawHeader("If-Modified-Since", lastModified);
 
     //Send the request and setupd a signal to ensure we're notified when it finishes
     QNetworkReply * reply = network->get(request);
-    _pendingReplies.insert(reply,cacheID);
+    _pendingReplies.insert(reply,key);
+    _pendingTiles.insert(key,reply);
 
     connect(reply,
             SIGNAL(finished()),
@@ -128,38 +161,59 @@ void OSMTileSource::handleNetworkRequestFinished()
         return;
     }
 
-    //get the cacheID
-    const QString cacheID = _pendingReplies.take(reply);
+    //get the TileKey
+    const TileKey key = _pendingReplies.take(reply);
+    _pendingTiles.remove(key);
 
-    _pendingRequests.remove(cacheID);
-
-    //If there was a network error, ignore the reply
-    if (reply->error() != QNetworkReply::NoError)
+    //Our stale copy is still good, so there's nothing to download or decode
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status == 304)
     {
-        qDebug() << "ErrorNo: " << reply->error() << "for url: " << reply->url().toString();
-        qDebug() << "Request failed, " << reply->errorString();
-        qDebug() << "Headers:"<<  reply->rawHeaderList() << "content:" << reply->readAll();
+        this->prepareRevalidatedTile(key.x(),key.y(),key.z(), OSMTileSource::replyExpireTime(reply));
         return;
     }
 
-    //Convert the cacheID back into x,y,z tile coordinates
-    quint32 x,y,z;
-    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+    //If there was a network error, remember it so that we don't ask for the tile again right away
+    if (reply->error() != QNetworkReply::NoError)
     {
-        qWarning() << "Failed to convert cacheID" << cacheID << "back to xyz";
+        qDebug() << "ErrorNo: " << reply->error() << "for url: " << reply->url().toString();
+        qDebug() << "Request failed, " << reply->errorString();
+        this->reportTileFailure(key.x(),key.y(),key.z(), OSMTileSource::replyFailureClass(reply));
         return;
     }
 
     QByteArray bytes = reply->readAll();
-    QImage * image = new QImage();
 
-    if (!image->loadFromData(bytes))
-    {
-        delete image;
-        qWarning() << "Failed to make QImage from network bytes";
-        return;
-    }
+    //Notify client of tile retrieval once the bytes are decoded (on the worker pool).
+    //The original bytes go to the disk cache without re-encoding, along with what we need to revalidate them.
+    this->decodeNewlyReceivedTile(key.x(),key.y(),key.z(), bytes, OSMTileSource::replyExpireTime(reply),
+                                  reply->rawHeader("ETag"), reply->rawHeader("Last-Modified"));
+}
+
+//private static
+NegativeTileCache::FailureClass OSMTileSource::replyFailureClass(QNetworkReply *reply)
+{
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+
+    //The tile doesn't exist (e.g., open ocean on some servers), and asking again won't change that
+    if (status == 404 || status == 410)
+        return NegativeTileCache::NotFound;
+
+    //The server is there but struggling, or wants us to slow down
+    if (status >= 500 || status == 429)
+        return NegativeTileCache::ServerError;
+
+    //Other 4xx answers are unlikely to change soon either
+    if (status >= 400)
+        return NegativeTileCache::NotFound;
+
+    //No answer at all
+    return NegativeTileCache::NetworkError;
+}
 
+//private static
+QDateTime OSMTileSource::replyExpireTime(QNetworkReply *reply)
+{
     //Figure out how long the tile should be cached
     QDateTime expireTime;
     if (reply->hasRawHeader("Cache-Control"))
@@ -176,9 +230,7 @@ void OSMTileSource::handleNetworkRequestFinished()
                 expireTime = QDateTime::currentDateTimeUtc().addSecs(delta);
         }
     }
-
-    //Notify client of tile retrieval
-    this->prepareNewlyReceivedTile(x,y,z, image, expireTime);
+    return expireTime;
 }
 
 OSMTileSource::OSMUrl::OSMUrl(QString url)
@@ -190,6 +242,8 @@ OSMTileSource::OSMUrl::OSMUrl(QString url)
     url.replace(QString("{y}")       ,QString("%3"));
     url.replace(QRegExp("{[a-z-]+}."),QString( "" ));
 
+    _template = url;
+
     _scheme = url.section("://",0,0); url = url.section("://",1,-1);
     _host   = url.section("/"  ,0,0); url = url.section("/"  ,1,-1);
     _path   = url.section("?"  ,0,0); url = url.section("?"  ,1,-1);
@@ -247,7 +301,5 @@ const QUrl OSMTileSource::OSMUrl::toQUrl(quint32 x, quint32 y, quint8 z) const
         url.setQueryItems(_query);
     }
 
-qDebug() << url;
-
     return url;
 }
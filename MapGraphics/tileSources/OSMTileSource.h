@@ -3,7 +3,6 @@
 
 #include "MapTileSource.h"
 #include "MapGraphics_global.h"
-#include <QSet>
 #include <QHash>
 #include <QUrl>
 
@@ -43,11 +42,25 @@ public:
 
     virtual QString tileFileExtension() const;
 
+    virtual QString cacheIdentity() const;
+
 protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
 
+    //virtual from MapTileSource
+    virtual void refreshTile(quint32 x,
+                             quint32 y,
+                             quint8 z,
+                             const QByteArray& etag,
+                             const QByteArray& lastModified);
+
+    //virtual from MapTileSource
+    virtual void cancelFetch(quint32 x,
+                             quint32 y,
+                             quint8 z);
+
 private:
     typedef QPair<QString, QString> QueryItem_t;
     typedef QList<QueryItem_t> Query_t;
@@ -64,8 +77,10 @@ private:
         inline const QString &getPath  () const { return _path  ; }
         inline const QString &getExt   () const { return _ext   ; }
         inline const Query_t &getQuery () const { return _query ; }
+        inline const QString &getTemplate() const { return _template; }
 
     private:
+        QString _template;
         QString _scheme;
         QString _host;
         QString _path;
@@ -74,14 +89,22 @@ private:
         int     _port;
     };
 
+    //Sends the request for a tile, made conditional on the validators if there are any
+    void sendRequest(const TileKey& key, const QByteArray& etag, const QByteArray& lastModified);
+
+    //Works out how long the tile in a reply should be cached, or returns a null QDateTime if it doesn't say
+    static QDateTime replyExpireTime(QNetworkReply * reply);
+
+    //Works out why a failed reply failed, which decides how long until the tile is tried again
+    static NegativeTileCache::FailureClass replyFailureClass(QNetworkReply * reply);
+
     QString _name;
     OSMUrl  _url;
 
-    //Set used to ensure a tile with a certain cacheID isn't requested twice
-    QSet<QString> _pendingRequests;
-
-    //Hash used to keep track of what cacheID goes with what reply
-    QHash<QNetworkReply *, QString> _pendingReplies;
+    //Hashes used to keep track of what tile goes with what reply, and the other way around for cancelFetch().
+    //Always updated together.
+    QHash<QNetworkReply *, TileKey> _pendingReplies;
+    QHash<TileKey, QNetworkReply *> _pendingTiles;
 
 signals:
 
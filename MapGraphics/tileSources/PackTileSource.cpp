@@ -0,0 +1,117 @@
+#include "PackTileSource.h"
+
+#include <cmath>
+#include <QFileInfo>
+#include <QStringBuilder>
+#include <QtDebug>
+
+#include "tileCaches/MapTileCache.h"
+#include "tileCaches/MemoryTileCache.h"
+#include "tileCaches/TilePack.h"
+
+const qreal PI = 3.14159265358979323846;
+const qreal deg2rad = PI / 180.0;
+const qreal rad2deg = 180.0 / PI;
+
+PackTileSource::PackTileSource(const QString &packFile, const QString &name) :
+    MapTileSource(), _pack(new TilePack(packFile)), _name(name)
+{
+    if (_name.isEmpty())
+        _name = QFileInfo(packFile).completeBaseName();
+
+    if (!_pack->isValid())
+        qWarning() << "Failed to open tile pack" << packFile << ":" << _pack->errorString();
+
+    //Decoded tiles in RAM in front of the pack. Keeping the encoded bytes anywhere else would only copy it.
+    QSharedPointer<MapTileCache> cache(new MapTileCache());
+    cache->addTier(QSharedPointer<MapTileCacheTier>(new MemoryTileCache(MapTileCacheTier::Decoded)));
+    this->setTileCache(cache);
+    this->setCacheMode(MapTileSource::DiskAndMemCaching);
+}
+
+PackTileSource::~PackTileSource()
+{
+}
+
+bool PackTileSource::isValid() const
+{
+    return _pack->isValid();
+}
+
+QPointF PackTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
+{
+    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
+    const quint16 tileSize = this->tileSize();
+    qreal x = (ll.x()+180.0) * (tilesOnOneEdge*tileSize)/360.0; // coord to pixel!
+    qreal y = (1-(log(tan(PI/4.0+(ll.y()*deg2rad)/2)) /PI)) /2.0  * (tilesOnOneEdge*tileSize);
+
+    return QPoint(int(x), int(y));
+}
+
+QPointF PackTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
+{
+    const qreal tilesOnOneEdge = pow(2.0,zoomLevel);
+    const quint16 tileSize = this->tileSize();
+    qreal longitude = (qgs.x()*(360.0/(tilesOnOneEdge*tileSize)))-180.0;
+    qreal latitude = rad2deg*(atan(sinh((1.0-qgs.y()*(2.0/(tilesOnOneEdge*tileSize)))*PI)));
+
+    return QPointF(longitude, latitude);
+}
+
+quint64 PackTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
+{
+    return pow(4.0,zoomLevel);
+}
+
+quint16 PackTileSource::tileSize() const
+{
+    if (!_pack->isValid() || _pack->tileSize() == 0)
+        return 256;
+    return _pack->tileSize();
+}
+
+quint8 PackTileSource::minZoomLevel(QPointF ll)
+{
+    Q_UNUSED(ll)
+    return _pack->minZoomLevel();
+}
+
+quint8 PackTileSource::maxZoomLevel(QPointF ll)
+{
+    Q_UNUSED(ll)
+    if (!_pack->isValid())
+        return 18;
+    return _pack->maxZoomLevel();
+}
+
+QString PackTileSource::name() const
+{
+    return _name;
+}
+
+QString PackTileSource::tileFileExtension() const
+{
+    if (_pack->format().isEmpty())
+        return "png";
+    return _pack->format();
+}
+
+QString PackTileSource::cacheIdentity() const
+{
+    //Two packs with the same name needn't hold the same tiles
+    return "pack|" % _pack->fileName();
+}
+
+//protected
+void PackTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    const QByteArray bytes = _pack->tile(TileKey(x,y,z));
+    if (bytes.isEmpty())
+    {
+        this->reportTileFailure(x,y,z, NegativeTileCache::NotFound);
+        return;
+    }
+
+    //Decoded on the worker pool, like tiles off the network
+    this->decodeNewlyReceivedTile(x,y,z, bytes);
+}
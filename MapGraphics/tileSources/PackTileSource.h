@@ -0,0 +1,77 @@
+#ifndef PACKTILESOURCE_H
+#define PACKTILESOURCE_H
+
+#include "MapTileSource.h"
+#include "MapGraphics_global.h"
+
+#include <QSharedPointer>
+
+class TilePack;
+
+/**
+ * @brief Serves tiles from a tile pack (see TilePack and the PackBuilder tool), for machines that have no
+ * network at all. The pack is memory-mapped, so serving a tile takes no system calls beyond the page
+ * faults of the first read. Tiles are decoded on the worker pool, and only the decoded ones are cached
+ * (in RAM) --- the pack already is the disk cache. Tiles that aren't in the pack fail as not found.
+ *
+ * Tiles are assumed to be web mercator ("slippy map") tiles, like those of OSMTileSource.
+ */
+class MAPGRAPHICSSHARED_EXPORT PackTileSource : public MapTileSource
+{
+    Q_OBJECT
+public:
+    /**
+     * @brief Opens the pack in packFile. If name is empty, the file name is used.
+     *
+     * @param packFile
+     * @param name
+     */
+    explicit PackTileSource(const QString& packFile, const QString& name = QString());
+    virtual ~PackTileSource();
+
+    /**
+     * @brief Returns true if the pack could be opened. If it couldn't, every tile fails.
+     *
+     * @return bool
+     */
+    bool isValid() const;
+
+    //pure-virtual from MapTileSource
+    virtual QPointF ll2qgs(const QPointF& ll, quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource
+    virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource
+    virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource
+    virtual quint16 tileSize() const;
+
+    //pure-virtual from MapTileSource
+    virtual quint8 minZoomLevel(QPointF ll);
+
+    //pure-virtual from MapTileSource
+    virtual quint8 maxZoomLevel(QPointF ll);
+
+    //pure-virtual from MapTileSource
+    virtual QString name() const;
+
+    //pure-virtual from MapTileSource
+    virtual QString tileFileExtension() const;
+
+    //virtual from MapTileSource
+    virtual QString cacheIdentity() const;
+
+protected:
+    //pure-virtual from MapTileSource
+    virtual void fetchTile(quint32 x,
+                           quint32 y,
+                           quint8 z);
+
+private:
+    QSharedPointer<TilePack> _pack;
+    QString _name;
+};
+
+#endif // PACKTILESOURCE_H
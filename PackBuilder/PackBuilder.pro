@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Builds a tile pack from a MapGraphics disk cache
+#
+#-------------------------------------------------
+
+QT       += core gui network sql
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = PackBuilder
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+#Linkage for MapGraphics shared library
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/release/ -lMapGraphics
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/debug/ -lMapGraphics
+else:unix:!symbian: LIBS += -L$$OUT_PWD/../MapGraphics/ -lMapGraphics
+
+INCLUDEPATH += $$PWD/../MapGraphics
+DEPENDPATH += $$PWD/../MapGraphics
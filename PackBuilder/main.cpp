@@ -0,0 +1,129 @@
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStringList>
+#include <QTextStream>
+
+#include "tileCaches/TilePackBuilder.h"
+
+/*
+ * Builds a tile pack out of a file tree disk cache, i.e. a ~/.MapGraphicsCache/<source> directory laid out
+ * as <z>/<x>/<y>.<extension>. Ship the pack with PackTileSource to serve those tiles without a network.
+ *
+ *  PackBuilder <cache directory> <pack file> [extension] [min zoom] [max zoom] [tile size]
+ */
+
+static bool toZoomLevel(const QString& string, quint8 * zoomLevel)
+{
+    bool ok = false;
+    const uint value = string.toUInt(&ok);
+    if (!ok || value > 31)
+        return false;
+    *zoomLevel = quint8(value);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QTextStream err(stderr);
+    QTextStream out(stdout);
+
+    QStringList args = a.arguments();
+    args.removeFirst();
+    if (args.size() < 2 || args.size() > 6)
+    {
+        err << "Usage: PackBuilder <cache directory> <pack file> [extension] [min zoom] [max zoom] [tile size]\n";
+        return 1;
+    }
+
+    const QDir cacheDir(args.at(0));
+    const QString packFile = args.at(1);
+    const QString extension = args.size() > 2 ? args.at(2) : QString("png");
+    quint8 minZoom = 0;
+    quint8 maxZoom = 31;
+    quint16 tileSize = 256;
+    if ((args.size() > 3 && !toZoomLevel(args.at(3), &minZoom))
+            || (args.size() > 4 && !toZoomLevel(args.at(4), &maxZoom)))
+    {
+        err << "Zoom levels must be between 0 and 31\n";
+        return 1;
+    }
+    if (args.size() > 5)
+    {
+        bool ok = false;
+        tileSize = args.at(5).toUShort(&ok);
+        if (!ok || tileSize == 0)
+        {
+            err << "Bad tile size " << args.at(5) << "\n";
+            return 1;
+        }
+    }
+
+    if (!cacheDir.exists())
+    {
+        err << "No such directory " << cacheDir.path() << "\n";
+        return 1;
+    }
+
+    TilePackBuilder builder(packFile, extension, tileSize);
+    const QString suffix = "." + extension;
+    int skipped = 0;
+
+    //Directory names that aren't numbers (or are out of range) aren't part of the tile tree
+    foreach(const QString& zName, cacheDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+    {
+        quint8 z;
+        if (!toZoomLevel(zName, &z) || z < minZoom || z > maxZoom)
+            continue;
+
+        const QDir zDir(cacheDir.filePath(zName));
+        foreach(const QString& xName, zDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+        {
+            bool ok = false;
+            const quint32 x = xName.toUInt(&ok);
+            if (!ok)
+                continue;
+
+            //Only the tiles themselves. The validators files next to them are of no use offline.
+            const QDir xDir(zDir.filePath(xName));
+            foreach(const QFileInfo& info, xDir.entryInfoList(QStringList("*" + suffix), QDir::Files))
+            {
+                const QString yName = info.fileName().left(info.fileName().size() - suffix.size());
+                const quint32 y = yName.toUInt(&ok);
+                if (!ok)
+                    continue;
+
+                QFile file(info.filePath());
+                if (!file.open(QFile::ReadOnly))
+                {
+                    skipped++;
+                    continue;
+                }
+
+                if (!builder.addTile(TileKey(x,y,z), file.readAll()))
+                {
+                    if (!builder.errorString().isEmpty())
+                    {
+                        err << "Failed to add " << info.filePath() << ": " << builder.errorString() << "\n";
+                        return 1;
+                    }
+                    skipped++;
+                }
+            }
+        }
+    }
+
+    if (!builder.finish())
+    {
+        err << "Failed to write " << packFile << ": " << builder.errorString() << "\n";
+        return 1;
+    }
+
+    out << "Wrote " << builder.tileCount() << " tiles to " << packFile;
+    if (skipped > 0)
+        out << " (skipped " << skipped << ")";
+    out << "\n";
+    return 0;
+}